@@ -0,0 +1,837 @@
+/* GStreamer h264 parser
+ * Copyright (C) 2005 Michal Benes <michal.benes@itonis.tv>
+ *           (C) 2008 Wim Taymans <wim.taymans@gmail.com>
+ *
+ * gsth264nal.c:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include "gsth264nal.h"
+
+#if defined (__GNUC__) && (defined (__i386__) || defined (__x86_64__))
+#  include <immintrin.h>
+#elif defined (__GNUC__) && defined (__aarch64__)
+#  include <arm_neon.h>
+#endif
+
+/* start code search. The scan functions return the offset of the first
+ * 0x000001 prefix that is completely inside @size bytes of @data or @size when
+ * there is none. The scalar version is always available, the vector versions
+ * check 16 or 32 positions at a time and are selected in gst_h264_scan_init
+ * depending on what the CPU supports. */
+guint
+gst_h264_scan_start_code_c (const guint8 * data, guint size)
+{
+  guint i = 0;
+
+  while (i + 2 < size) {
+    if (data[i + 2] > 1)
+      /* no start code can end in or before this byte */
+      i += 3;
+    else if (data[i + 1] != 0)
+      i += 2;
+    else if (data[i] != 0 || data[i + 2] != 1)
+      i++;
+    else
+      return i;
+  }
+  return size;
+}
+
+#if defined (__GNUC__) && (defined (__i386__) || defined (__x86_64__))
+#define HAVE_H264_SCAN_X86 1
+
+__attribute__ ((target ("sse2")))
+static guint
+gst_h264_scan_start_code_sse2 (const guint8 * data, guint size)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i one = _mm_set1_epi8 (1);
+  guint i = 0;
+
+  /* the loads at i + 1 and i + 2 need 18 bytes from i */
+  while (i + 18 <= size) {
+    __m128i v0, v1, v2;
+    guint mask;
+
+    v2 = _mm_loadu_si128 ((const __m128i *) (data + i + 2));
+    /* quick check, a start code needs a 0x00 or 0x01 in the third byte */
+    if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_min_epu8 (v2, one), v2)) == 0) {
+      i += 16;
+      continue;
+    }
+    v0 = _mm_loadu_si128 ((const __m128i *) (data + i));
+    v1 = _mm_loadu_si128 ((const __m128i *) (data + i + 1));
+    mask = _mm_movemask_epi8 (_mm_and_si128 (_mm_and_si128 (_mm_cmpeq_epi8 (v0,
+                    zero), _mm_cmpeq_epi8 (v1, zero)), _mm_cmpeq_epi8 (v2,
+                one)));
+    if (mask)
+      return i + __builtin_ctz (mask);
+    i += 16;
+  }
+  return i + gst_h264_scan_start_code_c (data + i, size - i);
+}
+
+__attribute__ ((target ("avx2")))
+static guint
+gst_h264_scan_start_code_avx2 (const guint8 * data, guint size)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i one = _mm256_set1_epi8 (1);
+  guint i = 0;
+
+  while (i + 34 <= size) {
+    __m256i v0, v1, v2;
+    guint mask;
+
+    v2 = _mm256_loadu_si256 ((const __m256i *) (data + i + 2));
+    if (_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_min_epu8 (v2, one),
+                v2)) == 0) {
+      i += 32;
+      continue;
+    }
+    v0 = _mm256_loadu_si256 ((const __m256i *) (data + i));
+    v1 = _mm256_loadu_si256 ((const __m256i *) (data + i + 1));
+    mask = _mm256_movemask_epi8 (_mm256_and_si256 (_mm256_and_si256
+            (_mm256_cmpeq_epi8 (v0, zero), _mm256_cmpeq_epi8 (v1, zero)),
+            _mm256_cmpeq_epi8 (v2, one)));
+    if (mask)
+      return i + __builtin_ctz (mask);
+    i += 32;
+  }
+  return i + gst_h264_scan_start_code_c (data + i, size - i);
+}
+#endif
+
+#if defined (__GNUC__) && defined (__aarch64__)
+#define HAVE_H264_SCAN_NEON 1
+
+static guint
+gst_h264_scan_start_code_neon (const guint8 * data, guint size)
+{
+  const uint8x16_t one = vdupq_n_u8 (1);
+  guint i = 0;
+
+  while (i + 18 <= size) {
+    uint8x16_t v0, v1, v2, m;
+
+    v0 = vld1q_u8 (data + i);
+    v1 = vld1q_u8 (data + i + 1);
+    v2 = vld1q_u8 (data + i + 2);
+    m = vandq_u8 (vandq_u8 (vceqzq_u8 (v0), vceqzq_u8 (v1)), vceqq_u8 (v2,
+            one));
+    /* NEON has no movemask, locate the match with the scalar code */
+    if (vmaxvq_u8 (m))
+      return i + gst_h264_scan_start_code_c (data + i, 18);
+    i += 16;
+  }
+  return i + gst_h264_scan_start_code_c (data + i, size - i);
+}
+#endif
+
+GstH264ScanFunc gst_h264_scan_start_code = gst_h264_scan_start_code_c;
+
+/* select the fastest start code search, returns its name */
+const gchar *
+gst_h264_scan_init (void)
+{
+  const gchar *impl = "c";
+
+#ifdef HAVE_H264_SCAN_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2")) {
+    gst_h264_scan_start_code = gst_h264_scan_start_code_avx2;
+    impl = "avx2";
+  } else if (__builtin_cpu_supports ("sse2")) {
+    gst_h264_scan_start_code = gst_h264_scan_start_code_sse2;
+    impl = "sse2";
+  }
+#endif
+#ifdef HAVE_H264_SCAN_NEON
+  gst_h264_scan_start_code = gst_h264_scan_start_code_neon;
+  impl = "neon";
+#endif
+
+  return impl;
+}
+
+/* get the size of the sync code at the start of @data, 3 or 4 bytes, or 0
+ * when @data does not start with a sync code */
+guint
+gst_h264_sync_code_size (const guint8 * data, guint size)
+{
+  if (size >= 3 && data[0] == 0 && data[1] == 0) {
+    if (data[2] == 1)
+      return 3;
+    if (size >= 4 && data[2] == 0 && data[3] == 1)
+      return 4;
+  }
+  return 0;
+}
+
+/* find the offsets of all the 3 and 4 byte sync codes in @data in one pass.
+ * Returns the number of sync codes stored in @offsets, at most @max_offsets. */
+guint
+gst_h264_find_sync_codes (const guint8 * data, guint size, guint * offsets,
+    guint max_offsets)
+{
+  guint pos = 0, n = 0;
+
+  while (n < max_offsets && pos < size) {
+    pos += gst_h264_scan_start_code (data + pos, size - pos);
+    if (pos >= size)
+      break;
+    /* include the zero_byte of a 4 byte sync code */
+    if (pos > 0 && data[pos - 1] == 0)
+      offsets[n++] = pos - 1;
+    else
+      offsets[n++] = pos;
+    pos += 3;
+  }
+  return n;
+}
+
+/* TRUE when @header can be the first byte of a NAL unit, the forbidden bit
+ * is 0, the type is specified and nal_ref_idc is allowed for the type */
+gboolean
+gst_h264_nal_header_valid (guint8 header)
+{
+  guint nal_type = header & 0x1f;
+  guint nal_ref_idc = (header >> 5) & 0x3;
+
+  if (header & 0x80)
+    return FALSE;
+
+  switch (nal_type) {
+    case NAL_UNKNOWN:
+      return FALSE;
+    case NAL_SLICE_IDR:
+    case NAL_SPS:
+    case NAL_PPS:
+      return nal_ref_idc != 0;
+    case NAL_SEI:
+    case NAL_AU_DELIMITER:
+    case NAL_SEQ_END:
+    case NAL_STREAM_END:
+    case NAL_FILTER_DATA:
+      return nal_ref_idc == 0;
+    default:
+      /* 24 to 31 are unspecified */
+      return nal_type < 24;
+  }
+}
+
+/* search the first @window offsets of the packetized data in @data for a
+ * NALU size with a valid NAL header that ends the data or is followed by
+ * another one, sizes larger than @max_size are not valid when it is not 0.
+ * Returns the offset of the NALU size or -1 when there is none. */
+gint
+gst_h264_find_nalu (const guint8 * data, guint size, guint nal_length_size,
+    guint max_size, guint window)
+{
+  guint pos, next, i;
+  guint32 nalu_size;
+
+  for (pos = 0; pos < window && size - pos > nal_length_size; pos++) {
+    nalu_size = 0;
+    for (i = 0; i < nal_length_size; i++)
+      nalu_size = (nalu_size << 8) | data[pos + i];
+    if (nalu_size <= 1 || nalu_size > size - pos - nal_length_size ||
+        (max_size > 0 && nalu_size > max_size) ||
+        !gst_h264_nal_header_valid (data[pos + nal_length_size]))
+      continue;
+
+    next = pos + nal_length_size + nalu_size;
+    if (next == size)
+      return pos;
+    if (size - next <= nal_length_size)
+      continue;
+
+    nalu_size = 0;
+    for (i = 0; i < nal_length_size; i++)
+      nalu_size = (nalu_size << 8) | data[next + i];
+    if (nalu_size > 1 && nalu_size <= size - next - nal_length_size &&
+        gst_h264_nal_header_valid (data[next + nal_length_size]))
+      return pos;
+  }
+  return -1;
+}
+
+/* TRUE when one of the bytes in @w is 0 */
+#define GST_NAL_BS_HAS_ZERO_BYTE(w) \
+    ((((w) - G_GUINT64_CONSTANT (0x0101010101010101)) & ~(w) & \
+        G_GUINT64_CONSTANT (0x8080808080808080)) != 0)
+
+/* number of leading zero bits in @x, @x can't be 0 */
+static inline gint
+gst_nal_bs_clz (guint32 x)
+{
+#if defined (__GNUC__)
+  return __builtin_clz (x);
+#else
+  static const guint8 clz4[16] = {
+    4, 3, 2, 2, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0
+  };
+  gint n = 0;
+
+  if (!(x & 0xffff0000)) {
+    n += 16;
+    x <<= 16;
+  }
+  if (!(x & 0xff000000)) {
+    n += 8;
+    x <<= 8;
+  }
+  if (!(x & 0xf0000000)) {
+    n += 4;
+    x <<= 4;
+  }
+  return n + clz4[x >> 28];
+#endif
+}
+
+void
+gst_nal_bs_init (GstNalBs * bs, const guint8 * data, guint size)
+{
+  bs->data = data;
+  bs->end = data + size;
+  bs->head = 0;
+  /* fill with something other than 0 to detect emulation prevention bytes */
+  bs->cache = 0xffffffff;
+}
+
+/* fill the cache with at least 57 bits or until the end of the data */
+static void
+gst_nal_bs_fill (GstNalBs * bs)
+{
+  while (bs->head <= 56) {
+    guint8 byte;
+
+    /* fast path, when the next 8 bytes don't contain a 0 and the last two bytes
+     * in the cache are not 0, there can't be an emulation prevention byte and
+     * we can copy as many bytes as fit in the cache */
+    if (bs->end - bs->data >= 8 && (bs->cache & 0xffff) != 0) {
+      guint64 word;
+
+      memcpy (&word, bs->data, sizeof (word));
+      word = GUINT64_FROM_BE (word);
+      if (!GST_NAL_BS_HAS_ZERO_BYTE (word)) {
+        gint bytes = (64 - bs->head) >> 3;
+
+        if (bytes == 8)
+          bs->cache = word;
+        else
+          bs->cache = (bs->cache << (bytes * 8)) | (word >> (64 - bytes * 8));
+        bs->data += bytes;
+        bs->head += bytes * 8;
+        continue;
+      }
+    }
+
+    if (bs->data >= bs->end)
+      break;
+
+    /* get the byte, this can be an emulation_prevention_three_byte that we need
+     * to ignore. */
+    byte = *bs->data++;
+    if (byte == 0x03 && ((bs->cache & 0xffff) == 0)) {
+      if (bs->data >= bs->end)
+        break;
+      /* next byte goes unconditionally to the cache, even if it's 0x03 */
+      byte = *bs->data++;
+    }
+    /* shift bytes in cache, moving the head bits of the cache left */
+    bs->cache = (bs->cache << 8) | byte;
+    bs->head += 8;
+  }
+}
+
+/* read @n bits, u(n) with @n <= 32 */
+guint32
+gst_nal_bs_read (GstNalBs * bs, guint n)
+{
+  guint32 res;
+
+  if (n == 0)
+    return 0;
+
+  /* fill up the cache if we need to */
+  if (bs->head < n)
+    gst_nal_bs_fill (bs);
+
+  /* we're at the end, can't produce more than head number of bits */
+  if (bs->head < n)
+    n = bs->head;
+  if (n == 0)
+    return 0;
+
+  /* bring the required bits down and truncate */
+  res = bs->cache >> (bs->head - n);
+
+  /* mask out required bits */
+  if (n < 32)
+    res &= (1U << n) - 1;
+
+  bs->head -= n;
+
+  return res;
+}
+
+void
+gst_nal_bs_skip (GstNalBs * bs, guint n)
+{
+  while (n > 32) {
+    gst_nal_bs_read (bs, 32);
+    n -= 32;
+  }
+  gst_nal_bs_read (bs, n);
+}
+
+gboolean
+gst_nal_bs_eos (GstNalBs * bs)
+{
+  return (bs->data >= bs->end) && (bs->head == 0);
+}
+
+/* read unsigned Exp-Golomb code */
+gint
+gst_nal_bs_read_ue (GstNalBs * bs)
+{
+  gint i = 0;
+
+  if (bs->head < 32)
+    gst_nal_bs_fill (bs);
+
+  /* codes with less than 16 leading zeros fit in the next 32 bits, we can
+   * decode them in one go */
+  if (G_LIKELY (bs->head >= 32)) {
+    guint32 word = bs->cache >> (bs->head - 32);
+
+    if (G_LIKELY (word >= 0x10000)) {
+      i = gst_nal_bs_clz (word);
+      bs->head -= 2 * i + 1;
+      return (word >> (31 - 2 * i)) - 1;
+    }
+  }
+
+  /* long codes and codes at the end of the data */
+  while (gst_nal_bs_read (bs, 1) == 0 && !gst_nal_bs_eos (bs) && i < 31)
+    i++;
+
+  return ((1U << i) - 1 + gst_nal_bs_read (bs, i));
+}
+
+/* read signed Exp-Golomb code */
+gint
+gst_nal_bs_read_se (GstNalBs * bs)
+{
+  guint32 code = gst_nal_bs_read_ue (bs);
+
+  return (code & 1) ? (gint) ((code >> 1) + 1) : -(gint) (code >> 1);
+}
+
+/* Table E-1, sample aspect ratios for aspect_ratio_idc 1 to 16 */
+static const guint8 gst_h264_par_table[17][2] = {
+  {0, 0}, {1, 1}, {12, 11}, {10, 11}, {16, 11}, {40, 33}, {24, 11}, {20, 11},
+  {32, 11}, {80, 33}, {18, 11}, {15, 11}, {64, 33}, {160, 99}, {4, 3}, {3, 2},
+  {2, 1}
+};
+
+static void
+gst_h264_skip_scaling_list (GstNalBs * bs, gint size)
+{
+  gint j, last_scale = 8, next_scale = 8;
+
+  for (j = 0; j < size; j++) {
+    if (next_scale != 0)
+      next_scale = (last_scale + gst_nal_bs_read_se (bs) + 256) % 256;
+    last_scale = next_scale == 0 ? last_scale : next_scale;
+  }
+}
+
+/* E.1.2 */
+static void
+gst_h264_read_hrd (GstNalBs * bs, GstH264Sps * sps)
+{
+  gint i, cpb_cnt;
+
+  cpb_cnt = gst_nal_bs_read_ue (bs) + 1;
+  /* bit_rate_scale, cpb_size_scale */
+  gst_nal_bs_skip (bs, 8);
+  for (i = 0; i < cpb_cnt && i < 32; i++) {
+    /* bit_rate_value_minus1, cpb_size_value_minus1, cbr_flag */
+    gst_nal_bs_read_ue (bs);
+    gst_nal_bs_read_ue (bs);
+    gst_nal_bs_skip (bs, 1);
+  }
+  /* initial_cpb_removal_delay_length_minus1 */
+  gst_nal_bs_skip (bs, 5);
+  sps->cpb_removal_delay_length = gst_nal_bs_read (bs, 5) + 1;
+  sps->dpb_output_delay_length = gst_nal_bs_read (bs, 5) + 1;
+  sps->time_offset_length = gst_nal_bs_read (bs, 5);
+  sps->hrd_present = TRUE;
+}
+
+/* E.1.1 */
+static void
+gst_h264_read_vui (GstNalBs * bs, GstH264Sps * sps)
+{
+  gboolean nal_hrd, vcl_hrd;
+
+  /* aspect_ratio_info_present_flag */
+  if (gst_nal_bs_read (bs, 1)) {
+    gint idc = gst_nal_bs_read (bs, 8);
+
+    if (idc == 255) {
+      sps->par_n = gst_nal_bs_read (bs, 16);
+      sps->par_d = gst_nal_bs_read (bs, 16);
+    } else if (idc > 0 && idc < G_N_ELEMENTS (gst_h264_par_table)) {
+      sps->par_n = gst_h264_par_table[idc][0];
+      sps->par_d = gst_h264_par_table[idc][1];
+    }
+  }
+  /* overscan_info_present_flag, overscan_appropriate_flag */
+  if (gst_nal_bs_read (bs, 1))
+    gst_nal_bs_skip (bs, 1);
+  /* video_signal_type_present_flag */
+  if (gst_nal_bs_read (bs, 1)) {
+    /* video_format, video_full_range_flag */
+    gst_nal_bs_skip (bs, 4);
+    /* colour_description_present_flag */
+    if (gst_nal_bs_read (bs, 1))
+      gst_nal_bs_skip (bs, 24);
+  }
+  /* chroma_loc_info_present_flag */
+  if (gst_nal_bs_read (bs, 1)) {
+    gst_nal_bs_read_ue (bs);
+    gst_nal_bs_read_ue (bs);
+  }
+  sps->timing_info_present = gst_nal_bs_read (bs, 1);
+  if (sps->timing_info_present) {
+    sps->num_units_in_tick = gst_nal_bs_read (bs, 32);
+    sps->time_scale = gst_nal_bs_read (bs, 32);
+    sps->fixed_frame_rate = gst_nal_bs_read (bs, 1);
+    if (sps->num_units_in_tick == 0 || sps->time_scale == 0)
+      sps->timing_info_present = FALSE;
+  }
+  nal_hrd = gst_nal_bs_read (bs, 1);
+  if (nal_hrd)
+    gst_h264_read_hrd (bs, sps);
+  vcl_hrd = gst_nal_bs_read (bs, 1);
+  if (vcl_hrd)
+    gst_h264_read_hrd (bs, sps);
+  if (nal_hrd || vcl_hrd)
+    /* low_delay_hrd_flag */
+    gst_nal_bs_skip (bs, 1);
+  sps->pic_struct_present = gst_nal_bs_read (bs, 1);
+  /* bitstream_restriction_flag */
+  if (gst_nal_bs_read (bs, 1)) {
+    /* motion_vectors_over_pic_boundaries_flag */
+    gst_nal_bs_skip (bs, 1);
+    /* max_bytes_per_pic_denom, max_bits_per_mb_denom,
+     * log2_max_mv_length_horizontal, log2_max_mv_length_vertical */
+    gst_nal_bs_read_ue (bs);
+    gst_nal_bs_read_ue (bs);
+    gst_nal_bs_read_ue (bs);
+    gst_nal_bs_read_ue (bs);
+    sps->num_reorder_frames = gst_nal_bs_read_ue (bs);
+    /* max_dec_frame_buffering */
+    gst_nal_bs_read_ue (bs);
+  }
+}
+
+/* 7.3.2.1.1, @data points to the byte after the NAL header */
+gboolean
+gst_h264_read_sps (GstH264Sps * sps, const guint8 * data, guint size)
+{
+  GstNalBs bs;
+  gint i, width_mbs, height_map_units;
+  gint crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+  gint crop_unit_x, crop_unit_y;
+
+  gst_nal_bs_init (&bs, data, size);
+
+  sps->profile_idc = gst_nal_bs_read (&bs, 8);
+  sps->constraint_flags = gst_nal_bs_read (&bs, 8);
+  sps->level_idc = gst_nal_bs_read (&bs, 8);
+  sps->sps_id = gst_nal_bs_read_ue (&bs);
+  if (sps->sps_id < 0 || sps->sps_id >= GST_H264_MAX_SPS)
+    return FALSE;
+
+  sps->chroma_format_idc = 1;
+  switch (sps->profile_idc) {
+    case 100:
+    case 110:
+    case 122:
+    case 244:
+    case 44:
+    case 83:
+    case 86:
+    case 118:
+    case 128:
+      sps->chroma_format_idc = gst_nal_bs_read_ue (&bs);
+      if (sps->chroma_format_idc == 3)
+        sps->separate_colour_plane = gst_nal_bs_read (&bs, 1);
+      /* bit_depth_luma_minus8, bit_depth_chroma_minus8 */
+      gst_nal_bs_read_ue (&bs);
+      gst_nal_bs_read_ue (&bs);
+      /* qpprime_y_zero_transform_bypass_flag */
+      gst_nal_bs_skip (&bs, 1);
+      /* seq_scaling_matrix_present_flag */
+      if (gst_nal_bs_read (&bs, 1)) {
+        for (i = 0; i < (sps->chroma_format_idc != 3 ? 8 : 12); i++) {
+          /* seq_scaling_list_present_flag */
+          if (gst_nal_bs_read (&bs, 1))
+            gst_h264_skip_scaling_list (&bs, i < 6 ? 16 : 64);
+        }
+      }
+      break;
+    default:
+      break;
+  }
+
+  sps->log2_max_frame_num = gst_nal_bs_read_ue (&bs) + 4;
+  sps->poc_type = gst_nal_bs_read_ue (&bs);
+  if (sps->poc_type == 0) {
+    sps->log2_max_poc_lsb = gst_nal_bs_read_ue (&bs) + 4;
+    if (sps->log2_max_poc_lsb < 4)
+      return FALSE;
+  } else if (sps->poc_type == 1) {
+    sps->delta_pic_order_always_zero = gst_nal_bs_read (&bs, 1);
+    sps->offset_for_non_ref_pic = gst_nal_bs_read_se (&bs);
+    sps->offset_for_top_to_bottom_field = gst_nal_bs_read_se (&bs);
+    sps->num_ref_frames_in_poc_cycle = gst_nal_bs_read_ue (&bs);
+    if (sps->num_ref_frames_in_poc_cycle < 0 ||
+        sps->num_ref_frames_in_poc_cycle > 255)
+      return FALSE;
+    for (i = 0; i < sps->num_ref_frames_in_poc_cycle; i++)
+      sps->offset_for_ref_frame[i] = gst_nal_bs_read_se (&bs);
+  }
+  if (sps->log2_max_frame_num < 4 || sps->log2_max_frame_num > 16 ||
+      sps->log2_max_poc_lsb > 16 || sps->poc_type < 0 || sps->poc_type > 2)
+    return FALSE;
+
+  sps->num_ref_frames = gst_nal_bs_read_ue (&bs);
+  /* gaps_in_frame_num_value_allowed_flag */
+  gst_nal_bs_skip (&bs, 1);
+  width_mbs = gst_nal_bs_read_ue (&bs) + 1;
+  height_map_units = gst_nal_bs_read_ue (&bs) + 1;
+  sps->frame_mbs_only = gst_nal_bs_read (&bs, 1);
+  if (!sps->frame_mbs_only)
+    /* mb_adaptive_frame_field_flag */
+    gst_nal_bs_skip (&bs, 1);
+  /* direct_8x8_inference_flag */
+  gst_nal_bs_skip (&bs, 1);
+  /* frame_cropping_flag */
+  if (gst_nal_bs_read (&bs, 1)) {
+    crop_left = gst_nal_bs_read_ue (&bs);
+    crop_right = gst_nal_bs_read_ue (&bs);
+    crop_top = gst_nal_bs_read_ue (&bs);
+    crop_bottom = gst_nal_bs_read_ue (&bs);
+  }
+
+  /* 7.4.2.1.1, the crop units depend on the chroma format */
+  if (sps->chroma_format_idc == 0 || sps->separate_colour_plane) {
+    crop_unit_x = 1;
+    crop_unit_y = 2 - sps->frame_mbs_only;
+  } else {
+    crop_unit_x = sps->chroma_format_idc == 3 ? 1 : 2;
+    crop_unit_y = (sps->chroma_format_idc == 1 ? 2 : 1) *
+        (2 - sps->frame_mbs_only);
+  }
+  sps->width = width_mbs * 16 - crop_unit_x * (crop_left + crop_right);
+  sps->height = (2 - sps->frame_mbs_only) * height_map_units * 16 -
+      crop_unit_y * (crop_top + crop_bottom);
+
+  sps->par_n = sps->par_d = 1;
+  /* vui_parameters_present_flag */
+  if (gst_nal_bs_read (&bs, 1))
+    gst_h264_read_vui (&bs, sps);
+
+  return TRUE;
+}
+
+/* 7.3.2.2, @data points to the byte after the NAL header */
+gboolean
+gst_h264_read_pps (GstH264Pps * pps, const guint8 * data, guint size)
+{
+  GstNalBs bs;
+
+  gst_nal_bs_init (&bs, data, size);
+
+  pps->pps_id = gst_nal_bs_read_ue (&bs);
+  pps->sps_id = gst_nal_bs_read_ue (&bs);
+  if (pps->pps_id < 0 || pps->pps_id >= GST_H264_MAX_PPS ||
+      pps->sps_id < 0 || pps->sps_id >= GST_H264_MAX_SPS)
+    return FALSE;
+  pps->entropy_coding_mode = gst_nal_bs_read (&bs, 1);
+  pps->pic_order_present = gst_nal_bs_read (&bs, 1);
+
+  return TRUE;
+}
+
+/* 7.3.3, parse the slice header fields after pic_parameter_set_id that are
+ * needed to detect the first slice of a picture */
+static void
+gst_h264_read_slice_header (GstH264NalHeader * hdr, GstNalBs * bs,
+    GstH264Sps * sps, GstH264Pps * pps)
+{
+  if (sps->separate_colour_plane)
+    /* colour_plane_id */
+    gst_nal_bs_skip (bs, 2);
+  hdr->frame_num = gst_nal_bs_read (bs, sps->log2_max_frame_num);
+  hdr->field_pic = FALSE;
+  hdr->bottom_field = FALSE;
+  if (!sps->frame_mbs_only) {
+    hdr->field_pic = gst_nal_bs_read (bs, 1);
+    if (hdr->field_pic)
+      hdr->bottom_field = gst_nal_bs_read (bs, 1);
+  }
+  hdr->idr_pic_id = 0;
+  if (hdr->nal_type == NAL_SLICE_IDR)
+    hdr->idr_pic_id = gst_nal_bs_read_ue (bs);
+  hdr->poc_lsb = 0;
+  hdr->delta_poc_bottom = 0;
+  hdr->delta_poc[0] = 0;
+  hdr->delta_poc[1] = 0;
+  if (sps->poc_type == 0) {
+    hdr->poc_lsb = gst_nal_bs_read (bs, sps->log2_max_poc_lsb);
+    if (pps->pic_order_present && !hdr->field_pic)
+      hdr->delta_poc_bottom = gst_nal_bs_read_se (bs);
+  } else if (sps->poc_type == 1 && !sps->delta_pic_order_always_zero) {
+    hdr->delta_poc[0] = gst_nal_bs_read_se (bs);
+    if (pps->pic_order_present && !hdr->field_pic)
+      hdr->delta_poc[1] = gst_nal_bs_read_se (bs);
+  }
+  hdr->poc_type = sps->poc_type;
+}
+
+/* G.7.3.1.1 and H.7.3.1.1, the 3 bytes after the NAL header of prefix and
+ * slice extension NAL units */
+static void
+gst_h264_read_nal_header_ext (GstH264NalHeader * hdr, const guint8 * data,
+    guint size)
+{
+  hdr->svc = FALSE;
+  hdr->ext_idr = FALSE;
+  hdr->anchor_pic = FALSE;
+  hdr->layer_id = 0;
+
+  if (size < 4)
+    return;
+
+  hdr->svc = (data[1] & 0x80) != 0;
+  if (hdr->svc) {
+    /* idr_flag, dependency_id and quality_id */
+    hdr->ext_idr = (data[1] & 0x40) != 0;
+    hdr->layer_id = data[2] & 0x7f;
+  } else {
+    /* non_idr_flag, view_id and anchor_pic_flag */
+    hdr->ext_idr = (data[1] & 0x40) == 0;
+    hdr->layer_id = (data[2] << 2) | (data[3] >> 6);
+    hdr->anchor_pic = (data[3] & 0x04) != 0;
+  }
+}
+
+/* parse the NAL header in @data and for slices the start of the slice header,
+ * for prefix and slice extension NAL units their header extension. The fields
+ * after pic_parameter_set_id are only read when the PPS and its SPS are in
+ * @pps and @sps, indexed on their id. @sps and @pps can be NULL. Returns FALSE
+ * when there is no NAL header. */
+gboolean
+gst_h264_read_nal_header (GstH264NalHeader * hdr, const guint8 * data,
+    guint size, GstH264Sps * const *sps, GstH264Pps * const *pps)
+{
+  GstNalBs bs;
+  GstH264Pps *slice_pps;
+
+  if (size < 1)
+    return FALSE;
+
+  hdr->nal_ref_idc = (data[0] & 0x60) >> 5;
+  hdr->nal_type = (data[0] & 0x1f);
+  hdr->poc_type = -1;
+
+  if (hdr->nal_type == NAL_PREFIX || hdr->nal_type == NAL_SLICE_EXT) {
+    gst_h264_read_nal_header_ext (hdr, data, size);
+    return TRUE;
+  }
+  if (hdr->nal_type < NAL_SLICE || hdr->nal_type > NAL_SLICE_IDR)
+    return TRUE;
+
+  gst_nal_bs_init (&bs, data + 1, size - 1);
+  hdr->first_mb_in_slice = gst_nal_bs_read_ue (&bs);
+  hdr->slice_type = gst_nal_bs_read_ue (&bs);
+  hdr->pps_id = gst_nal_bs_read_ue (&bs);
+
+  if (hdr->nal_type == NAL_SLICE_DPB || hdr->nal_type == NAL_SLICE_DPC ||
+      sps == NULL || pps == NULL || hdr->pps_id < 0 ||
+      hdr->pps_id >= GST_H264_MAX_PPS)
+    return TRUE;
+
+  slice_pps = pps[hdr->pps_id];
+  if (slice_pps && sps[slice_pps->sps_id])
+    gst_h264_read_slice_header (hdr, &bs, sps[slice_pps->sps_id], slice_pps);
+
+  return TRUE;
+}
+
+/* upper bound of the bits left, emulation prevention bytes are counted */
+static inline guint
+gst_nal_bs_bits_left (GstNalBs * bs)
+{
+  return bs->head + 8 * (bs->end - bs->data);
+}
+
+/* 7.3.2.3, call @func for the SEI messages in @data, @data points to the byte
+ * after the NAL header. Returns FALSE when a message is truncated. */
+gboolean
+gst_h264_read_sei (const guint8 * data, guint size, GstH264SeiFunc func,
+    gpointer user_data)
+{
+  GstNalBs bs;
+
+  gst_nal_bs_init (&bs, data, size);
+
+  /* the last byte is the rbsp_trailing_bits */
+  while (gst_nal_bs_bits_left (&bs) > 8) {
+    GstNalBs payload;
+    guint payload_type = 0, payload_size = 0, byte;
+
+    while ((byte = gst_nal_bs_read (&bs, 8)) == 0xff)
+      payload_type += 255;
+    payload_type += byte;
+    while ((byte = gst_nal_bs_read (&bs, 8)) == 0xff)
+      payload_size += 255;
+    payload_size += byte;
+
+    if (payload_size * 8 > gst_nal_bs_bits_left (&bs))
+      return FALSE;
+
+    payload = bs;
+    if (!func (payload_type, &payload, payload_size, user_data))
+      break;
+    gst_nal_bs_skip (&bs, payload_size * 8);
+  }
+  return TRUE;
+}
@@ -0,0 +1,210 @@
+/* GStreamer h264 parser
+ * Copyright (C) 2005 Michal Benes <michal.benes@itonis.tv>
+ *           (C) 2008 Wim Taymans <wim.taymans@gmail.com>
+ *
+ * gsth264nal.h:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef __GST_H264_NAL_H__
+#define __GST_H264_NAL_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* H.264 bitstream parsing without any element state: finding the NAL units
+ * in byte-stream data and reading the NAL unit header, the slice header, the
+ * parameter sets and the SEI messages. Only depends on GLib, the caller keeps
+ * the parameter sets it wants slices to refer to. */
+
+#define GST_H264_MAX_SPS 32
+#define GST_H264_MAX_PPS 256
+
+typedef enum
+{
+  NAL_UNKNOWN = 0,
+  NAL_SLICE = 1,
+  NAL_SLICE_DPA = 2,
+  NAL_SLICE_DPB = 3,
+  NAL_SLICE_DPC = 4,
+  NAL_SLICE_IDR = 5,
+  NAL_SEI = 6,
+  NAL_SPS = 7,
+  NAL_PPS = 8,
+  NAL_AU_DELIMITER = 9,
+  NAL_SEQ_END = 10,
+  NAL_STREAM_END = 11,
+  NAL_FILTER_DATA = 12,
+  NAL_SPS_EXT = 13,
+  /* SVC and MVC, Annex G and H */
+  NAL_PREFIX = 14,
+  NAL_SUBSET_SPS = 15,
+  NAL_SLICE_AUX = 19,
+  NAL_SLICE_EXT = 20
+} GstNalUnitType;
+
+/* SEI payloadType, Annex D */
+typedef enum
+{
+  SEI_BUFFERING_PERIOD = 0,
+  SEI_PIC_TIMING = 1,
+  SEI_USER_DATA_REGISTERED = 4,
+  SEI_USER_DATA_UNREGISTERED = 5,
+  SEI_RECOVERY_POINT = 6
+} GstSeiPayloadType;
+
+typedef struct _GstH264Sps GstH264Sps;
+typedef struct _GstH264Pps GstH264Pps;
+
+/* simple bitstream parser, automatically skips over
+ * emulation_prevention_three_bytes. The unread bits are kept in the low bits
+ * of a 64 bit cache that is refilled a word at a time when the next bytes can't
+ * contain an emulation_prevention_three_byte. */
+typedef struct
+{
+  const guint8 *data;
+  const guint8 *end;
+  gint head;                    /* number of unread bits in the cache */
+  guint64 cache;                /* cached bytes */
+} GstNalBs;
+
+/* parsed sequence and picture parameter sets. The data and size of the raw
+ * NAL unit are not touched by the parsing, the element keeps the NAL unit
+ * there to only parse again when a parameter set with the same id changes. */
+struct _GstH264Sps
+{
+  guint8 *data;
+  guint size;
+
+  gint profile_idc;
+  gint constraint_flags;
+  gint level_idc;
+  gint sps_id;
+  gint chroma_format_idc;
+  gboolean separate_colour_plane;
+  gint log2_max_frame_num;
+  gint poc_type;
+  gint log2_max_poc_lsb;
+  gboolean delta_pic_order_always_zero;
+  gint offset_for_non_ref_pic;
+  gint offset_for_top_to_bottom_field;
+  gint num_ref_frames_in_poc_cycle;
+  gint offset_for_ref_frame[255];
+  gint num_ref_frames;
+  gboolean frame_mbs_only;
+  gint width;
+  gint height;
+
+  /* VUI */
+  gint par_n;
+  gint par_d;
+  gboolean timing_info_present;
+  guint32 num_units_in_tick;
+  guint32 time_scale;
+  gboolean fixed_frame_rate;
+  gboolean hrd_present;
+  gint cpb_removal_delay_length;
+  gint dpb_output_delay_length;
+  gint time_offset_length;
+  gboolean pic_struct_present;
+  gint num_reorder_frames;
+};
+
+struct _GstH264Pps
+{
+  guint8 *data;
+  guint size;
+
+  gint pps_id;
+  gint sps_id;
+  gboolean entropy_coding_mode;
+  gboolean pic_order_present;
+};
+
+/* the NAL unit header and for slices the start of the slice header */
+typedef struct
+{
+  gint nal_type;
+  gint nal_ref_idc;
+
+  gint first_mb_in_slice;
+  gint slice_type;
+  gint pps_id;
+
+  /* the rest of the slice header, only valid when the PPS and SPS of the
+   * slice are known, else poc_type is -1 */
+  gint poc_type;
+  gint frame_num;
+  gboolean field_pic;
+  gboolean bottom_field;
+  gint idr_pic_id;
+  gint poc_lsb;
+  gint delta_poc_bottom;
+  gint delta_poc[2];
+
+  /* the nal_unit_header_svc_extension or nal_unit_header_mvc_extension,
+   * only set for prefix and slice extension NAL units. @ext_idr is the SVC
+   * idr_flag or the inverted MVC non_idr_flag, @layer_id is the SVC
+   * dependency_id and quality_id or the MVC view_id. */
+  gboolean svc;
+  gboolean ext_idr;
+  gboolean anchor_pic;
+  gint layer_id;
+} GstH264NalHeader;
+
+/* called for every SEI message, @payload reads the @payload_size bytes of the
+ * message. Return FALSE to skip the remaining messages. */
+typedef gboolean (*GstH264SeiFunc) (guint payload_type, GstNalBs * payload,
+    guint payload_size, gpointer user_data);
+
+/* start code search, returns the offset of the first 0x000001 prefix in @data
+ * or @size when there is none */
+typedef guint (*GstH264ScanFunc) (const guint8 * data, guint size);
+
+extern GstH264ScanFunc gst_h264_scan_start_code;
+
+const gchar *gst_h264_scan_init (void);
+guint gst_h264_scan_start_code_c (const guint8 * data, guint size);
+guint gst_h264_sync_code_size (const guint8 * data, guint size);
+guint gst_h264_find_sync_codes (const guint8 * data, guint size,
+    guint * offsets, guint max_offsets);
+gboolean gst_h264_nal_header_valid (guint8 header);
+gint gst_h264_find_nalu (const guint8 * data, guint size,
+    guint nal_length_size, guint max_size, guint window);
+
+void gst_nal_bs_init (GstNalBs * bs, const guint8 * data, guint size);
+guint32 gst_nal_bs_read (GstNalBs * bs, guint n);
+void gst_nal_bs_skip (GstNalBs * bs, guint n);
+gboolean gst_nal_bs_eos (GstNalBs * bs);
+gint gst_nal_bs_read_ue (GstNalBs * bs);
+gint gst_nal_bs_read_se (GstNalBs * bs);
+
+gboolean gst_h264_read_nal_header (GstH264NalHeader * hdr,
+    const guint8 * data, guint size, GstH264Sps * const *sps,
+    GstH264Pps * const *pps);
+gboolean gst_h264_read_sps (GstH264Sps * sps, const guint8 * data,
+    guint size);
+gboolean gst_h264_read_pps (GstH264Pps * pps, const guint8 * data,
+    guint size);
+gboolean gst_h264_read_sei (const guint8 * data, guint size,
+    GstH264SeiFunc func, gpointer user_data);
+
+G_END_DECLS
+
+#endif /* __GST_H264_NAL_H__ */
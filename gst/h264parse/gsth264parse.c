@@ -23,11 +23,14 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_CONFIG_H
 #  include "config.h"
 #endif
 
+#include <glib/gstdio.h>
+
 #include "gsth264parse.h"
 
 static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE ("sink",
@@ -38,7 +41,8 @@ static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE ("sink",
 static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
-    GST_STATIC_CAPS ("video/x-h264"));
+    GST_STATIC_CAPS ("video/x-h264, "
+        "stream-format = (string) { byte-stream, avc }"));
 
 GST_DEBUG_CATEGORY_STATIC (h264_parse_debug);
 #define GST_CAT_DEFAULT h264_parse_debug
@@ -51,29 +55,143 @@ GST_ELEMENT_DETAILS ("H264Parse",
     "Wim Taymans <wim.taymans@gmail.com>");
 
 #define DEFAULT_SPLIT_PACKETIZED     FALSE
+#define DEFAULT_OUTPUT               GST_H264_PARSE_OUTPUT_NAL
+#define DEFAULT_CONFIG_INTERVAL      0
+#define DEFAULT_KEYFRAME_ONLY_RATE   4.0
+#define DEFAULT_QOS                  FALSE
+#define DEFAULT_QOS_GOP_LATENESS     GST_SECOND
+#define DEFAULT_INDEX_LOCATION       NULL
+#define DEFAULT_INTERPOLATE          TRUE
+#define DEFAULT_SCAN_THREADS         1
+#define DEFAULT_REVERSE_THREAD       FALSE
+#define DEFAULT_LOW_LATENCY          FALSE
+#define DEFAULT_BATCH_OUTPUT         FALSE
+#define DEFAULT_STATS_INTERVAL       0
+#define DEFAULT_STATS_TIMING         FALSE
+#define DEFAULT_MAX_NAL_SIZE         0
+#define DEFAULT_RESYNC_WINDOW        4096
+#define DEFAULT_RECOVERY_POINTS      FALSE
+#define DEFAULT_PIC_TIMING           FALSE
+#define DEFAULT_EMIT_USER_DATA       FALSE
+#define DEFAULT_STRIP_ENHANCEMENT    FALSE
+
+/* size of the blocks we read in pull mode */
+#define PULL_BLOCK_SIZE              (1024 * 1024)
+
+/* smallest part of a buffer we let a scan thread search for sync codes */
+#define PARALLEL_SCAN_MIN_SIZE       (64 * 1024)
+
+/* how many bytes after the sync code or NALU size we look at to find the
+ * type of a NAL unit */
+#define NAL_HEADER_PEEK_SIZE         32
+
+/* the most NAL units we keep in the reverse playback decode queue, when a GOP
+ * has more we push them out without waiting for the I frame */
+#define MAX_DECODE_QUEUE_LEN         4096
+/* the most unused list links we keep around for reuse */
+#define MAX_NAL_POOL_LEN             MAX_DECODE_QUEUE_LEN
+
+/* most buffers or access units we push in one buffer list */
+#define MAX_BATCH_LEN                256
 
 enum
 {
   PROP_0,
-  PROP_SPLIT_PACKETIZED
+  PROP_SPLIT_PACKETIZED,
+  PROP_OUTPUT,
+  PROP_CONFIG_INTERVAL,
+  PROP_KEYFRAME_ONLY_RATE,
+  PROP_QOS,
+  PROP_QOS_GOP_LATENESS,
+  PROP_INDEX_LOCATION,
+  PROP_INTERPOLATE,
+  PROP_SCAN_THREADS,
+  PROP_REVERSE_THREAD,
+  PROP_LOW_LATENCY,
+  PROP_BATCH_OUTPUT,
+  PROP_STATS,
+  PROP_STATS_INTERVAL,
+  PROP_STATS_TIMING,
+  PROP_MAX_NAL_SIZE,
+  PROP_RESYNC_WINDOW,
+  PROP_RECOVERY_POINTS,
+  PROP_PIC_TIMING,
+  PROP_EMIT_USER_DATA,
+  PROP_STRIP_ENHANCEMENT
+};
+
+enum
+{
+  SIGNAL_USER_DATA,
+  LAST_SIGNAL
+};
+
+static guint gst_h264_parse_signals[LAST_SIGNAL] = { 0 };
+
+#define GST_TYPE_H264_PARSE_OUTPUT (gst_h264_parse_output_get_type ())
+static GType
+gst_h264_parse_output_get_type (void)
+{
+  static GType output_type = 0;
+
+  if (!output_type) {
+    static const GEnumValue output_types[] = {
+      {GST_H264_PARSE_OUTPUT_NAL, "One buffer per NAL unit", "nal"},
+      {GST_H264_PARSE_OUTPUT_AU, "One buffer per access unit", "au"},
+      {0, NULL, NULL},
+    };
+
+    output_type = g_enum_register_static ("GstH264ParseOutput", output_types);
+  }
+  return output_type;
+}
+
+/* a sync code found in the forward bytestream data */
+typedef struct
+{
+  guint64 offset;               /* stream offset of the 0x000001 prefix */
+  guint zeros;                  /* zero bytes in front of the prefix */
+  GstClockTime timestamp;       /* timestamp of the buffer it was found in */
+} GstH264NalStart;
+
+/* part of a buffer a scan thread searches for sync codes, the prefixes that
+ * start before @end are collected in @found */
+struct _GstH264ScanJob
+{
+  const guint8 *data;
+  guint size;
+  guint end;
+  GArray *found;
 };
 
-typedef enum
-{
-  NAL_UNKNOWN = 0,
-  NAL_SLICE = 1,
-  NAL_SLICE_DPA = 2,
-  NAL_SLICE_DPB = 3,
-  NAL_SLICE_DPC = 4,
-  NAL_SLICE_IDR = 5,
-  NAL_SEI = 6,
-  NAL_SPS = 7,
-  NAL_PPS = 8,
-  NAL_AU_DELIMITER = 9,
-  NAL_SEQ_END = 10,
-  NAL_STREAM_END = 11,
-  NAL_FILTER_DATA = 12
-} GstNalUnitType;
+/* an access unit in the keyframe index */
+typedef struct
+{
+  guint64 offset;               /* upstream offset of the access unit */
+  GstClockTime timestamp;
+  guint type;                   /* KEYFRAME_IDR or KEYFRAME_RECOVERY */
+} GstH264Keyframe;
+
+#define KEYFRAME_IDR      1
+/* a picture after a recovery point SEI */
+#define KEYFRAME_RECOVERY 2
+
+/* registered user data of a SEI message at @offset of the NAL units we output,
+ * or a @copy of it when the NAL unit has emulation prevention bytes there */
+typedef struct
+{
+  guint offset;
+  guint size;
+  GstBuffer *copy;
+} GstH264UserData;
+
+/* The keyframe index file next to a raw stream starts with the magic, the
+ * size and the mtime of the stream, followed by fixed size records of
+ * offset (64 bits), timestamp (64 bits), type (32 bits) and 32 unused bits
+ * sorted on offset. All fields are big endian. */
+#define INDEX_FILE_MAGIC     "H264IDX1"
+#define INDEX_HEADER_SIZE    24
+#define INDEX_RECORD_SIZE    24
 
 /* small linked list implementation to allocate the list entry and the data in
  * one go */
@@ -81,22 +199,38 @@ struct _GstNalList
 {
   GstNalList *next;
 
-  gint nal_type;
-  gint nal_ref_idc;
-  gint first_mb_in_slice;
-  gint slice_type;
+  GstH264NalHeader hdr;
   gboolean slice;
   gboolean i_frame;
+  /* a picture after a recovery point SEI with a recovery_frame_cnt of 0, a
+   * random access point like an I frame when recovery-points is on */
+  gboolean recovery;
+  /* a picture after any recovery point SEI, dropping up to the next keyframe
+   * stops there. With gradual decoder refresh the pictures are only correct
+   * recovery_frame_cnt frames later, so they are not keyframes. */
+  gboolean recovery_point;
+
+  /* timestamp and duration of the picture of a slice when we interpolate */
+  GstClockTime pts;
+  GstClockTime duration;
 
   GstBuffer *buffer;
 };
 
+/* unused links are kept in a pool in the element so that reverse playback and
+ * access unit collection don't allocate for every NAL unit */
 static GstNalList *
-gst_nal_list_new (GstBuffer * buffer)
+gst_nal_list_new (GstH264Parse * h264parse, GstBuffer * buffer)
 {
   GstNalList *new_list;
 
-  new_list = g_slice_new0 (GstNalList);
+  if ((new_list = h264parse->nal_pool)) {
+    h264parse->nal_pool = new_list->next;
+    h264parse->nal_pool_len--;
+    memset (new_list, 0, sizeof (GstNalList));
+  } else {
+    new_list = g_slice_new0 (GstNalList);
+  }
   new_list->buffer = buffer;
 
   return new_list;
@@ -111,107 +245,630 @@ gst_nal_list_prepend_link (GstNalList * list, GstNalList * link)
 }
 
 static GstNalList *
-gst_nal_list_delete_head (GstNalList * list)
+gst_nal_list_delete_head (GstH264Parse * h264parse, GstNalList * list)
 {
   if (list) {
     GstNalList *old = list;
 
     list = list->next;
 
-    g_slice_free (GstNalList, old);
+    if (h264parse->nal_pool_len < MAX_NAL_POOL_LEN) {
+      old->next = h264parse->nal_pool;
+      h264parse->nal_pool = old;
+      h264parse->nal_pool_len++;
+    } else {
+      g_slice_free (GstNalList, old);
+    }
   }
   return list;
 }
 
-/* simple bitstream parser, automatically skips over
- * emulation_prevention_three_bytes. */
-typedef struct
+static void
+gst_nal_list_free_pool (GstH264Parse * h264parse)
 {
-  const guint8 *data;
-  const guint8 *end;
-  gint head;                    /* bitpos in the cache of next bit */
-  guint64 cache;                /* cached bytes */
-} GstNalBs;
+  while (h264parse->nal_pool) {
+    GstNalList *old = h264parse->nal_pool;
+
+    h264parse->nal_pool = old->next;
+    g_slice_free (GstNalList, old);
+  }
+  h264parse->nal_pool_len = 0;
+}
 
 static void
-gst_nal_bs_init (GstNalBs * bs, const guint8 * data, guint size)
+gst_h264_sps_free (GstH264Sps * sps)
 {
-  bs->data = data;
-  bs->end = data + size;
-  bs->head = 0;
-  /* fill with something other than 0 to detect emulation prevention bytes */
-  bs->cache = 0xffffffff;
+  g_free (sps->data);
+  g_slice_free (GstH264Sps, sps);
 }
 
-static guint32
-gst_nal_bs_read (GstNalBs * bs, guint n)
+static void
+gst_h264_pps_free (GstH264Pps * pps)
 {
-  guint32 res = 0;
-  gint shift;
+  g_free (pps->data);
+  g_slice_free (GstH264Pps, pps);
+}
 
-  if (n == 0)
-    return res;
+/* store the SPS or PPS in @data, @data points to the NAL header. A parameter
+ * set that is already known is not parsed again. */
+static void
+gst_h264_parse_store_sps (GstH264Parse * h264parse, const guint8 * data,
+    guint size)
+{
+  GstNalBs bs;
+  GstH264Sps *sps;
+  gint sps_id;
+
+  /* skip the NAL header, profile_idc, constraint flags and level_idc */
+  gst_nal_bs_init (&bs, data + 4, size > 4 ? size - 4 : 0);
+  sps_id = gst_nal_bs_read_ue (&bs);
+  if (sps_id < 0 || sps_id >= GST_H264_PARSE_MAX_SPS)
+    goto invalid;
+
+  sps = h264parse->sps[sps_id];
+  if (sps && sps->size == size && memcmp (sps->data, data, size) == 0)
+    return;
+
+  sps = g_slice_new0 (GstH264Sps);
+  if (!gst_h264_read_sps (sps, data + 1, size - 1)) {
+    gst_h264_sps_free (sps);
+    goto invalid;
+  }
+  sps->data = g_memdup (data, size);
+  sps->size = size;
+
+  GST_DEBUG_OBJECT (h264parse, "SPS %d: profile %d, level %d, %dx%d, "
+      "log2_max_frame_num %d, poc_type %d, frame_mbs_only %d, timing %d "
+      "(%u/%u)", sps_id, sps->profile_idc, sps->level_idc, sps->width,
+      sps->height, sps->log2_max_frame_num, sps->poc_type,
+      sps->frame_mbs_only, sps->timing_info_present, sps->time_scale,
+      sps->num_units_in_tick);
+
+  if (h264parse->sps[sps_id])
+    gst_h264_sps_free (h264parse->sps[sps_id]);
+  h264parse->sps[sps_id] = sps;
+  h264parse->have_sps = TRUE;
+  if (h264parse->active_sps_id < 0)
+    h264parse->active_sps_id = sps_id;
+  h264parse->update_caps = TRUE;
+  gst_buffer_replace (&h264parse->codec_nals, NULL);
+
+  /* a tick is a field period, the latency we add is a frame */
+  if (sps->timing_info_present && sps->num_units_in_tick != 0 &&
+      sps->time_scale != 0) {
+    GstClockTime duration;
+    gboolean changed;
+
+    duration = gst_util_uint64_scale (2 * GST_SECOND, sps->num_units_in_tick,
+        sps->time_scale);
+
+    GST_OBJECT_LOCK (h264parse);
+    changed = duration != h264parse->frame_duration;
+    h264parse->frame_duration = duration;
+    GST_OBJECT_UNLOCK (h264parse);
+
+    if (changed) {
+      GST_DEBUG_OBJECT (h264parse, "frame duration %" GST_TIME_FORMAT,
+          GST_TIME_ARGS (duration));
+      gst_element_post_message (GST_ELEMENT_CAST (h264parse),
+          gst_message_new_latency (GST_OBJECT_CAST (h264parse)));
+    }
+  }
+  return;
 
-  /* fill up the cache if we need to */
-  while (bs->head < n) {
-    guint8 byte;
-    gboolean check_three_byte;
+  /* ERRORS */
+invalid:
+  {
+    GST_DEBUG_OBJECT (h264parse, "invalid SPS of size %u", size);
+    return;
+  }
+}
 
-    check_three_byte = TRUE;
-  next_byte:
-    if (bs->data >= bs->end) {
-      /* we're at the end, can't produce more than head number of bits */
-      n = bs->head;
-      break;
+static void
+gst_h264_parse_store_pps (GstH264Parse * h264parse, const guint8 * data,
+    guint size)
+{
+  GstNalBs bs;
+  GstH264Pps *pps;
+  gint pps_id;
+
+  gst_nal_bs_init (&bs, data + 1, size - 1);
+  pps_id = gst_nal_bs_read_ue (&bs);
+  if (pps_id < 0 || pps_id >= GST_H264_PARSE_MAX_PPS)
+    goto invalid;
+
+  pps = h264parse->pps[pps_id];
+  if (pps && pps->size == size && memcmp (pps->data, data, size) == 0)
+    return;
+
+  pps = g_slice_new0 (GstH264Pps);
+  if (!gst_h264_read_pps (pps, data + 1, size - 1)) {
+    gst_h264_pps_free (pps);
+    goto invalid;
+  }
+  pps->data = g_memdup (data, size);
+  pps->size = size;
+
+  GST_DEBUG_OBJECT (h264parse, "PPS %d: SPS %d, pic_order_present %d",
+      pps_id, pps->sps_id, pps->pic_order_present);
+
+  if (h264parse->pps[pps_id])
+    gst_h264_pps_free (h264parse->pps[pps_id]);
+  h264parse->pps[pps_id] = pps;
+  h264parse->have_pps = TRUE;
+  h264parse->update_caps = TRUE;
+  gst_buffer_replace (&h264parse->codec_nals, NULL);
+  return;
+
+  /* ERRORS */
+invalid:
+  {
+    GST_DEBUG_OBJECT (h264parse, "invalid PPS of size %u", size);
+    return;
+  }
+}
+
+/* write the @size of a NAL unit in the @prefix_size bytes at @data */
+static inline void
+gst_h264_parse_write_nalu_size (guint8 * data, guint prefix_size, guint size)
+{
+  guint i;
+
+  for (i = prefix_size; i > 0; i--) {
+    data[i - 1] = size & 0xff;
+    size >>= 8;
+  }
+}
+
+/* get all known parameter sets as one buffer in the output stream format, SPS
+ * first. Bytestream output gets 4 byte sync codes. Packetized output gets the
+ * NALU sizes of the slices around it: the input nal_length_size when we pass
+ * avc through and 4 bytes when we make the avcC from a bytestream. The buffer
+ * is built once and kept until a parameter set or the output format changes.
+ * Returns NULL when there are no parameter sets. */
+static GstBuffer *
+gst_h264_parse_get_codec_nals (GstH264Parse * h264parse)
+{
+  guint8 *data;
+  guint i, size = 0, prefix_size = 4;
+
+  if (h264parse->codec_nals)
+    return h264parse->codec_nals;
+
+  if (h264parse->out_packetized && h264parse->packetized)
+    prefix_size = h264parse->nal_length_size;
+
+  for (i = 0; i < GST_H264_PARSE_MAX_SPS; i++)
+    if (h264parse->sps[i])
+      size += prefix_size + h264parse->sps[i]->size;
+  for (i = 0; i < GST_H264_PARSE_MAX_PPS; i++)
+    if (h264parse->pps[i])
+      size += prefix_size + h264parse->pps[i]->size;
+  if (size == 0)
+    return NULL;
+
+  h264parse->codec_nals = gst_buffer_new_and_alloc (size);
+  data = GST_BUFFER_DATA (h264parse->codec_nals);
+  for (i = 0; i < GST_H264_PARSE_MAX_SPS; i++) {
+    if (h264parse->sps[i]) {
+      gst_h264_parse_write_nalu_size (data, prefix_size,
+          h264parse->out_packetized ? h264parse->sps[i]->size : 1);
+      memcpy (data + prefix_size, h264parse->sps[i]->data,
+          h264parse->sps[i]->size);
+      data += prefix_size + h264parse->sps[i]->size;
+    }
+  }
+  for (i = 0; i < GST_H264_PARSE_MAX_PPS; i++) {
+    if (h264parse->pps[i]) {
+      gst_h264_parse_write_nalu_size (data, prefix_size,
+          h264parse->out_packetized ? h264parse->pps[i]->size : 1);
+      memcpy (data + prefix_size, h264parse->pps[i]->data,
+          h264parse->pps[i]->size);
+      data += prefix_size + h264parse->pps[i]->size;
+    }
+  }
+  GST_DEBUG_OBJECT (h264parse, "made codec NALs of %u bytes with %u byte "
+      "prefixes", size, prefix_size);
+
+  return h264parse->codec_nals;
+}
+
+static void
+gst_h264_parse_clear_params (GstH264Parse * h264parse)
+{
+  gint i;
+
+  for (i = 0; i < GST_H264_PARSE_MAX_SPS; i++) {
+    if (h264parse->sps[i]) {
+      gst_h264_sps_free (h264parse->sps[i]);
+      h264parse->sps[i] = NULL;
+    }
+  }
+  for (i = 0; i < GST_H264_PARSE_MAX_PPS; i++) {
+    if (h264parse->pps[i]) {
+      gst_h264_pps_free (h264parse->pps[i]);
+      h264parse->pps[i] = NULL;
+    }
+  }
+  h264parse->have_sps = FALSE;
+  h264parse->have_pps = FALSE;
+  h264parse->active_sps_id = -1;
+  gst_buffer_replace (&h264parse->codec_nals, NULL);
+
+  GST_OBJECT_LOCK (h264parse);
+  h264parse->frame_duration = GST_CLOCK_TIME_NONE;
+  GST_OBJECT_UNLOCK (h264parse);
+}
+
+/* read the nal_length_size bytes of NALU size in @data */
+static inline guint32
+gst_h264_parse_read_nalu_size (GstH264Parse * h264parse, const guint8 * data)
+{
+  guint32 nalu_size = 0;
+  guint i;
+
+  for (i = 0; i < h264parse->nal_length_size; i++)
+    nalu_size = (nalu_size << 8) | data[i];
+
+  return nalu_size;
+}
+
+/* TRUE when a packetized NAL unit of @nalu_size fits in the @avail bytes
+ * after its size and is not larger than max-nal-size */
+static inline gboolean
+gst_h264_parse_nalu_size_valid (GstH264Parse * h264parse, guint32 nalu_size,
+    guint avail)
+{
+  return nalu_size > 1 && nalu_size <= avail &&
+      (h264parse->max_nal_size == 0 || nalu_size <= h264parse->max_nal_size);
+}
+
+/* convert @buffer from the input to the output stream format. A bytestream
+ * buffer has one NAL unit that starts with a 3 or 4 byte sync code, a
+ * packetized buffer has one or more NAL units prefixed with their size. The
+ * output always has 4 byte sync codes or sizes. 4 byte prefixes are rewritten
+ * in place when we own the only reference to the buffer and its memory,
+ * anything else is converted into one new buffer. Sub-buffers taken from the
+ * adapter share the memory of the input and are never writable. */
+static GstBuffer *
+gst_h264_parse_convert (GstH264Parse * h264parse, GstBuffer * buffer)
+{
+  GstBuffer *outbuf;
+  guint8 *data, *out;
+  guint size, prefix_size, nalu_size, n_nals, out_size;
+
+  data = GST_BUFFER_DATA (buffer);
+  size = GST_BUFFER_SIZE (buffer);
+
+  if (!h264parse->packetized) {
+    /* bytestream to packetized */
+    prefix_size = gst_h264_sync_code_size (data, size);
+    if (prefix_size == 0)
+      return buffer;
+    nalu_size = size - prefix_size;
+
+    if (prefix_size == 4 && gst_buffer_is_writable (buffer)) {
+      GST_WRITE_UINT32_BE (data, nalu_size);
+      return buffer;
+    }
+    outbuf = gst_buffer_new_and_alloc (nalu_size + 4);
+    out = GST_BUFFER_DATA (outbuf);
+    GST_WRITE_UINT32_BE (out, nalu_size);
+    memcpy (out + 4, data + prefix_size, nalu_size);
+  } else {
+    guint offset;
+
+    /* packetized to bytestream */
+    prefix_size = h264parse->nal_length_size;
+    if (prefix_size == 4 && gst_buffer_is_writable (buffer)) {
+      for (offset = 0; offset + prefix_size <= size;
+          offset += prefix_size + nalu_size) {
+        nalu_size = gst_h264_parse_read_nalu_size (h264parse, data + offset);
+        nalu_size = MIN (nalu_size, size - offset - prefix_size);
+        GST_WRITE_UINT32_BE (data + offset, 1);
+      }
+      return buffer;
+    }
+
+    /* count the NAL units to know the size of the new buffer */
+    n_nals = 0;
+    for (offset = 0; offset + prefix_size <= size;
+        offset += prefix_size + nalu_size) {
+      nalu_size = gst_h264_parse_read_nalu_size (h264parse, data + offset);
+      nalu_size = MIN (nalu_size, size - offset - prefix_size);
+      n_nals++;
+    }
+
+    out_size = size + n_nals * (4 - prefix_size);
+    outbuf = gst_buffer_new_and_alloc (out_size);
+    out = GST_BUFFER_DATA (outbuf);
+    for (offset = 0; offset + prefix_size <= size;
+        offset += prefix_size + nalu_size) {
+      nalu_size = gst_h264_parse_read_nalu_size (h264parse, data + offset);
+      nalu_size = MIN (nalu_size, size - offset - prefix_size);
+      GST_WRITE_UINT32_BE (out, 1);
+      memcpy (out + 4, data + offset + prefix_size, nalu_size);
+      out += 4 + nalu_size;
+    }
+    /* trailing bytes that can't hold a NALU size */
+    memcpy (out, data + offset, size - offset);
+    GST_BUFFER_SIZE (outbuf) = out - GST_BUFFER_DATA (outbuf) + size - offset;
+  }
+  gst_buffer_copy_metadata (outbuf, buffer,
+      GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS);
+  gst_buffer_unref (buffer);
+
+  return outbuf;
+}
+
+/* avcC has 5 bits for the number of SPS and 8 bits for the number of PPS */
+#define AVCC_MAX_SPS 31
+#define AVCC_MAX_PPS 255
+
+/* make avcC codec_data from the known parameter sets, when converting from
+ * bytestream we always use 4 byte NALU sizes */
+static GstBuffer *
+gst_h264_parse_make_avcc (GstH264Parse * h264parse)
+{
+  GstBuffer *avcc;
+  GstH264Sps *first = NULL;
+  guint8 *data;
+  guint i, size = 7, num_sps = 0, num_pps = 0;
+
+  for (i = 0; i < GST_H264_PARSE_MAX_SPS; i++) {
+    if (h264parse->sps[i]) {
+      if (num_sps == AVCC_MAX_SPS) {
+        GST_WARNING_OBJECT (h264parse, "too many SPS for avcC, skipping %u", i);
+        continue;
+      }
+      if (first == NULL)
+        first = h264parse->sps[i];
+      size += 2 + h264parse->sps[i]->size;
+      num_sps++;
+    }
+  }
+  for (i = 0; i < GST_H264_PARSE_MAX_PPS; i++) {
+    if (h264parse->pps[i]) {
+      if (num_pps == AVCC_MAX_PPS) {
+        GST_WARNING_OBJECT (h264parse, "too many PPS for avcC, skipping %u", i);
+        continue;
+      }
+      size += 2 + h264parse->pps[i]->size;
+      num_pps++;
     }
-    /* get the byte, this can be an emulation_prevention_three_byte that we need
-     * to ignore. */
-    byte = *bs->data++;
-    if (check_three_byte && byte == 0x03 && ((bs->cache & 0xffff) == 0)) {
-      /* next byte goes unconditionally to the cache, even if it's 0x03 */
-      check_three_byte = FALSE;
-      goto next_byte;
+  }
+  if (num_sps == 0 || num_pps == 0)
+    return NULL;
+
+  avcc = gst_buffer_new_and_alloc (size);
+  data = GST_BUFFER_DATA (avcc);
+  /* version, profile, profile_compat, level, from the NAL header on */
+  data[0] = 1;
+  data[1] = first->data[1];
+  data[2] = first->data[2];
+  data[3] = first->data[3];
+  /* 6 bits reserved | lengthSizeMinusOne */
+  data[4] = 0xfc | 3;
+  /* 3 bits reserved | numOfSequenceParameterSets */
+  data[5] = 0xe0 | num_sps;
+  data += 6;
+  for (i = 0; i < GST_H264_PARSE_MAX_SPS && num_sps > 0; i++) {
+    if (h264parse->sps[i]) {
+      GST_WRITE_UINT16_BE (data, h264parse->sps[i]->size);
+      memcpy (data + 2, h264parse->sps[i]->data, h264parse->sps[i]->size);
+      data += 2 + h264parse->sps[i]->size;
+      num_sps--;
+    }
+  }
+  *data++ = num_pps;
+  for (i = 0; i < GST_H264_PARSE_MAX_PPS && num_pps > 0; i++) {
+    if (h264parse->pps[i]) {
+      GST_WRITE_UINT16_BE (data, h264parse->pps[i]->size);
+      memcpy (data + 2, h264parse->pps[i]->data, h264parse->pps[i]->size);
+      data += 2 + h264parse->pps[i]->size;
+      num_pps--;
     }
-    /* shift bytes in cache, moving the head bits of the cache left */
-    bs->cache = (bs->cache << 8) | byte;
-    bs->head += 8;
   }
 
-  /* bring the required bits down and truncate */
-  if ((shift = bs->head - n) > 0)
-    res = bs->cache >> shift;
+  return avcc;
+}
+
+/* set caps on the srcpad based on @caps with the output stream format */
+static gboolean
+gst_h264_parse_set_src_caps (GstH264Parse * h264parse, GstCaps * caps)
+{
+  GstStructure *str;
+  gboolean res;
+
+  if (caps)
+    caps = gst_caps_copy (caps);
   else
-    res = bs->cache;
+    caps = gst_caps_new_simple ("video/x-h264", NULL);
+  str = gst_caps_get_structure (caps, 0);
 
-  /* mask out required bits */
-  if (n < 32)
-    res &= (1 << n) - 1;
+  if (h264parse->out_packetized) {
+    gst_structure_set (str, "stream-format", G_TYPE_STRING, "avc", NULL);
+    if (!h264parse->packetized) {
+      GstBuffer *avcc;
+
+      /* we make the codec_data when we have seen the parameter sets */
+      gst_structure_remove_field (str, "codec_data");
+      if ((avcc = gst_h264_parse_make_avcc (h264parse))) {
+        gst_structure_set (str, "codec_data", GST_TYPE_BUFFER, avcc, NULL);
+        gst_buffer_unref (avcc);
+      }
+    }
+  } else {
+    gst_structure_set (str, "stream-format", G_TYPE_STRING, "byte-stream",
+        NULL);
+    gst_structure_remove_field (str, "codec_data");
+  }
 
-  bs->head = shift;
+  GST_DEBUG_OBJECT (h264parse, "setting caps %" GST_PTR_FORMAT, caps);
+  res = gst_pad_set_caps (h264parse->srcpad, caps);
+  gst_caps_unref (caps);
 
   return res;
 }
 
+/* pick the output stream format, we output what downstream wants and keep the
+ * input format when downstream accepts both. @caps are the sink caps or NULL
+ * when upstream didn't set caps. */
 static gboolean
-gst_nal_bs_eos (GstNalBs * bs)
+gst_h264_parse_negotiate (GstH264Parse * h264parse, GstCaps * caps)
+{
+  GstCaps *allowed;
+
+  h264parse->out_packetized = h264parse->packetized;
+
+  allowed = gst_pad_get_allowed_caps (h264parse->srcpad);
+  if (allowed) {
+    if (!gst_caps_is_empty (allowed) && !gst_caps_is_any (allowed)) {
+      const gchar *format;
+
+      format = gst_structure_get_string (gst_caps_get_structure (allowed, 0),
+          "stream-format");
+      if (format && !strcmp (format, "avc"))
+        h264parse->out_packetized = TRUE;
+      else if (format && !strcmp (format, "byte-stream"))
+        h264parse->out_packetized = FALSE;
+    }
+    gst_caps_unref (allowed);
+  }
+
+  GST_DEBUG_OBJECT (h264parse, "input %s, output %s",
+      h264parse->packetized ? "avc" : "byte-stream",
+      h264parse->out_packetized ? "avc" : "byte-stream");
+
+  h264parse->update_caps = FALSE;
+  h264parse->push_codec_nals = h264parse->packetized &&
+      !h264parse->out_packetized;
+
+  /* build the parameter sets in the output format now, we need them for every
+   * keyframe when converting or inserting them */
+  gst_buffer_replace (&h264parse->codec_nals, NULL);
+  gst_h264_parse_get_codec_nals (h264parse);
+
+  return gst_h264_parse_set_src_caps (h264parse, caps);
+}
+
+GST_BOILERPLATE (GstH264Parse, gst_h264_parse, GstElement, GST_TYPE_ELEMENT);
+
+/* a snapshot of the statistics, counters that are updated while we read
+ * them can be one ahead of the others */
+static GstStructure *
+gst_h264_parse_stats_structure (GstH264Parse * h264parse)
 {
-  return (bs->data >= bs->end) && (bs->head == 0);
+  GstH264ParseStats *stats = &h264parse->stats;
+  GstStructure *s;
+  guint64 nals = 0, bytes, nal_bytes, corrupt_bytes;
+  GstClockTime scan_time, push_time;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (stats->nals); i++)
+    nals += (guint) g_atomic_int_get (&stats->nals[i]);
+
+  GST_OBJECT_LOCK (h264parse);
+  bytes = stats->bytes;
+  nal_bytes = stats->nal_bytes;
+  corrupt_bytes = stats->corrupt_bytes;
+  scan_time = stats->scan_time;
+  push_time = stats->push_time;
+  GST_OBJECT_UNLOCK (h264parse);
+
+  s = gst_structure_new ("h264parse-stats",
+      "bytes", G_TYPE_UINT64, bytes,
+      "nal-units", G_TYPE_UINT64, nals,
+      "access-units", G_TYPE_UINT, (guint) g_atomic_int_get (&stats->aus),
+      "idr-frames", G_TYPE_UINT, (guint) g_atomic_int_get (&stats->idrs),
+      "dropped-nal-units", G_TYPE_UINT,
+      (guint) g_atomic_int_get (&stats->dropped_nals),
+      "dropped-access-units", G_TYPE_UINT,
+      (guint) g_atomic_int_get (&stats->dropped_aus),
+      "dropped-gops", G_TYPE_UINT,
+      (guint) g_atomic_int_get (&stats->dropped_gops),
+      "average-nal-size", G_TYPE_UINT, nals ?
+      (guint) (nal_bytes / nals) : 0,
+      "max-nal-size", G_TYPE_UINT,
+      (guint) g_atomic_int_get (&stats->max_nal_size),
+      "adapter-high-water", G_TYPE_UINT,
+      (guint) g_atomic_int_get (&stats->adapter_max),
+      "scan-time", G_TYPE_UINT64, scan_time,
+      "push-time", G_TYPE_UINT64, push_time,
+      "size-fixes", G_TYPE_UINT, (guint) g_atomic_int_get (&stats->size_fixes),
+      "resyncs", G_TYPE_UINT, (guint) g_atomic_int_get (&stats->resyncs),
+      "corrupt-bytes", G_TYPE_UINT64, corrupt_bytes,
+      "stripped-nal-units", G_TYPE_UINT,
+      (guint) g_atomic_int_get (&stats->stripped_nals), NULL);
+
+  /* the counts of the NAL unit types we saw */
+  for (i = 0; i < G_N_ELEMENTS (stats->nals); i++) {
+    gchar name[16];
+    guint count = g_atomic_int_get (&stats->nals[i]);
+
+    if (count == 0)
+      continue;
+    g_snprintf (name, sizeof (name), "nal-type-%u", i);
+    gst_structure_set (s, name, G_TYPE_UINT, count, NULL);
+  }
+  return s;
 }
 
-/* read unsigned Exp-Golomb code */
-static gint
-gst_nal_bs_read_ue (GstNalBs * bs)
+/* add @value to the 64 bit @total of the statistics, they can't be updated
+ * atomically on all platforms */
+static inline void
+gst_h264_parse_stats_add (GstH264Parse * h264parse, guint64 * total,
+    guint64 value)
 {
-  gint i = 0;
+  GST_OBJECT_LOCK (h264parse);
+  *total += value;
+  GST_OBJECT_UNLOCK (h264parse);
+}
 
-  while (gst_nal_bs_read (bs, 1) == 0 && !gst_nal_bs_eos (bs) && i < 32)
-    i++;
+static inline void
+gst_h264_parse_count_nal (GstH264Parse * h264parse, GstNalList * nal,
+    guint size)
+{
+  GstH264ParseStats *stats = &h264parse->stats;
 
-  return ((1 << i) - 1 + gst_nal_bs_read (bs, i));
+  g_atomic_int_add (&stats->nals[nal->hdr.nal_type & 0x1f], 1);
+  gst_h264_parse_stats_add (h264parse, &stats->nal_bytes, size);
+  if (size > (guint) stats->max_nal_size)
+    g_atomic_int_set (&stats->max_nal_size, size);
 }
 
+/* post the statistics when stats-interval passed since the last time */
+static void
+gst_h264_parse_post_stats (GstH264Parse * h264parse)
+{
+  GstClockTime now;
+  gboolean post = FALSE;
+
+  now = gst_util_get_timestamp ();
+  GST_OBJECT_LOCK (h264parse);
+  if (!GST_CLOCK_TIME_IS_VALID (h264parse->stats_last))
+    h264parse->stats_last = now;
+  else if (now - h264parse->stats_last >= h264parse->stats_interval) {
+    h264parse->stats_last = now;
+    post = TRUE;
+  }
+  GST_OBJECT_UNLOCK (h264parse);
+
+  if (post) {
+    gst_element_post_message (GST_ELEMENT_CAST (h264parse),
+        gst_message_new_element (GST_OBJECT_CAST (h264parse),
+            gst_h264_parse_stats_structure (h264parse)));
+  }
+}
 
-GST_BOILERPLATE (GstH264Parse, gst_h264_parse, GstElement, GST_TYPE_ELEMENT);
+static void
+gst_h264_parse_reset_stats (GstH264Parse * h264parse)
+{
+  GST_OBJECT_LOCK (h264parse);
+  memset (&h264parse->stats, 0, sizeof (h264parse->stats));
+  h264parse->stats_last = GST_CLOCK_TIME_NONE;
+  GST_OBJECT_UNLOCK (h264parse);
+}
 
 static void gst_h264_parse_finalize (GObject * object);
 static void gst_h264_parse_set_property (GObject * object, guint prop_id,
@@ -220,9 +877,18 @@ static void gst_h264_parse_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
 
 static GstFlowReturn gst_h264_parse_chain (GstPad * pad, GstBuffer * buf);
+static gboolean gst_h264_parse_sink_activate (GstPad * sinkpad);
+static gboolean gst_h264_parse_sink_activate_pull (GstPad * sinkpad,
+    gboolean active);
+static void gst_h264_parse_loop (GstPad * pad);
 static gboolean gst_h264_parse_sink_event (GstPad * pad, GstEvent * event);
+static gboolean gst_h264_parse_src_event (GstPad * pad, GstEvent * event);
+static gboolean gst_h264_parse_src_query (GstPad * pad, GstQuery * query);
 static gboolean gst_h264_parse_sink_setcaps (GstPad * pad, GstCaps * caps);
 
+static void gst_h264_parse_set_index (GstElement * element, GstIndex * index);
+static GstIndex *gst_h264_parse_get_index (GstElement * element);
+
 static GstStateChangeReturn gst_h264_parse_change_state (GstElement * element,
     GstStateChange transition);
 
@@ -236,8 +902,6 @@ gst_h264_parse_base_init (gpointer g_class)
   gst_element_class_add_pad_template (gstelement_class,
       gst_static_pad_template_get (&sinktemplate));
   gst_element_class_set_details (gstelement_class, &gst_h264_parse_details);
-
-  GST_DEBUG_CATEGORY_INIT (h264_parse_debug, "h264parse", 0, "h264 parser");
 }
 
 static void
@@ -257,8 +921,130 @@ gst_h264_parse_class_init (GstH264ParseClass * klass)
       g_param_spec_boolean ("split-packetized", "Split packetized",
           "Split NAL units of packetized streams", DEFAULT_SPLIT_PACKETIZED,
           G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_OUTPUT,
+      g_param_spec_enum ("output", "Output",
+          "Output one buffer per NAL unit or one per access unit (frame)",
+          GST_TYPE_H264_PARSE_OUTPUT, DEFAULT_OUTPUT, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_CONFIG_INTERVAL,
+      g_param_spec_int ("config-interval", "Config interval",
+          "Send SPS and PPS in front of an IDR frame when this many seconds "
+          "passed since they were last sent (-1 = every IDR frame, "
+          "0 = only what is in the stream)", -1, 3600,
+          DEFAULT_CONFIG_INTERVAL, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_KEYFRAME_ONLY_RATE,
+      g_param_spec_double ("keyframe-only-rate", "Keyframe only rate",
+          "Only output keyframes when the absolute playback rate is above "
+          "this value, keyframes are also the only output after a seek with "
+          "the SKIP flag (0 = only for SKIP seeks)", 0.0, G_MAXDOUBLE,
+          DEFAULT_KEYFRAME_ONLY_RATE, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_QOS,
+      g_param_spec_boolean ("qos", "QoS",
+          "Drop non-reference frames when downstream is late", DEFAULT_QOS,
+          G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_QOS_GOP_LATENESS,
+      g_param_spec_uint64 ("qos-gop-lateness", "QoS GOP lateness",
+          "Lateness in nanoseconds above which all frames up to the next "
+          "keyframe or recovery point are dropped "
+          "(GST_CLOCK_TIME_NONE = never)", 0, G_MAXUINT64,
+          DEFAULT_QOS_GOP_LATENESS, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_INDEX_LOCATION,
+      g_param_spec_string ("index-location", "Index location",
+          "Keyframe index file of the stream upstream reads, it is used for "
+          "seeking when it matches the stream and updated at EOS "
+          "(NULL = no index file)", DEFAULT_INDEX_LOCATION,
+          G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_INTERPOLATE,
+      g_param_spec_boolean ("interpolate-timestamps", "Interpolate timestamps",
+          "Compute the timestamp and duration of pictures without an upstream "
+          "timestamp from the VUI timing and the picture order count",
+          DEFAULT_INTERPOLATE, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_SCAN_THREADS,
+      g_param_spec_uint ("scan-threads", "Scan threads",
+          "Number of threads that search the blocks read in pull mode for "
+          "sync codes, takes effect on activation", 1, 64,
+          DEFAULT_SCAN_THREADS, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_REVERSE_THREAD,
+      g_param_spec_boolean ("reverse-thread", "Reverse thread",
+          "Split the next GOP chunk in reverse playback on a thread while "
+          "the current one is pushed, the output of a chunk is delayed until "
+          "the next one starts", DEFAULT_REVERSE_THREAD, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_LOW_LATENCY,
+      g_param_spec_boolean ("low-latency", "Low latency",
+          "Input buffers end on NAL unit boundaries and a buffer that ends "
+          "with a slice ends the access unit (like from an RTP depayloader "
+          "that pushes on the marker bit), output without waiting for the "
+          "next sync code or access unit", DEFAULT_LOW_LATENCY,
+          G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_BATCH_OUTPUT,
+      g_param_spec_boolean ("batch-output", "Batch output",
+          "Push the NAL units or access units of an input buffer in one "
+          "buffer list", DEFAULT_BATCH_OUTPUT, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics",
+          "Parsing statistics of the current stream, access-units and "
+          "idr-frames are only counted with output=au", GST_TYPE_STRUCTURE,
+          G_PARAM_READABLE));
+  g_object_class_install_property (gobject_class, PROP_STATS_INTERVAL,
+      g_param_spec_uint64 ("stats-interval", "Statistics interval",
+          "Post the statistics in an element message when this many "
+          "nanoseconds passed since the last one (0 = never)", 0, G_MAXUINT64,
+          DEFAULT_STATS_INTERVAL, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_STATS_TIMING,
+      g_param_spec_boolean ("stats-timing", "Statistics timing",
+          "Measure the time spent scanning for sync codes and pushing "
+          "downstream for the statistics", DEFAULT_STATS_TIMING,
+          G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_MAX_NAL_SIZE,
+      g_param_spec_uint ("max-nal-size", "Max NAL size",
+          "Largest NAL unit in bytes, bytestream data without the next sync "
+          "code after this many bytes and larger packetized NALU sizes are "
+          "dropped as corrupt data, the pictures after it up to the next "
+          "keyframe or recovery point as well (0 = unlimited)",
+          0, G_MAXUINT, DEFAULT_MAX_NAL_SIZE, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_RESYNC_WINDOW,
+      g_param_spec_uint ("resync-window", "Resync window",
+          "Number of bytes after an invalid packetized NALU size that are "
+          "searched for the next valid one", 0, G_MAXUINT,
+          DEFAULT_RESYNC_WINDOW, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_RECOVERY_POINTS,
+      g_param_spec_boolean ("recovery-points", "Recovery points",
+          "Use the pictures after recovery point SEI messages with a "
+          "recovery_frame_cnt of 0 as keyframes for open GOP streams, gradual "
+          "decoder refresh points stay delta units", DEFAULT_RECOVERY_POINTS,
+          G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_PIC_TIMING,
+      g_param_spec_boolean ("pic-timing", "Picture timing",
+          "Interpolate timestamps and durations with the pic_timing SEI "
+          "messages when the stream has them", DEFAULT_PIC_TIMING,
+          G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_EMIT_USER_DATA,
+      g_param_spec_boolean ("emit-user-data", "Emit user data",
+          "Emit the user-data signal for registered user data SEI messages",
+          DEFAULT_EMIT_USER_DATA, G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class, PROP_STRIP_ENHANCEMENT,
+      g_param_spec_boolean ("strip-enhancement", "Strip enhancement",
+          "Drop the prefix, subset SPS and slice extension NAL units of SVC "
+          "and MVC streams, only the base layer or view is output",
+          DEFAULT_STRIP_ENHANCEMENT, G_PARAM_READWRITE));
+
+  /**
+   * GstH264Parse::user-data:
+   * @h264parse: the parser
+   * @data: the payload of a registered user data SEI message, starting with
+   *     the itu_t_t35_country_code, with the timestamp of its NAL unit
+   *
+   * Emitted from the streaming thread when emit-user-data is enabled, for
+   * closed captions and other side data. @data is a subbuffer of the output
+   * NAL unit unless the payload has emulation prevention bytes.
+   */
+  gst_h264_parse_signals[SIGNAL_USER_DATA] =
+      g_signal_new ("user-data", G_TYPE_FROM_CLASS (klass), G_SIGNAL_RUN_LAST,
+      0, NULL, NULL, g_cclosure_marshal_VOID__BOXED, G_TYPE_NONE, 1,
+      GST_TYPE_BUFFER);
 
   gstelement_class->change_state = gst_h264_parse_change_state;
+  gstelement_class->set_index = GST_DEBUG_FUNCPTR (gst_h264_parse_set_index);
+  gstelement_class->get_index = GST_DEBUG_FUNCPTR (gst_h264_parse_get_index);
 }
 
 static void
@@ -267,6 +1053,10 @@ gst_h264_parse_init (GstH264Parse * h264parse, GstH264ParseClass * g_class)
   h264parse->sinkpad = gst_pad_new_from_static_template (&sinktemplate, "sink");
   gst_pad_set_chain_function (h264parse->sinkpad,
       GST_DEBUG_FUNCPTR (gst_h264_parse_chain));
+  gst_pad_set_activate_function (h264parse->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_h264_parse_sink_activate));
+  gst_pad_set_activatepull_function (h264parse->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_h264_parse_sink_activate_pull));
   gst_pad_set_event_function (h264parse->sinkpad,
       GST_DEBUG_FUNCPTR (gst_h264_parse_sink_event));
   gst_pad_set_setcaps_function (h264parse->sinkpad,
@@ -274,10 +1064,64 @@ gst_h264_parse_init (GstH264Parse * h264parse, GstH264ParseClass * g_class)
   gst_element_add_pad (GST_ELEMENT (h264parse), h264parse->sinkpad);
 
   h264parse->srcpad = gst_pad_new_from_static_template (&srctemplate, "src");
+  gst_pad_set_event_function (h264parse->srcpad,
+      GST_DEBUG_FUNCPTR (gst_h264_parse_src_event));
+  gst_pad_set_query_function (h264parse->srcpad,
+      GST_DEBUG_FUNCPTR (gst_h264_parse_src_query));
   gst_element_add_pad (GST_ELEMENT (h264parse), h264parse->srcpad);
 
   h264parse->split_packetized = DEFAULT_SPLIT_PACKETIZED;
+  h264parse->output = DEFAULT_OUTPUT;
+  h264parse->config_interval = DEFAULT_CONFIG_INTERVAL;
+  h264parse->keyframe_only_rate = DEFAULT_KEYFRAME_ONLY_RATE;
+  h264parse->qos = DEFAULT_QOS;
+  h264parse->interpolate = DEFAULT_INTERPOLATE;
+  h264parse->scan_threads = DEFAULT_SCAN_THREADS;
+  h264parse->reverse_thread = DEFAULT_REVERSE_THREAD;
+  h264parse->low_latency = DEFAULT_LOW_LATENCY;
+  h264parse->batch_output = DEFAULT_BATCH_OUTPUT;
+  h264parse->stats_interval = DEFAULT_STATS_INTERVAL;
+  h264parse->stats_timing = DEFAULT_STATS_TIMING;
+  h264parse->max_nal_size = DEFAULT_MAX_NAL_SIZE;
+  h264parse->resync_window = DEFAULT_RESYNC_WINDOW;
+  h264parse->recovery_points = DEFAULT_RECOVERY_POINTS;
+  h264parse->pic_timing = DEFAULT_PIC_TIMING;
+  h264parse->emit_user_data = DEFAULT_EMIT_USER_DATA;
+  h264parse->strip_enhancement = DEFAULT_STRIP_ENHANCEMENT;
+  h264parse->active_sps_id = -1;
+  h264parse->stats_last = GST_CLOCK_TIME_NONE;
+  h264parse->frame_duration = GST_CLOCK_TIME_NONE;
+  h264parse->qos_gop_lateness = DEFAULT_QOS_GOP_LATENESS;
+  h264parse->earliest_time = GST_CLOCK_TIME_NONE;
+  h264parse->qos_timestamp = GST_CLOCK_TIME_NONE;
+  h264parse->last_config = GST_CLOCK_TIME_NONE;
+  h264parse->au_timestamp = GST_CLOCK_TIME_NONE;
   h264parse->adapter = gst_adapter_new ();
+  h264parse->sync_codes = g_array_new (FALSE, FALSE, sizeof (guint));
+  h264parse->user_data = g_array_new (FALSE, FALSE, sizeof (GstH264UserData));
+  h264parse->nal_starts = g_array_new (FALSE, FALSE, sizeof (GstH264NalStart));
+  h264parse->gather = g_ptr_array_new ();
+  h264parse->pending = g_ptr_array_new ();
+  h264parse->reverse_gather = g_ptr_array_new ();
+  h264parse->reverse_split = g_ptr_array_new ();
+  h264parse->reverse_ready = g_ptr_array_new ();
+  h264parse->keyframes = g_array_new (FALSE, FALSE, sizeof (GstH264Keyframe));
+  h264parse->ts_slice = g_slice_new0 (GstNalList);
+  h264parse->ts_upstream = GST_CLOCK_TIME_NONE;
+  h264parse->ts_prefix = GST_CLOCK_TIME_NONE;
+  h264parse->ts_max_pts = GST_CLOCK_TIME_NONE;
+  h264parse->ts_pts = GST_CLOCK_TIME_NONE;
+  h264parse->ts_duration = GST_CLOCK_TIME_NONE;
+  h264parse->upstream_offset = GST_BUFFER_OFFSET_NONE;
+  h264parse->after_slice = TRUE;
+  h264parse->index_seek_time = GST_CLOCK_TIME_NONE;
+  h264parse->index_seek_stop = -1;
+  h264parse->index_seek_timestamp = GST_CLOCK_TIME_NONE;
+  h264parse->seek_target = GST_CLOCK_TIME_NONE;
+  h264parse->scan_lock = g_mutex_new ();
+  h264parse->scan_cond = g_cond_new ();
+  h264parse->reverse_lock = g_mutex_new ();
+  h264parse->reverse_cond = g_cond_new ();
 }
 
 static void
@@ -288,6 +1132,28 @@ gst_h264_parse_finalize (GObject * object)
   h264parse = GST_H264PARSE (object);
 
   g_object_unref (h264parse->adapter);
+  g_array_free (h264parse->sync_codes, TRUE);
+  g_array_free (h264parse->user_data, TRUE);
+  g_array_free (h264parse->nal_starts, TRUE);
+  gst_h264_parse_clear_params (h264parse);
+  gst_buffer_replace (&h264parse->codec_data, NULL);
+  g_ptr_array_free (h264parse->gather, TRUE);
+  g_ptr_array_free (h264parse->pending, TRUE);
+  g_ptr_array_free (h264parse->reverse_gather, TRUE);
+  g_ptr_array_free (h264parse->reverse_split, TRUE);
+  g_ptr_array_free (h264parse->reverse_ready, TRUE);
+  g_array_free (h264parse->keyframes, TRUE);
+  g_slice_free (GstNalList, h264parse->ts_slice);
+  if (h264parse->index_file)
+    g_mapped_file_free (h264parse->index_file);
+  g_free (h264parse->index_location);
+  if (h264parse->index)
+    gst_object_unref (h264parse->index);
+  gst_nal_list_free_pool (h264parse);
+  g_mutex_free (h264parse->scan_lock);
+  g_cond_free (h264parse->scan_cond);
+  g_mutex_free (h264parse->reverse_lock);
+  g_cond_free (h264parse->reverse_cond);
 
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -304,6 +1170,68 @@ gst_h264_parse_set_property (GObject * object, guint prop_id,
     case PROP_SPLIT_PACKETIZED:
       parse->split_packetized = g_value_get_boolean (value);
       break;
+    case PROP_OUTPUT:
+      parse->output = g_value_get_enum (value);
+      break;
+    case PROP_CONFIG_INTERVAL:
+      parse->config_interval = g_value_get_int (value);
+      break;
+    case PROP_KEYFRAME_ONLY_RATE:
+      parse->keyframe_only_rate = g_value_get_double (value);
+      break;
+    case PROP_QOS:
+      parse->qos = g_value_get_boolean (value);
+      break;
+    case PROP_QOS_GOP_LATENESS:
+      parse->qos_gop_lateness = g_value_get_uint64 (value);
+      break;
+    case PROP_INTERPOLATE:
+      parse->interpolate = g_value_get_boolean (value);
+      break;
+    case PROP_SCAN_THREADS:
+      parse->scan_threads = g_value_get_uint (value);
+      break;
+    case PROP_REVERSE_THREAD:
+      parse->reverse_thread = g_value_get_boolean (value);
+      break;
+    case PROP_LOW_LATENCY:
+      parse->low_latency = g_value_get_boolean (value);
+      break;
+    case PROP_BATCH_OUTPUT:
+      parse->batch_output = g_value_get_boolean (value);
+      break;
+    case PROP_STATS_INTERVAL:
+      GST_OBJECT_LOCK (parse);
+      parse->stats_interval = g_value_get_uint64 (value);
+      GST_OBJECT_UNLOCK (parse);
+      break;
+    case PROP_STATS_TIMING:
+      parse->stats_timing = g_value_get_boolean (value);
+      break;
+    case PROP_MAX_NAL_SIZE:
+      parse->max_nal_size = g_value_get_uint (value);
+      break;
+    case PROP_RESYNC_WINDOW:
+      parse->resync_window = g_value_get_uint (value);
+      break;
+    case PROP_RECOVERY_POINTS:
+      parse->recovery_points = g_value_get_boolean (value);
+      break;
+    case PROP_PIC_TIMING:
+      parse->pic_timing = g_value_get_boolean (value);
+      break;
+    case PROP_EMIT_USER_DATA:
+      parse->emit_user_data = g_value_get_boolean (value);
+      break;
+    case PROP_STRIP_ENHANCEMENT:
+      parse->strip_enhancement = g_value_get_boolean (value);
+      break;
+    case PROP_INDEX_LOCATION:
+      GST_OBJECT_LOCK (parse);
+      g_free (parse->index_location);
+      parse->index_location = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK (parse);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -322,12 +1250,171 @@ gst_h264_parse_get_property (GObject * object, guint prop_id, GValue * value,
     case PROP_SPLIT_PACKETIZED:
       g_value_set_boolean (value, parse->split_packetized);
       break;
+    case PROP_OUTPUT:
+      g_value_set_enum (value, parse->output);
+      break;
+    case PROP_CONFIG_INTERVAL:
+      g_value_set_int (value, parse->config_interval);
+      break;
+    case PROP_KEYFRAME_ONLY_RATE:
+      g_value_set_double (value, parse->keyframe_only_rate);
+      break;
+    case PROP_QOS:
+      g_value_set_boolean (value, parse->qos);
+      break;
+    case PROP_QOS_GOP_LATENESS:
+      g_value_set_uint64 (value, parse->qos_gop_lateness);
+      break;
+    case PROP_INTERPOLATE:
+      g_value_set_boolean (value, parse->interpolate);
+      break;
+    case PROP_SCAN_THREADS:
+      g_value_set_uint (value, parse->scan_threads);
+      break;
+    case PROP_REVERSE_THREAD:
+      g_value_set_boolean (value, parse->reverse_thread);
+      break;
+    case PROP_LOW_LATENCY:
+      g_value_set_boolean (value, parse->low_latency);
+      break;
+    case PROP_BATCH_OUTPUT:
+      g_value_set_boolean (value, parse->batch_output);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed (value, gst_h264_parse_stats_structure (parse));
+      break;
+    case PROP_STATS_INTERVAL:
+      GST_OBJECT_LOCK (parse);
+      g_value_set_uint64 (value, parse->stats_interval);
+      GST_OBJECT_UNLOCK (parse);
+      break;
+    case PROP_STATS_TIMING:
+      g_value_set_boolean (value, parse->stats_timing);
+      break;
+    case PROP_MAX_NAL_SIZE:
+      g_value_set_uint (value, parse->max_nal_size);
+      break;
+    case PROP_RESYNC_WINDOW:
+      g_value_set_uint (value, parse->resync_window);
+      break;
+    case PROP_RECOVERY_POINTS:
+      g_value_set_boolean (value, parse->recovery_points);
+      break;
+    case PROP_PIC_TIMING:
+      g_value_set_boolean (value, parse->pic_timing);
+      break;
+    case PROP_EMIT_USER_DATA:
+      g_value_set_boolean (value, parse->emit_user_data);
+      break;
+    case PROP_STRIP_ENHANCEMENT:
+      g_value_set_boolean (value, parse->strip_enhancement);
+      break;
+    case PROP_INDEX_LOCATION:
+      GST_OBJECT_LOCK (parse);
+      g_value_set_string (value, parse->index_location);
+      GST_OBJECT_UNLOCK (parse);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
   }
 }
 
+/* parse the avcC in @codec_data and store its parameter sets. An avcC that
+ * is cut off in the parameter sets is only warned about, we keep the ones
+ * in front of the cut. */
+static gboolean
+gst_h264_parse_parse_avcc (GstH264Parse * h264parse, GstBuffer * codec_data)
+{
+  guint8 *data;
+  guint size;
+  gint profile;
+  guint num_sps, num_pps, nal_size, i;
+
+  data = GST_BUFFER_DATA (codec_data);
+  size = GST_BUFFER_SIZE (codec_data);
+
+  /* parse the avcC data */
+  if (size < 7)
+    goto avcc_too_small;
+  /* parse the version, this must be 1 */
+  if (data[0] != 1)
+    goto wrong_version;
+
+  /* AVCProfileIndication */
+  /* profile_compat */
+  /* AVCLevelIndication */
+  profile = (data[1] << 16) | (data[2] << 8) | data[3];
+  GST_DEBUG_OBJECT (h264parse, "profile %06x", profile);
+
+  /* 6 bits reserved | 2 bits lengthSizeMinusOne */
+  /* this is the number of bytes in front of the NAL units to mark their
+   * length */
+  h264parse->nal_length_size = (data[4] & 0x03) + 1;
+  GST_DEBUG_OBJECT (h264parse, "nal length %u", h264parse->nal_length_size);
+
+  /* 3 bits reserved | 5 bits numOfSequenceParameterSets, each SPS and PPS
+   * is prefixed with a 16 bit size */
+  num_sps = data[5] & 0x1f;
+  data += 6;
+  size -= 6;
+  for (i = 0; i < num_sps; i++) {
+    if (size < 2)
+      goto avcc_truncated;
+    nal_size = GST_READ_UINT16_BE (data);
+    data += 2;
+    size -= 2;
+    if (nal_size == 0 || size < nal_size)
+      goto avcc_truncated;
+    if ((data[0] & 0x1f) == NAL_SPS)
+      gst_h264_parse_store_sps (h264parse, data, nal_size);
+    data += nal_size;
+    size -= nal_size;
+  }
+
+  /* numOfPictureParameterSets */
+  if (size < 1)
+    goto avcc_truncated;
+  num_pps = data[0];
+  data++;
+  size--;
+  for (i = 0; i < num_pps; i++) {
+    if (size < 2)
+      goto avcc_truncated;
+    nal_size = GST_READ_UINT16_BE (data);
+    data += 2;
+    size -= 2;
+    if (nal_size == 0 || size < nal_size)
+      goto avcc_truncated;
+    if ((data[0] & 0x1f) == NAL_PPS)
+      gst_h264_parse_store_pps (h264parse, data, nal_size);
+    data += nal_size;
+    size -= nal_size;
+  }
+  GST_DEBUG_OBJECT (h264parse, "avcC has %u SPS and %u PPS", num_sps,
+      num_pps);
+
+  return TRUE;
+
+  /* ERRORS */
+avcc_too_small:
+  {
+    GST_ERROR_OBJECT (h264parse, "avcC too small, %u bytes", size);
+    return FALSE;
+  }
+wrong_version:
+  {
+    GST_ERROR_OBJECT (h264parse, "wrong avcC version");
+    return FALSE;
+  }
+avcc_truncated:
+  {
+    GST_WARNING_OBJECT (h264parse, "avcC truncated, %u bytes left, keeping "
+        "the parameter sets in front of the cut", size);
+    return TRUE;
+  }
+}
+
 static gboolean
 gst_h264_parse_sink_setcaps (GstPad * pad, GstCaps * caps)
 {
@@ -335,8 +1422,6 @@ gst_h264_parse_sink_setcaps (GstPad * pad, GstCaps * caps)
   GstH264Parse *h264parse;
   GstStructure *str;
   const GValue *value;
-  guint8 *data;
-  guint size;
 
   h264parse = GST_H264PARSE (GST_PAD_PARENT (pad));
 
@@ -345,78 +1430,2223 @@ gst_h264_parse_sink_setcaps (GstPad * pad, GstCaps * caps)
   /* packetized video has a codec_data */
   if ((value = gst_structure_get_value (str, "codec_data"))) {
     GstBuffer *buffer;
-    gint profile;
 
     GST_DEBUG_OBJECT (h264parse, "have packetized h264");
     h264parse->packetized = TRUE;
+    h264parse->passthrough = TRUE;
 
     buffer = gst_value_get_buffer (value);
-    data = GST_BUFFER_DATA (buffer);
-    size = GST_BUFFER_SIZE (buffer);
-
-    /* parse the avcC data */
-    if (size < 7)
-      goto avcc_too_small;
-    /* parse the version, this must be 1 */
-    if (data[0] != 1)
-      goto wrong_version;
-
-    /* AVCProfileIndication */
-    /* profile_compat */
-    /* AVCLevelIndication */
-    profile = (data[1] << 16) | (data[2] << 8) | data[3];
-    GST_DEBUG_OBJECT (h264parse, "profile %06x", profile);
-
-    /* 6 bits reserved | 2 bits lengthSizeMinusOne */
-    /* this is the number of bytes in front of the NAL units to mark their
-     * length */
-    h264parse->nal_length_size = (data[4] & 0x03) + 1;
-    GST_DEBUG_OBJECT (h264parse, "nal length %u", h264parse->nal_length_size);
-
-    /* FIXME, PPS, SPS have vital info for detecting new I-frames */
+    if (!gst_h264_parse_parse_avcc (h264parse, buffer))
+      return FALSE;
+    /* we need it again when we start after a stop */
+    gst_buffer_replace (&h264parse->codec_data, buffer);
   } else {
     GST_DEBUG_OBJECT (h264parse, "have bytestream h264");
     h264parse->packetized = FALSE;
-    /* we have 4 sync bytes */
+    /* we have 3 or 4 sync bytes, the size is checked for each NAL unit */
     h264parse->nal_length_size = 4;
+    gst_buffer_replace (&h264parse->codec_data, NULL);
   }
 
-  /* forward the caps */
-  res = gst_pad_set_caps (h264parse->srcpad, caps);
+  /* forward the caps in the format downstream wants */
+  res = gst_h264_parse_negotiate (h264parse, caps);
 
   return res;
-
-  /* ERRORS */
-avcc_too_small:
-  {
-    GST_ERROR_OBJECT (h264parse, "avcC size %u < 7", size);
-    return FALSE;
-  }
-wrong_version:
-  {
-    GST_ERROR_OBJECT (h264parse, "wrong avcC version");
-    return FALSE;
-  }
+}
+
+static void
+gst_h264_parse_reset_scan (GstH264Parse * h264parse)
+{
+  g_array_set_size (h264parse->nal_starts, 0);
+  h264parse->nal_starts_head = 0;
+  h264parse->zero_run = 0;
+  h264parse->adapter_offset = 0;
+  h264parse->upstream_offset = GST_BUFFER_OFFSET_NONE;
+  h264parse->after_slice = TRUE;
+}
+
+static void
+gst_h264_parse_clear_au (GstH264Parse * h264parse)
+{
+  while (h264parse->au) {
+    gst_buffer_unref (h264parse->au->buffer);
+    h264parse->au = gst_nal_list_delete_head (h264parse, h264parse->au);
+  }
+  h264parse->au_last = NULL;
+  h264parse->au_slice = NULL;
+  h264parse->au_keyframe = FALSE;
+  h264parse->au_timestamp = GST_CLOCK_TIME_NONE;
+}
+
+static void
+gst_h264_parse_reset_timestamps (GstH264Parse * h264parse)
+{
+  h264parse->ts_upstream = GST_CLOCK_TIME_NONE;
+  h264parse->ts_prefix = GST_CLOCK_TIME_NONE;
+  h264parse->ts_base_valid = FALSE;
+  h264parse->ts_max_pts = GST_CLOCK_TIME_NONE;
+  h264parse->ts_have_slice = FALSE;
+  h264parse->ts_pts = GST_CLOCK_TIME_NONE;
+  h264parse->ts_duration = GST_CLOCK_TIME_NONE;
+  h264parse->poc_msb = 0;
+  h264parse->poc_lsb = 0;
+  h264parse->poc_frame_num = 0;
+  h264parse->poc_frame_num_offset = 0;
+  h264parse->cpb_base_valid = FALSE;
+  memset (&h264parse->sei_next, 0, sizeof (GstH264ParseSei));
+  memset (&h264parse->sei, 0, sizeof (GstH264ParseSei));
+}
+
+static void gst_h264_parse_wait_reverse (GstH264Parse * h264parse);
+
+static void
+gst_h264_parse_clear_buffers (GPtrArray * buffers)
+{
+  g_ptr_array_foreach (buffers, (GFunc) gst_mini_object_unref, NULL);
+  g_ptr_array_set_size (buffers, 0);
 }
 
 static void
 gst_h264_parse_clear_queues (GstH264Parse * h264parse)
 {
-  g_list_foreach (h264parse->gather, (GFunc) gst_mini_object_unref, NULL);
-  g_list_free (h264parse->gather);
-  h264parse->gather = NULL;
-  while (h264parse->decode) {
-    gst_buffer_unref (h264parse->decode->buffer);
-    h264parse->decode = gst_nal_list_delete_head (h264parse->decode);
+  /* the reverse thread uses the pending data */
+  gst_h264_parse_wait_reverse (h264parse);
+  gst_h264_parse_clear_buffers (h264parse->reverse_gather);
+  gst_h264_parse_clear_buffers (h264parse->reverse_split);
+  gst_h264_parse_clear_buffers (h264parse->reverse_ready);
+
+  gst_h264_parse_clear_buffers (h264parse->gather);
+  while (h264parse->decode) {
+    gst_buffer_unref (h264parse->decode->buffer);
+    h264parse->decode = gst_nal_list_delete_head (h264parse, h264parse->decode);
+  }
+  h264parse->decode = NULL;
+  h264parse->decode_len = 0;
+  gst_h264_parse_clear_au (h264parse);
+  /* don't keep the links of a long reverse GOP around after a flush */
+  gst_nal_list_free_pool (h264parse);
+  gst_h264_parse_clear_buffers (h264parse->pending);
+  h264parse->pending_size = 0;
+  gst_adapter_clear (h264parse->adapter);
+  gst_h264_parse_reset_scan (h264parse);
+  h264parse->have_i_frame = FALSE;
+  h264parse->last_config = GST_CLOCK_TIME_NONE;
+  h264parse->config_sent = FALSE;
+
+  GST_OBJECT_LOCK (h264parse);
+  h264parse->earliest_time = GST_CLOCK_TIME_NONE;
+  GST_OBJECT_UNLOCK (h264parse);
+  h264parse->qos_timestamp = GST_CLOCK_TIME_NONE;
+  h264parse->qos_skip_gop = FALSE;
+  h264parse->seek_target = GST_CLOCK_TIME_NONE;
+  gst_h264_parse_reset_timestamps (h264parse);
+}
+
+static void
+gst_h264_parse_add_nal_start (GstH264Parse * h264parse, guint64 offset,
+    guint zeros, GstClockTime timestamp)
+{
+  GstH264NalStart start;
+
+  start.offset = offset;
+  start.zeros = zeros;
+  start.timestamp = timestamp;
+  g_array_append_val (h264parse->nal_starts, start);
+}
+
+/* the 0x000001 prefix at @pos in @data of a buffer at stream @offset */
+static inline void
+gst_h264_parse_found_sync_code (GstH264Parse * h264parse, const guint8 * data,
+    guint pos, guint64 offset, GstClockTime timestamp)
+{
+  guint zeros;
+
+  /* count the zeros in front of the prefix */
+  for (zeros = 0; zeros < pos && data[pos - zeros - 1] == 0; zeros++);
+  if (zeros == pos)
+    zeros += h264parse->zero_run;
+
+  gst_h264_parse_add_nal_start (h264parse, offset + pos, zeros, timestamp);
+}
+
+/* runs in the scan thread pool. Prefixes never overlap, so the ones a job
+ * finds are exactly the ones a search of the whole buffer finds in its
+ * part. The 2 bytes after the part are in @size to find the prefixes that
+ * start at the end. */
+static void
+gst_h264_parse_scan_job (GstH264ScanJob * job, GstH264Parse * h264parse)
+{
+  guint pos = 0;
+
+  while (pos < job->end) {
+    pos += gst_h264_scan_start_code (job->data + pos, job->size - pos);
+    if (pos >= job->end)
+      break;
+    g_array_append_val (job->found, pos);
+    pos += 3;
+  }
+
+  g_mutex_lock (h264parse->scan_lock);
+  if (--h264parse->scan_running == 0)
+    g_cond_signal (h264parse->scan_cond);
+  g_mutex_unlock (h264parse->scan_lock);
+}
+
+/* search @data in parts on the scan threads and add the sync codes in stream
+ * order when they are all done */
+static void
+gst_h264_parse_scan_parallel (GstH264Parse * h264parse, const guint8 * data,
+    guint size, guint64 offset, GstClockTime timestamp)
+{
+  guint i, j, n_jobs, part;
+
+  n_jobs = MIN (h264parse->scan_n_jobs, size / PARALLEL_SCAN_MIN_SIZE);
+  part = size / n_jobs;
+
+  g_mutex_lock (h264parse->scan_lock);
+  h264parse->scan_running = n_jobs;
+  for (i = 0; i < n_jobs; i++) {
+    GstH264ScanJob *job = &h264parse->scan_jobs[i];
+
+    job->data = data + i * part;
+    job->end = (i == n_jobs - 1) ? size - i * part : part;
+    job->size = MIN (job->end + 2, size - i * part);
+    g_array_set_size (job->found, 0);
+    g_thread_pool_push (h264parse->scan_pool, job, NULL);
+  }
+  while (h264parse->scan_running > 0)
+    g_cond_wait (h264parse->scan_cond, h264parse->scan_lock);
+  g_mutex_unlock (h264parse->scan_lock);
+
+  for (i = 0; i < n_jobs; i++) {
+    GstH264ScanJob *job = &h264parse->scan_jobs[i];
+    guint base = job->data - data;
+
+    for (j = 0; j < job->found->len; j++)
+      gst_h264_parse_found_sync_code (h264parse, data,
+          base + g_array_index (job->found, guint, j), offset, timestamp);
+  }
+}
+
+static void
+gst_h264_parse_start_scan_pool (GstH264Parse * h264parse)
+{
+  GError *err = NULL;
+  guint i;
+
+  if (h264parse->scan_threads < 2)
+    return;
+
+  h264parse->scan_pool = g_thread_pool_new ((GFunc) gst_h264_parse_scan_job,
+      h264parse, h264parse->scan_threads, FALSE, &err);
+  if (h264parse->scan_pool == NULL) {
+    GST_WARNING_OBJECT (h264parse, "could not create scan threads: %s",
+        err->message);
+    g_error_free (err);
+    return;
+  }
+
+  h264parse->scan_n_jobs = h264parse->scan_threads;
+  h264parse->scan_jobs = g_new0 (GstH264ScanJob, h264parse->scan_n_jobs);
+  for (i = 0; i < h264parse->scan_n_jobs; i++)
+    h264parse->scan_jobs[i].found = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  GST_DEBUG_OBJECT (h264parse, "scanning with %u threads",
+      h264parse->scan_n_jobs);
+}
+
+static void
+gst_h264_parse_stop_scan_pool (GstH264Parse * h264parse)
+{
+  guint i;
+
+  if (h264parse->scan_pool == NULL)
+    return;
+
+  g_thread_pool_free (h264parse->scan_pool, FALSE, TRUE);
+  h264parse->scan_pool = NULL;
+  for (i = 0; i < h264parse->scan_n_jobs; i++)
+    g_array_free (h264parse->scan_jobs[i].found, TRUE);
+  g_free (h264parse->scan_jobs);
+  h264parse->scan_jobs = NULL;
+  h264parse->scan_n_jobs = 0;
+}
+
+/* scan @buffer for sync codes before it is pushed in the adapter. Sync codes
+ * that start in the previously scanned data are found with the number of zero
+ * bytes we saw at the end of it, so we never need to look at a byte twice or
+ * peek more than one buffer. */
+static void
+gst_h264_parse_scan_buffer (GstH264Parse * h264parse, GstBuffer * buffer)
+{
+  const guint8 *data;
+  guint size, pos, zeros;
+  guint64 offset;
+  GstClockTime timestamp;
+
+  data = GST_BUFFER_DATA (buffer);
+  size = GST_BUFFER_SIZE (buffer);
+  timestamp = GST_BUFFER_TIMESTAMP (buffer);
+  if (size == 0)
+    return;
+
+  /* stream offset of the first byte of this buffer */
+  offset = h264parse->adapter_offset +
+      gst_adapter_available (h264parse->adapter);
+
+  /* sync codes that started in the previous buffer */
+  if (h264parse->zero_run >= 2 && data[0] == 1)
+    gst_h264_parse_add_nal_start (h264parse, offset - 2,
+        h264parse->zero_run - 2, timestamp);
+  else if (h264parse->zero_run >= 1 && size >= 2 && data[0] == 0
+      && data[1] == 1)
+    gst_h264_parse_add_nal_start (h264parse, offset - 1,
+        h264parse->zero_run - 1, timestamp);
+
+  if (h264parse->scan_pool && size >= 2 * PARALLEL_SCAN_MIN_SIZE) {
+    gst_h264_parse_scan_parallel (h264parse, data, size, offset, timestamp);
+  } else {
+    pos = 0;
+    while (pos < size) {
+      pos += gst_h264_scan_start_code (data + pos, size - pos);
+      if (pos >= size)
+        break;
+      gst_h264_parse_found_sync_code (h264parse, data, pos, offset, timestamp);
+      pos += 3;
+    }
+  }
+
+  /* remember the zeros at the end for the next buffer */
+  for (zeros = 0; zeros < size && data[size - zeros - 1] == 0; zeros++);
+  if (zeros == size)
+    h264parse->zero_run += zeros;
+  else
+    h264parse->zero_run = zeros;
+}
+
+static void
+gst_h264_parse_flush (GstH264Parse * h264parse, guint size)
+{
+  gst_adapter_flush (h264parse->adapter, size);
+  h264parse->adapter_offset += size;
+}
+
+static GstBuffer *
+gst_h264_parse_take (GstH264Parse * h264parse, guint size)
+{
+  h264parse->adapter_offset += size;
+  /* this is a subbuffer when the data is inside the first buffer */
+  return gst_adapter_take_buffer (h264parse->adapter, size);
+}
+
+/* drop @size bytes of corrupt data at the start of the adapter, the pictures
+ * up to the next I frame or recovery point can refer to what we dropped */
+static void
+gst_h264_parse_drop_corrupt (GstH264Parse * h264parse, guint size)
+{
+  GST_WARNING_OBJECT (h264parse, "dropping %u bytes of corrupt data", size);
+
+  gst_h264_parse_flush (h264parse, size);
+  g_atomic_int_add (&h264parse->stats.resyncs, 1);
+  gst_h264_parse_stats_add (h264parse, &h264parse->stats.corrupt_bytes, size);
+  h264parse->qos_skip_gop = TRUE;
+  h264parse->discont = TRUE;
+}
+
+/* SEI messages are only parsed when something uses them, while we drop up to
+ * the next keyframe a recovery point also ends that */
+static inline gboolean
+gst_h264_parse_want_sei (GstH264Parse * h264parse)
+{
+  return h264parse->recovery_points || h264parse->pic_timing ||
+      h264parse->emit_user_data || h264parse->qos_skip_gop;
+}
+
+/* the SEI NAL unit we read the messages of */
+typedef struct
+{
+  GstH264Parse *h264parse;
+  const guint8 *data;
+  guint size;
+} GstH264SeiContext;
+
+/* remember where the registered user data in @payload is, @payload is byte
+ * aligned at the start of the message. Without emulation prevention bytes in
+ * front of the end of the message the raw data is the same as the RBSP and a
+ * subbuffer of the output can be used, else we copy. */
+static void
+gst_h264_parse_add_user_data (GstH264SeiContext * ctx, GstNalBs * payload,
+    guint payload_size)
+{
+  GstH264Parse *h264parse = ctx->h264parse;
+  GstH264UserData user_data;
+  guint offset, end, i;
+
+  offset = (payload->data - ctx->data) - payload->head / 8;
+  end = MIN (offset + payload_size, ctx->size);
+  for (i = 2; i < end; i++) {
+    if (ctx->data[i] == 0x03 && ctx->data[i - 1] == 0 && ctx->data[i - 2] == 0)
+      break;
+  }
+
+  user_data.size = payload_size;
+  if (i < end) {
+    user_data.offset = 0;
+    user_data.copy = gst_buffer_new_and_alloc (payload_size);
+    for (i = 0; i < payload_size; i++)
+      GST_BUFFER_DATA (user_data.copy)[i] = gst_nal_bs_read (payload, 8);
+  } else {
+    user_data.offset = (ctx->data - h264parse->sei_data) + offset;
+    user_data.copy = NULL;
+  }
+  g_array_append_val (h264parse->user_data, user_data);
+}
+
+static gboolean
+gst_h264_parse_read_sei_message (guint payload_type, GstNalBs * payload,
+    guint payload_size, gpointer user_data)
+{
+  GstH264SeiContext *ctx = user_data;
+  GstH264Parse *h264parse = ctx->h264parse;
+  GstH264ParseSei *sei = &h264parse->sei_next;
+  GstH264Sps *sps = NULL;
+
+  if (h264parse->active_sps_id >= 0)
+    sps = h264parse->sps[h264parse->active_sps_id];
+
+  switch (payload_type) {
+    case SEI_BUFFERING_PERIOD:
+      sei->buffering_period = h264parse->pic_timing;
+      break;
+    case SEI_PIC_TIMING:
+      /* D.1.2, the field lengths are in the SPS */
+      if (!h264parse->pic_timing || sps == NULL)
+        break;
+      if (sps->hrd_present) {
+        sei->cpb_removal_delay = gst_nal_bs_read (payload,
+            sps->cpb_removal_delay_length);
+        sei->dpb_output_delay = gst_nal_bs_read (payload,
+            sps->dpb_output_delay_length);
+        sei->pic_timing = TRUE;
+      }
+      if (sps->pic_struct_present) {
+        sei->pic_struct = gst_nal_bs_read (payload, 4);
+        sei->have_pic_struct = TRUE;
+      }
+      break;
+    case SEI_USER_DATA_REGISTERED:
+      if (h264parse->emit_user_data && h264parse->sei_data)
+        gst_h264_parse_add_user_data (ctx, payload, payload_size);
+      break;
+    case SEI_RECOVERY_POINT:
+      sei->recovery_frame_cnt = gst_nal_bs_read_ue (payload);
+      sei->recovery_point = TRUE;
+      GST_LOG_OBJECT (h264parse, "recovery point, recovery_frame_cnt %d",
+          sei->recovery_frame_cnt);
+      break;
+    default:
+      break;
+  }
+  return TRUE;
+}
+
+/* read the SEI messages of the SEI NAL unit in @data for the next picture,
+ * registered user data is found when the NAL unit is in sei_data */
+static void
+gst_h264_parse_parse_sei (GstH264Parse * h264parse, const guint8 * data,
+    guint size)
+{
+  GstH264SeiContext ctx;
+
+  ctx.h264parse = h264parse;
+  ctx.data = data + 1;
+  ctx.size = size - 1;
+  if (!gst_h264_read_sei (ctx.data, ctx.size, gst_h264_parse_read_sei_message,
+          &ctx))
+    GST_DEBUG_OBJECT (h264parse, "truncated SEI message");
+}
+
+static void
+gst_h264_parse_clear_user_data (GstH264Parse * h264parse)
+{
+  guint i;
+
+  for (i = 0; i < h264parse->user_data->len; i++) {
+    GstH264UserData *user_data = &g_array_index (h264parse->user_data,
+        GstH264UserData, i);
+
+    if (user_data->copy)
+      gst_buffer_unref (user_data->copy);
+  }
+  g_array_set_size (h264parse->user_data, 0);
+}
+
+/* emit the registered user data found in the NAL units of @buffer */
+static void
+gst_h264_parse_emit_user_data (GstH264Parse * h264parse, GstBuffer * buffer,
+    GstClockTime timestamp)
+{
+  guint i;
+
+  for (i = 0; i < h264parse->user_data->len; i++) {
+    GstH264UserData *user_data = &g_array_index (h264parse->user_data,
+        GstH264UserData, i);
+    GstBuffer *data;
+
+    if (user_data->copy)
+      data = user_data->copy;
+    else
+      data = gst_buffer_create_sub (buffer, user_data->offset,
+          user_data->size);
+    GST_BUFFER_TIMESTAMP (data) = timestamp;
+
+    GST_LOG_OBJECT (h264parse, "user data of %u bytes", user_data->size);
+    g_signal_emit (h264parse, gst_h264_parse_signals[SIGNAL_USER_DATA], 0,
+        data);
+    gst_buffer_unref (data);
+  }
+  g_array_set_size (h264parse->user_data, 0);
+}
+
+/* parse the NAL header and the start of the slice header, @data points to the
+ * NAL header. SPS and PPS NAL units need to be complete and are stored. For
+ * packetized input a buffer can contain multiple NAL units, the slice and
+ * i_frame fields are only ever set here so that they are TRUE when one of the
+ * NAL units is a slice or an I slice. */
+static void
+gst_h264_parse_parse_nal (GstH264Parse * parse, GstNalList * link,
+    const guint8 * data, guint size)
+{
+  GstH264NalHeader *hdr = &link->hdr;
+
+  if (!gst_h264_read_nal_header (hdr, data, size, parse->sps, parse->pps))
+    return;
+
+  GST_DEBUG_OBJECT (parse, "NAL type: %d, ref_idc: %d", hdr->nal_type,
+      hdr->nal_ref_idc);
+
+  /* first parse some things needed to get to the frame type */
+  if (hdr->nal_type >= NAL_SLICE && hdr->nal_type <= NAL_SLICE_IDR) {
+    link->slice = TRUE;
+
+    /* the SEI messages in front of the first slice are for its picture */
+    if (gst_h264_parse_want_sei (parse)) {
+      if (hdr->nal_type != NAL_SLICE_DPB && hdr->nal_type != NAL_SLICE_DPC &&
+          hdr->first_mb_in_slice == 0) {
+        parse->sei = parse->sei_next;
+        memset (&parse->sei_next, 0, sizeof (GstH264ParseSei));
+        if (hdr->poc_type >= 0)
+          parse->active_sps_id = parse->pps[hdr->pps_id]->sps_id;
+      }
+      if (parse->sei.recovery_point && hdr->nal_type != NAL_SLICE_IDR) {
+        link->recovery_point = TRUE;
+        if (parse->recovery_points && parse->sei.recovery_frame_cnt == 0)
+          link->recovery = TRUE;
+      }
+    }
+
+    GST_DEBUG_OBJECT (parse, "first MB: %d, slice type: %d, PPS: %d",
+        hdr->first_mb_in_slice, hdr->slice_type, hdr->pps_id);
+
+    switch (hdr->slice_type) {
+      case 0:
+      case 5:
+      case 3:
+      case 8:                  /* SP */
+        /* P frames */
+        GST_DEBUG_OBJECT (parse, "we have a P slice");
+        break;
+      case 1:
+      case 6:
+        /* B frames */
+        GST_DEBUG_OBJECT (parse, "we have a B slice");
+        break;
+      case 2:
+      case 7:
+      case 4:
+      case 9:
+        /* I frames */
+        GST_DEBUG_OBJECT (parse, "we have an I slice");
+        link->i_frame = TRUE;
+        break;
+    }
+  } else if (hdr->nal_type == NAL_SPS) {
+    gst_h264_parse_store_sps (parse, data, size);
+  } else if (hdr->nal_type == NAL_PPS) {
+    gst_h264_parse_store_pps (parse, data, size);
+  } else if (hdr->nal_type == NAL_SEI && gst_h264_parse_want_sei (parse) &&
+      parse->segment.rate > 0.0) {
+    /* in reverse playback the SEI messages come after their picture */
+    gst_h264_parse_parse_sei (parse, data, size);
+  }
+}
+
+/* check if the slice in @link is the first slice of a new primary coded
+ * picture after the picture of @slice, 7.4.1.2.4 */
+static gboolean
+gst_h264_parse_is_new_picture (GstNalList * link, GstNalList * slice)
+{
+  if (link->hdr.first_mb_in_slice == 0)
+    return TRUE;
+  if (link->hdr.pps_id != slice->hdr.pps_id)
+    return TRUE;
+  if ((link->hdr.nal_ref_idc == 0) != (slice->hdr.nal_ref_idc == 0))
+    return TRUE;
+  if ((link->hdr.nal_type == NAL_SLICE_IDR) !=
+      (slice->hdr.nal_type == NAL_SLICE_IDR))
+    return TRUE;
+  /* the other checks need the parameter sets */
+  if (link->hdr.poc_type < 0 || slice->hdr.poc_type < 0)
+    return FALSE;
+  if (link->hdr.frame_num != slice->hdr.frame_num)
+    return TRUE;
+  if (link->hdr.field_pic != slice->hdr.field_pic)
+    return TRUE;
+  if (link->hdr.bottom_field != slice->hdr.bottom_field)
+    return TRUE;
+  if (link->hdr.nal_type == NAL_SLICE_IDR &&
+      link->hdr.idr_pic_id != slice->hdr.idr_pic_id)
+    return TRUE;
+  if (link->hdr.poc_type == 0 && (link->hdr.poc_lsb != slice->hdr.poc_lsb ||
+          link->hdr.delta_poc_bottom != slice->hdr.delta_poc_bottom))
+    return TRUE;
+  if (link->hdr.poc_type == 1 &&
+      (link->hdr.delta_poc[0] != slice->hdr.delta_poc[0] ||
+          link->hdr.delta_poc[1] != slice->hdr.delta_poc[1]))
+    return TRUE;
+  return FALSE;
+}
+
+/* check if @link is the first NAL unit of a new access unit, see 7.4.1.2.3 */
+static gboolean
+gst_h264_parse_is_new_au (GstH264Parse * h264parse, GstNalList * link)
+{
+  GstNalList *slice = h264parse->au_slice;
+
+  /* the current access unit needs a primary coded picture first */
+  if (slice == NULL)
+    return FALSE;
+
+  /* packetized buffers that we don't split contain a complete access unit */
+  if (h264parse->packetized && !h264parse->split_packetized)
+    return TRUE;
+
+  switch (link->hdr.nal_type) {
+    case NAL_AU_DELIMITER:
+    case NAL_SPS:
+    case NAL_PPS:
+    case NAL_SEI:
+    case NAL_SUBSET_SPS:
+      return TRUE;
+    case NAL_SLICE:
+    case NAL_SLICE_DPA:
+    case NAL_SLICE_IDR:
+      return gst_h264_parse_is_new_picture (link, slice);
+    default:
+      /* a prefix NAL unit goes with the base layer slice after it, the slice
+       * extensions of the other layers and views come after the base layer
+       * picture of the same access unit */
+      return FALSE;
+  }
+}
+
+/* 8.2.1, the picture order count of the picture that starts with @slice and
+ * updates the state needed for the next picture. Memory management operation
+ * 5 is not parsed, the count goes on after it. */
+static gint
+gst_h264_parse_picture_poc (GstH264Parse * h264parse, GstNalList * slice,
+    GstH264Sps * sps)
+{
+  gboolean idr = slice->hdr.nal_type == NAL_SLICE_IDR;
+  gint top, bottom, frame_num_offset;
+
+  if (sps->poc_type == 0) {
+    gint max_lsb = 1 << sps->log2_max_poc_lsb;
+    gint msb;
+
+    if (idr) {
+      h264parse->poc_msb = 0;
+      h264parse->poc_lsb = 0;
+    }
+    if (slice->hdr.poc_lsb < h264parse->poc_lsb &&
+        h264parse->poc_lsb - slice->hdr.poc_lsb >= max_lsb / 2)
+      msb = h264parse->poc_msb + max_lsb;
+    else if (slice->hdr.poc_lsb > h264parse->poc_lsb &&
+        slice->hdr.poc_lsb - h264parse->poc_lsb > max_lsb / 2)
+      msb = h264parse->poc_msb - max_lsb;
+    else
+      msb = h264parse->poc_msb;
+
+    top = msb + slice->hdr.poc_lsb;
+    bottom = slice->hdr.field_pic ? top : top + slice->hdr.delta_poc_bottom;
+    if (slice->hdr.nal_ref_idc != 0) {
+      h264parse->poc_msb = msb;
+      h264parse->poc_lsb = slice->hdr.poc_lsb;
+    }
+  } else {
+    if (idr)
+      frame_num_offset = 0;
+    else if (h264parse->poc_frame_num > slice->hdr.frame_num)
+      frame_num_offset = h264parse->poc_frame_num_offset +
+          (1 << sps->log2_max_frame_num);
+    else
+      frame_num_offset = h264parse->poc_frame_num_offset;
+
+    if (sps->poc_type == 1) {
+      gint n = sps->num_ref_frames_in_poc_cycle;
+      gint abs_frame_num = 0, expected = 0, i;
+
+      if (n != 0)
+        abs_frame_num = frame_num_offset + slice->hdr.frame_num;
+      if (slice->hdr.nal_ref_idc == 0 && abs_frame_num > 0)
+        abs_frame_num--;
+      if (abs_frame_num > 0) {
+        gint delta_per_cycle = 0;
+
+        for (i = 0; i < n; i++)
+          delta_per_cycle += sps->offset_for_ref_frame[i];
+        expected = ((abs_frame_num - 1) / n) * delta_per_cycle;
+        for (i = 0; i <= (abs_frame_num - 1) % n; i++)
+          expected += sps->offset_for_ref_frame[i];
+      }
+      if (slice->hdr.nal_ref_idc == 0)
+        expected += sps->offset_for_non_ref_pic;
+
+      if (!slice->hdr.field_pic) {
+        top = expected + slice->hdr.delta_poc[0];
+        bottom = top + sps->offset_for_top_to_bottom_field +
+            slice->hdr.delta_poc[1];
+      } else if (!slice->hdr.bottom_field) {
+        top = bottom = expected + slice->hdr.delta_poc[0];
+      } else {
+        top = bottom = expected + sps->offset_for_top_to_bottom_field +
+            slice->hdr.delta_poc[0];
+      }
+    } else {
+      if (idr)
+        top = 0;
+      else if (slice->hdr.nal_ref_idc == 0)
+        top = 2 * (frame_num_offset + slice->hdr.frame_num) - 1;
+      else
+        top = 2 * (frame_num_offset + slice->hdr.frame_num);
+      bottom = top;
+    }
+    h264parse->poc_frame_num = slice->hdr.frame_num;
+    h264parse->poc_frame_num_offset = frame_num_offset;
+  }
+
+  if (slice->hdr.field_pic)
+    return slice->hdr.bottom_field ? bottom : top;
+  return MIN (top, bottom);
+}
+
+/* Table D-1, the field periods a picture with pic_struct is shown */
+static const guint pic_struct_fields[16] = {
+  2, 1, 1, 2, 2, 3, 3, 4, 6
+};
+
+/* the timestamp of the current picture from the pic_timing SEI, its removal
+ * time counts from the last buffering period and its output time from the
+ * removal time, D.2.2. The duration comes from pic_struct. @anchor tells that
+ * @timestamp is a new upstream timestamp, the removal time of the next
+ * buffering period counts from there. Returns -1 without delays. */
+static gint64
+gst_h264_parse_pic_timing (GstH264Parse * h264parse, GstH264Sps * sps,
+    GstClockTime timestamp, gboolean anchor, GstClockTime * duration)
+{
+  GstH264ParseSei *sei = &h264parse->sei;
+  guint64 scale = GST_SECOND * (guint64) sps->num_units_in_tick;
+  gint64 removal, output;
+
+  if (sei->have_pic_struct && pic_struct_fields[sei->pic_struct] > 0)
+    *duration = gst_util_uint64_scale (pic_struct_fields[sei->pic_struct],
+        scale, sps->time_scale);
+
+  if (!sei->pic_timing)
+    return -1;
+
+  removal = gst_util_uint64_scale (sei->cpb_removal_delay, scale,
+      sps->time_scale);
+  output = gst_util_uint64_scale (sei->dpb_output_delay, scale,
+      sps->time_scale);
+  if (sei->buffering_period) {
+    if (h264parse->cpb_base_valid)
+      h264parse->cpb_base += removal;
+    removal = 0;
+  }
+  if (anchor) {
+    h264parse->cpb_base = (gint64) timestamp - removal - output;
+    h264parse->cpb_base_valid = TRUE;
+  }
+  if (!h264parse->cpb_base_valid)
+    return -1;
+
+  return MAX (h264parse->cpb_base + removal + output, 0);
+}
+
+/* the timestamp of the picture that starts with @slice, @timestamp is the
+ * upstream timestamp of the slice. A picture order count step is one field
+ * period of the VUI timing, the count starts at the timestamp of the IDR
+ * picture and an IDR picture is shown after all pictures before it. New
+ * upstream timestamps are used as they are. With pic-timing the delays of
+ * the pic_timing SEI are used instead when the stream has them. Returns
+ * GST_CLOCK_TIME_NONE when the timestamp can't be interpolated. */
+static GstClockTime
+gst_h264_parse_picture_timestamp (GstH264Parse * h264parse,
+    GstNalList * slice, GstClockTime timestamp, GstClockTime * duration)
+{
+  GstH264Pps *pps;
+  GstH264Sps *sps;
+  GstClockTime tick, pts;
+  gboolean anchor;
+  gint64 poc_time, timing = -1;
+
+  *duration = GST_CLOCK_TIME_NONE;
+
+  /* a timestamp we saw before belongs to an earlier picture in the same
+   * input buffer */
+  anchor = GST_CLOCK_TIME_IS_VALID (timestamp) &&
+      timestamp != h264parse->ts_upstream;
+  if (anchor)
+    h264parse->ts_upstream = timestamp;
+
+  if (slice->hdr.poc_type < 0)
+    return GST_CLOCK_TIME_NONE;
+  pps = h264parse->pps[slice->hdr.pps_id];
+  sps = h264parse->sps[pps->sps_id];
+  if (!sps->timing_info_present || sps->num_units_in_tick == 0 ||
+      sps->time_scale == 0)
+    return GST_CLOCK_TIME_NONE;
+
+  tick = gst_util_uint64_scale (GST_SECOND, sps->num_units_in_tick,
+      sps->time_scale);
+  poc_time = (gint64) gst_h264_parse_picture_poc (h264parse, slice, sps) *
+      (gint64) tick;
+  *duration = slice->hdr.field_pic ? tick : 2 * tick;
+
+  if (anchor) {
+    h264parse->ts_base = (gint64) timestamp - poc_time;
+    h264parse->ts_base_valid = TRUE;
+  } else if (slice->hdr.nal_type == NAL_SLICE_IDR) {
+    if (GST_CLOCK_TIME_IS_VALID (h264parse->ts_max_pts))
+      h264parse->ts_base = h264parse->ts_max_pts + h264parse->ts_max_duration -
+          poc_time;
+    else
+      h264parse->ts_base = 0;
+    h264parse->ts_base_valid = TRUE;
+  }
+
+  if (h264parse->pic_timing)
+    timing = gst_h264_parse_pic_timing (h264parse, sps, timestamp, anchor,
+        duration);
+  if (timing >= 0)
+    pts = timing;
+  else if (h264parse->ts_base_valid)
+    pts = MAX (h264parse->ts_base + poc_time, 0);
+  else
+    return GST_CLOCK_TIME_NONE;
+  if (!GST_CLOCK_TIME_IS_VALID (h264parse->ts_max_pts) ||
+      pts > h264parse->ts_max_pts) {
+    h264parse->ts_max_pts = pts;
+    h264parse->ts_max_duration = *duration;
+  }
+
+  GST_LOG_OBJECT (h264parse, "picture timestamp %" GST_TIME_FORMAT
+      ", duration %" GST_TIME_FORMAT, GST_TIME_ARGS (pts),
+      GST_TIME_ARGS (*duration));
+
+  return pts;
+}
+
+/* set the interpolated timestamp of the picture of the slice in @link */
+static void
+gst_h264_parse_slice_timestamp (GstH264Parse * h264parse, GstNalList * link,
+    GstClockTime timestamp)
+{
+  /* data partitions B and C have no header to look at */
+  if (link->hdr.nal_type != NAL_SLICE_DPB &&
+      link->hdr.nal_type != NAL_SLICE_DPC && (!h264parse->ts_have_slice ||
+          (h264parse->packetized && !h264parse->split_packetized) ||
+          gst_h264_parse_is_new_picture (link, h264parse->ts_slice))) {
+    h264parse->ts_pts = gst_h264_parse_picture_timestamp (h264parse, link,
+        timestamp, &h264parse->ts_duration);
+    *h264parse->ts_slice = *link;
+    h264parse->ts_have_slice = TRUE;
+  }
+  link->pts = h264parse->ts_pts;
+  link->duration = h264parse->ts_duration;
+}
+
+/* see if the slice in @link has to be dropped because downstream is late,
+ * @keyframe tells if decoding can start at its picture: an IDR or I picture
+ * or a picture after a recovery point. Non-reference slices go first, when
+ * we are later than qos-gop-lateness everything up to the next keyframe. */
+static gboolean
+gst_h264_parse_qos_drop (GstH264Parse * h264parse, GstNalList * link,
+    gboolean keyframe, GstClockTime timestamp)
+{
+  GstClockTime earliest, running;
+
+  /* NAL units after the first one of a buffer have no timestamp */
+  if (GST_CLOCK_TIME_IS_VALID (timestamp))
+    h264parse->qos_timestamp = timestamp;
+  else
+    timestamp = h264parse->qos_timestamp;
+
+  /* the enhancement layer slices go with their base layer picture */
+  if (!link->slice && link->hdr.nal_type != NAL_SLICE_EXT)
+    return FALSE;
+
+  if (keyframe && h264parse->qos_skip_gop) {
+    GST_DEBUG_OBJECT (h264parse, "keyframe, stop dropping");
+    h264parse->qos_skip_gop = FALSE;
+  }
+  if (h264parse->qos_skip_gop)
+    return TRUE;
+
+  if (G_UNLIKELY (GST_CLOCK_TIME_IS_VALID (h264parse->seek_target))) {
+    if (!keyframe || (GST_CLOCK_TIME_IS_VALID (timestamp) &&
+            timestamp < h264parse->seek_target))
+      return TRUE;
+    GST_DEBUG_OBJECT (h264parse, "keyframe at %" GST_TIME_FORMAT
+        ", reached the seek position", GST_TIME_ARGS (timestamp));
+    h264parse->seek_target = GST_CLOCK_TIME_NONE;
+  }
+
+  GST_OBJECT_LOCK (h264parse);
+  earliest = h264parse->earliest_time;
+  GST_OBJECT_UNLOCK (h264parse);
+
+  if (!h264parse->qos || !GST_CLOCK_TIME_IS_VALID (earliest) ||
+      !GST_CLOCK_TIME_IS_VALID (timestamp) ||
+      h264parse->segment.format != GST_FORMAT_TIME ||
+      h264parse->segment.rate < 0.0)
+    return FALSE;
+
+  running = gst_segment_to_running_time (&h264parse->segment,
+      GST_FORMAT_TIME, timestamp);
+  if (!GST_CLOCK_TIME_IS_VALID (running) || running >= earliest)
+    return FALSE;
+
+  if (!keyframe && GST_CLOCK_TIME_IS_VALID (h264parse->qos_gop_lateness) &&
+      earliest - running > h264parse->qos_gop_lateness) {
+    h264parse->qos_skip_gop = TRUE;
+    g_atomic_int_add (&h264parse->stats.dropped_gops, 1);
+    h264parse->discont = TRUE;
+    GST_INFO_OBJECT (h264parse, "%" GST_TIME_FORMAT " late, dropping up to "
+        "the next keyframe (%d times)",
+        GST_TIME_ARGS (earliest - running), h264parse->stats.dropped_gops);
+    return TRUE;
+  }
+
+  return link->hdr.nal_ref_idc == 0;
+}
+
+/* push @buffer on the srcpad, with stats-timing we count the time it took */
+static GstFlowReturn
+gst_h264_parse_pad_push (GstH264Parse * h264parse, GstBuffer * buffer)
+{
+  GstClockTime start;
+  GstFlowReturn res;
+
+  if (!h264parse->stats_timing)
+    return gst_pad_push (h264parse->srcpad, buffer);
+
+  start = gst_util_get_timestamp ();
+  res = gst_pad_push (h264parse->srcpad, buffer);
+  gst_h264_parse_stats_add (h264parse, &h264parse->stats.push_time,
+      gst_util_get_timestamp () - start);
+
+  return res;
+}
+
+/* push @list on the srcpad, with stats-timing we count the time it took */
+static GstFlowReturn
+gst_h264_parse_pad_push_list (GstH264Parse * h264parse, GstBufferList * list)
+{
+  GstClockTime start;
+  GstFlowReturn res;
+
+  if (!h264parse->stats_timing)
+    return gst_pad_push_list (h264parse->srcpad, list);
+
+  start = gst_util_get_timestamp ();
+  res = gst_pad_push_list (h264parse->srcpad, list);
+  gst_h264_parse_stats_add (h264parse, &h264parse->stats.push_time,
+      gst_util_get_timestamp () - start);
+
+  return res;
+}
+
+/* start collecting the output groups in a new batch list */
+static void
+gst_h264_parse_start_batch (GstH264Parse * h264parse)
+{
+  h264parse->batch = gst_buffer_list_new ();
+  h264parse->batch_it = gst_buffer_list_iterate (h264parse->batch);
+  h264parse->batch_len = 0;
+}
+
+/* push the groups we collected in the batch, with @restart we continue
+ * collecting in a new one */
+static GstFlowReturn
+gst_h264_parse_push_batch (GstH264Parse * h264parse, gboolean restart)
+{
+  GstBufferList *list;
+  guint len;
+
+  list = h264parse->batch;
+  if (list == NULL)
+    return GST_FLOW_OK;
+
+  len = h264parse->batch_len;
+  gst_buffer_list_iterator_free (h264parse->batch_it);
+  h264parse->batch = NULL;
+  h264parse->batch_it = NULL;
+  if (restart)
+    gst_h264_parse_start_batch (h264parse);
+
+  if (len == 0) {
+    gst_buffer_list_unref (list);
+    return GST_FLOW_OK;
+  }
+
+  GST_LOG_OBJECT (h264parse, "pushing %u groups in one list", len);
+  return gst_h264_parse_pad_push_list (h264parse, list);
+}
+
+/* a group was added to the batch, push it when it is full */
+static GstFlowReturn
+gst_h264_parse_batch_added (GstH264Parse * h264parse)
+{
+  if (++h264parse->batch_len < MAX_BATCH_LEN)
+    return GST_FLOW_OK;
+
+  return gst_h264_parse_push_batch (h264parse, TRUE);
+}
+
+/* push the collected access unit as one buffer list group, downstream elements
+ * without buffer list support get it merged into one buffer. When we only
+ * collected to find the keyframes for NAL output, each NAL unit gets its own
+ * group and keeps its flags and timestamp. */
+static GstFlowReturn
+gst_h264_parse_push_au (GstH264Parse * h264parse)
+{
+  GstBufferList *list;
+  GstBufferListIterator *it;
+  GstBuffer *first;
+  GstClockTime timestamp;
+  gboolean au_output;
+
+  if (h264parse->au == NULL)
+    return GST_FLOW_OK;
+
+  if (h264parse->keyframe_only && !h264parse->au_keyframe) {
+    GST_LOG_OBJECT (h264parse, "dropping access unit without keyframe");
+    gst_h264_parse_clear_au (h264parse);
+    h264parse->discont = TRUE;
+    return GST_FLOW_OK;
+  }
+
+  first = h264parse->au->buffer;
+
+  /* the access unit gets the timestamp of its picture when we know it */
+  timestamp = GST_BUFFER_TIMESTAMP (first);
+  if (h264parse->au_slice &&
+      GST_CLOCK_TIME_IS_VALID (h264parse->au_slice->pts))
+    timestamp = h264parse->au_slice->pts;
+
+  if (h264parse->au_slice && gst_h264_parse_qos_drop (h264parse,
+          h264parse->au_slice, h264parse->au_keyframe ||
+          h264parse->au_slice->hdr.nal_type == NAL_SLICE_IDR ||
+          h264parse->au_slice->recovery_point, timestamp)) {
+    g_atomic_int_add (&h264parse->stats.dropped_aus, 1);
+    GST_LOG_OBJECT (h264parse, "QoS dropped access unit, %d so far",
+        h264parse->stats.dropped_aus);
+    gst_h264_parse_clear_au (h264parse);
+    return GST_FLOW_OK;
+  }
+  au_output = h264parse->output == GST_H264_PARSE_OUTPUT_AU;
+
+  if (au_output && h264parse->au_slice) {
+    g_atomic_int_add (&h264parse->stats.aus, 1);
+    if (h264parse->au_slice->hdr.nal_type == NAL_SLICE_IDR)
+      g_atomic_int_add (&h264parse->stats.idrs, 1);
+  }
+
+  if (h264parse->discont) {
+    GST_BUFFER_FLAG_SET (first, GST_BUFFER_FLAG_DISCONT);
+    h264parse->discont = FALSE;
+  }
+
+  if (au_output) {
+    if (h264parse->au_keyframe)
+      GST_BUFFER_FLAG_UNSET (first, GST_BUFFER_FLAG_DELTA_UNIT);
+    else
+      GST_BUFFER_FLAG_SET (first, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    if (h264parse->au_slice &&
+        GST_CLOCK_TIME_IS_VALID (h264parse->au_slice->pts)) {
+      GST_BUFFER_TIMESTAMP (first) = h264parse->au_slice->pts;
+      GST_BUFFER_DURATION (first) = h264parse->au_slice->duration;
+    } else {
+      /* else the access unit gets the timestamp of its first NAL unit, when
+       * more access units start in the same input buffer only the first one
+       * gets it */
+      timestamp = GST_BUFFER_TIMESTAMP (first);
+      if (timestamp == h264parse->au_timestamp)
+        GST_BUFFER_TIMESTAMP (first) = GST_CLOCK_TIME_NONE;
+      else
+        h264parse->au_timestamp = timestamp;
+    }
+  }
+
+  /* when we batch the groups go in the batch list */
+  if (h264parse->batch) {
+    list = NULL;
+    it = h264parse->batch_it;
+  } else {
+    list = gst_buffer_list_new ();
+    it = gst_buffer_list_iterate (list);
+  }
+  if (au_output)
+    gst_buffer_list_iterator_add_group (it);
+  while (h264parse->au) {
+    GstBuffer *buf = h264parse->au->buffer;
+
+    if (!au_output) {
+      gst_buffer_list_iterator_add_group (it);
+      gst_buffer_set_caps (buf, GST_PAD_CAPS (h264parse->srcpad));
+      if (list == NULL)
+        h264parse->batch_len++;
+    } else if (buf != first) {
+      GST_BUFFER_TIMESTAMP (buf) = GST_CLOCK_TIME_NONE;
+    } else {
+      gst_buffer_set_caps (buf, GST_PAD_CAPS (h264parse->srcpad));
+    }
+    gst_buffer_list_iterator_add (it, buf);
+    h264parse->au = gst_nal_list_delete_head (h264parse, h264parse->au);
+  }
+
+  GST_DEBUG_OBJECT (h264parse, "pushing access unit, keyframe %d, ts %"
+      GST_TIME_FORMAT, h264parse->au_keyframe,
+      GST_TIME_ARGS (GST_BUFFER_TIMESTAMP (first)));
+
+  h264parse->au_last = NULL;
+  h264parse->au_slice = NULL;
+  h264parse->au_keyframe = FALSE;
+
+  if (list == NULL) {
+    if (au_output)
+      return gst_h264_parse_batch_added (h264parse);
+    else if (h264parse->batch_len >= MAX_BATCH_LEN)
+      return gst_h264_parse_push_batch (h264parse, TRUE);
+    return GST_FLOW_OK;
+  }
+
+  gst_buffer_list_iterator_free (it);
+  return gst_h264_parse_pad_push_list (h264parse, list);
+}
+
+/* add a NAL unit to the access unit, pushing out the previous access unit when
+ * this NAL unit starts a new one. SVC and MVC streams have a prefix NAL unit
+ * in front of every base layer slice, the slice after it decides if a new
+ * access unit starts and takes the prefix along. */
+static GstFlowReturn
+gst_h264_parse_collect_au (GstH264Parse * h264parse, GstNalList * link)
+{
+  GstFlowReturn res = GST_FLOW_OK;
+
+  if (gst_h264_parse_is_new_au (h264parse, link)) {
+    GstNalList *prefix = NULL;
+
+    if (link->slice && h264parse->au_last != h264parse->au &&
+        h264parse->au_last->hdr.nal_type == NAL_PREFIX) {
+      GstNalList *prev;
+
+      for (prev = h264parse->au; prev->next != h264parse->au_last;
+          prev = prev->next);
+      prefix = h264parse->au_last;
+      prev->next = NULL;
+      h264parse->au_last = prev;
+    }
+    res = gst_h264_parse_push_au (h264parse);
+    if (prefix) {
+      h264parse->au = prefix;
+      h264parse->au_last = prefix;
+    }
+  }
+
+  if (link->slice && link->hdr.nal_type != NAL_SLICE_DPB &&
+      link->hdr.nal_type != NAL_SLICE_DPC) {
+    if (h264parse->au_slice == NULL) {
+      h264parse->au_slice = link;
+      h264parse->au_keyframe = link->i_frame || link->recovery;
+    } else if (!link->i_frame && !link->recovery) {
+      /* all slices need to be I slices for a keyframe */
+      h264parse->au_keyframe = FALSE;
+    }
+  }
+
+  link->next = NULL;
+  if (h264parse->au_last)
+    h264parse->au_last->next = link;
+  else
+    h264parse->au = link;
+  h264parse->au_last = link;
+
+  return res;
+}
+
+/* parse all the NAL units of the packetized data in @data into @link, returns
+ * TRUE when there is an IDR slice, @params is set when there is a SPS or PPS */
+static gboolean
+gst_h264_parse_parse_packetized (GstH264Parse * h264parse, GstNalList * link,
+    const guint8 * data, guint size, gboolean * params)
+{
+  guint32 nalu_size;
+  gboolean idr = FALSE;
+
+  *params = FALSE;
+
+  while (size > h264parse->nal_length_size) {
+    nalu_size = gst_h264_parse_read_nalu_size (h264parse, data);
+    data += h264parse->nal_length_size;
+    size -= h264parse->nal_length_size;
+    nalu_size = MIN (nalu_size, size);
+    if (nalu_size == 0)
+      continue;
+
+    gst_h264_parse_parse_nal (h264parse, link, data, nalu_size);
+    gst_h264_parse_count_nal (h264parse, link, nalu_size);
+    if (link->hdr.nal_type == NAL_SLICE_IDR)
+      idr = TRUE;
+    else if (link->hdr.nal_type == NAL_SPS || link->hdr.nal_type == NAL_PPS)
+      *params = TRUE;
+
+    data += nalu_size;
+    size -= nalu_size;
+  }
+  return idr;
+}
+
+/* update the codec_data in the src caps after a parameter set change when we
+ * convert bytestream to packetized */
+static GstFlowReturn
+gst_h264_parse_update_caps (GstH264Parse * h264parse)
+{
+  GstFlowReturn res;
+
+  if (!h264parse->update_caps)
+    return GST_FLOW_OK;
+
+  h264parse->update_caps = FALSE;
+  if (!h264parse->out_packetized || h264parse->packetized)
+    return GST_FLOW_OK;
+
+  /* a list is pushed with the caps of its first buffer, the batch can't
+   * contain buffers with the new caps */
+  res = gst_h264_parse_push_batch (h264parse, TRUE);
+  gst_h264_parse_set_src_caps (h264parse, GST_PAD_CAPS (h264parse->srcpad));
+
+  return res;
+}
+
+/* push @outbuf on its own or add it to the batch of the input buffer, the
+ * parameter sets in @config go in front of it in the same group */
+static GstFlowReturn
+gst_h264_parse_push_group (GstH264Parse * h264parse, GstBuffer * config,
+    GstBuffer * outbuf)
+{
+  GstBufferList *list;
+  GstBufferListIterator *it;
+  GstBuffer *first;
+  GstFlowReturn res;
+
+  res = gst_h264_parse_update_caps (h264parse);
+  if (res != GST_FLOW_OK) {
+    if (config)
+      gst_buffer_unref (config);
+    gst_buffer_unref (outbuf);
+    return res;
+  }
+
+  first = config ? config : outbuf;
+
+  GST_DEBUG_OBJECT (h264parse,
+      "pushing buffer %p, size %u, ts %" GST_TIME_FORMAT, outbuf,
+      GST_BUFFER_SIZE (outbuf), GST_TIME_ARGS (GST_BUFFER_TIMESTAMP (outbuf)));
+
+  if (h264parse->discont) {
+    GST_BUFFER_FLAG_SET (first, GST_BUFFER_FLAG_DISCONT);
+    h264parse->discont = FALSE;
+  }
+
+  /* a group is pushed with the caps of its first buffer */
+  gst_buffer_set_caps (first, GST_PAD_CAPS (h264parse->srcpad));
+
+  if (h264parse->batch) {
+    gst_buffer_list_iterator_add_group (h264parse->batch_it);
+    if (config)
+      gst_buffer_list_iterator_add (h264parse->batch_it, config);
+    gst_buffer_list_iterator_add (h264parse->batch_it, outbuf);
+    return gst_h264_parse_batch_added (h264parse);
+  }
+  if (config == NULL)
+    return gst_h264_parse_pad_push (h264parse, outbuf);
+
+  list = gst_buffer_list_new ();
+  it = gst_buffer_list_iterate (list);
+  gst_buffer_list_iterator_add_group (it);
+  gst_buffer_list_iterator_add (it, config);
+  gst_buffer_list_iterator_add (it, outbuf);
+  gst_buffer_list_iterator_free (it);
+
+  return gst_h264_parse_pad_push_list (h264parse, list);
+}
+
+/* push @outbuf on its own or add it to the batch of the input buffer */
+static GstFlowReturn
+gst_h264_parse_push_buffer (GstH264Parse * h264parse, GstBuffer * outbuf)
+{
+  return gst_h264_parse_push_group (h264parse, NULL, outbuf);
+}
+
+/* push @outbuf described by @nal or add it to the access unit */
+static GstFlowReturn
+gst_h264_parse_push_nal (GstH264Parse * h264parse, GstNalList * nal,
+    GstBuffer * outbuf)
+{
+  GstFlowReturn res;
+
+  /* in keyframe only mode we need the complete access unit to know if it
+   * can be dropped */
+  if (h264parse->output == GST_H264_PARSE_OUTPUT_AU ||
+      h264parse->keyframe_only) {
+    GstNalList *link;
+
+    link = gst_nal_list_new (h264parse, outbuf);
+    *link = *nal;
+    link->buffer = outbuf;
+    res = gst_h264_parse_collect_au (h264parse, link);
+    /* the previous access unit is out, changed parameter sets apply to the
+     * one we're collecting now */
+    if (res == GST_FLOW_OK)
+      res = gst_h264_parse_update_caps (h264parse);
+    return res;
+  }
+
+  /* we're not collecting anymore */
+  if (G_UNLIKELY (h264parse->au)) {
+    res = gst_h264_parse_push_au (h264parse);
+    if (res != GST_FLOW_OK) {
+      gst_buffer_unref (outbuf);
+      return res;
+    }
+  }
+
+  return gst_h264_parse_push_buffer (h264parse, outbuf);
+}
+
+/* insert @entry in @keyframes sorted on offset, returns FALSE when there
+ * already is a keyframe at that offset */
+static gboolean
+gst_h264_keyframes_insert (GArray * keyframes, const GstH264Keyframe * entry)
+{
+  guint lo, hi, mid;
+
+  lo = 0;
+  hi = keyframes->len;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (g_array_index (keyframes, GstH264Keyframe, mid).offset < entry->offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < keyframes->len &&
+      g_array_index (keyframes, GstH264Keyframe, lo).offset == entry->offset)
+    return FALSE;
+
+  g_array_insert_vals (keyframes, lo, entry, 1);
+  return TRUE;
+}
+
+/* add the access unit of @type at upstream @offset to the keyframe index, we
+ * keep the array sorted on offset because we see the same keyframes again
+ * when seeking back */
+static void
+gst_h264_parse_add_keyframe (GstH264Parse * h264parse, guint64 offset,
+    GstClockTime timestamp, guint type)
+{
+  GstH264Keyframe entry;
+  GstIndex *index;
+  gint id;
+
+  if (offset == GST_BUFFER_OFFSET_NONE || !GST_CLOCK_TIME_IS_VALID (timestamp))
+    return;
+
+  entry.offset = offset;
+  entry.timestamp = timestamp;
+  entry.type = type;
+
+  GST_OBJECT_LOCK (h264parse);
+  if (!gst_h264_keyframes_insert (h264parse->keyframes, &entry)) {
+    GST_OBJECT_UNLOCK (h264parse);
+    return;
+  }
+  index = h264parse->index ? gst_object_ref (h264parse->index) : NULL;
+  id = h264parse->index_id;
+  GST_OBJECT_UNLOCK (h264parse);
+
+  GST_LOG_OBJECT (h264parse, "keyframe at offset %" G_GUINT64_FORMAT ", ts %"
+      GST_TIME_FORMAT, offset, GST_TIME_ARGS (timestamp));
+
+  if (index) {
+    gst_index_add_association (index, id, GST_ASSOCIATION_FLAG_KEY_UNIT,
+        GST_FORMAT_TIME, timestamp, GST_FORMAT_BYTES, offset, NULL);
+    gst_object_unref (index);
+  }
+}
+
+static void
+gst_h264_parse_read_index_record (const guint8 * data, GstH264Keyframe * entry)
+{
+  entry->offset = GST_READ_UINT64_BE (data);
+  entry->timestamp = GST_READ_UINT64_BE (data + 8);
+  entry->type = GST_READ_UINT32_BE (data + 16);
+}
+
+/* read keyframe @i of the index file @records or of @keyframes */
+static inline void
+gst_h264_parse_keyframe_at (const guint8 * records, GArray * keyframes,
+    guint i, GstH264Keyframe * entry)
+{
+  if (records)
+    gst_h264_parse_read_index_record (records + i * INDEX_RECORD_SIZE, entry);
+  else
+    *entry = g_array_index (keyframes, GstH264Keyframe, i);
+}
+
+/* binary search for @timestamp in the @len keyframes of the index file
+ * @records or of @keyframes. Returns the number of keyframes at or before
+ * @timestamp, @entry is set to the last of them. */
+static guint
+gst_h264_parse_search_keyframes (const guint8 * records, GArray * keyframes,
+    guint len, GstClockTime timestamp, GstH264Keyframe * entry)
+{
+  GstH264Keyframe mid_entry;
+  guint lo, hi, mid;
+
+  lo = 0;
+  hi = len;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    gst_h264_parse_keyframe_at (records, keyframes, mid, &mid_entry);
+    if (mid_entry.timestamp <= timestamp)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo > 0)
+    gst_h264_parse_keyframe_at (records, keyframes, lo - 1, entry);
+
+  return lo;
+}
+
+/* find the last keyframe at or before @timestamp in the index file and in the
+ * keyframes we found since, returns FALSE when @timestamp is not in the
+ * indexed part of the stream, @keyframe is then the last keyframe in front of
+ * it when there is one. The records of the index file are only touched by the
+ * binary search. */
+static gboolean
+gst_h264_parse_find_keyframe (GstH264Parse * h264parse,
+    GstClockTime timestamp, GstH264Keyframe * keyframe)
+{
+  GArray *keyframes = h264parse->keyframes;
+  GstH264Keyframe file_entry = { 0, }, entry = { 0, };
+  gboolean res = FALSE;
+  guint n_records, n_file, n_found;
+
+  GST_OBJECT_LOCK (h264parse);
+  n_records = h264parse->index_records ? h264parse->index_n_records : 0;
+  n_file = gst_h264_parse_search_keyframes (h264parse->index_records, NULL,
+      n_records, timestamp, &file_entry);
+  n_found = gst_h264_parse_search_keyframes (NULL, keyframes, keyframes->len,
+      timestamp, &entry);
+  if (n_file == 0 && n_found == 0)
+    goto done;
+
+  /* the closest one of both */
+  if (n_found == 0 || (n_file > 0 && file_entry.timestamp > entry.timestamp))
+    entry = file_entry;
+
+  *keyframe = entry;
+
+  /* we don't know where the next keyframe after the last one is */
+  if (n_file == n_records && n_found == keyframes->len &&
+      entry.timestamp < timestamp)
+    goto done;
+
+  res = TRUE;
+
+done:
+  GST_OBJECT_UNLOCK (h264parse);
+  return res;
+}
+
+/* get the size and mtime of the file upstream reads */
+static gboolean
+gst_h264_parse_stat_source (GstH264Parse * h264parse, guint64 * size,
+    gint64 * mtime)
+{
+  GstQuery *query;
+  gchar *uri = NULL, *filename;
+  struct stat st;
+  gboolean res = FALSE;
+
+  query = gst_query_new_uri ();
+  if (gst_pad_peer_query (h264parse->sinkpad, query))
+    gst_query_parse_uri (query, &uri);
+  gst_query_unref (query);
+  if (uri == NULL)
+    return FALSE;
+
+  filename = g_filename_from_uri (uri, NULL, NULL);
+  g_free (uri);
+  if (filename == NULL)
+    return FALSE;
+
+  if (g_stat (filename, &st) == 0) {
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    res = TRUE;
   }
-  h264parse->decode = NULL;
-  h264parse->decode_len = 0;
-  if (h264parse->prev) {
-    gst_buffer_unref (h264parse->prev);
-    h264parse->prev = NULL;
+  g_free (filename);
+
+  return res;
+}
+
+/* map the keyframe index file when it was written for the stream upstream
+ * reads, this is only done once per stream */
+static void
+gst_h264_parse_open_index (GstH264Parse * h264parse)
+{
+  GMappedFile *file;
+  GError *err = NULL;
+  const guint8 *data;
+  gchar *location;
+  gsize len;
+  guint64 size;
+  gint64 mtime;
+
+  GST_OBJECT_LOCK (h264parse);
+  if (h264parse->index_checked || h264parse->index_location == NULL) {
+    GST_OBJECT_UNLOCK (h264parse);
+    return;
+  }
+  h264parse->index_checked = TRUE;
+  location = g_strdup (h264parse->index_location);
+  GST_OBJECT_UNLOCK (h264parse);
+
+  if (!gst_h264_parse_stat_source (h264parse, &size, &mtime))
+    goto no_source;
+
+  GST_OBJECT_LOCK (h264parse);
+  h264parse->source_size = size;
+  h264parse->source_mtime = mtime;
+  h264parse->source_known = TRUE;
+  GST_OBJECT_UNLOCK (h264parse);
+
+  file = g_mapped_file_new (location, FALSE, &err);
+  if (file == NULL)
+    goto open_failed;
+
+  data = (const guint8 *) g_mapped_file_get_contents (file);
+  len = g_mapped_file_get_length (file);
+  if (len < INDEX_HEADER_SIZE ||
+      (len - INDEX_HEADER_SIZE) % INDEX_RECORD_SIZE != 0 ||
+      memcmp (data, INDEX_FILE_MAGIC, 8) != 0)
+    goto invalid;
+  if (GST_READ_UINT64_BE (data + 8) != size ||
+      (gint64) GST_READ_UINT64_BE (data + 16) != mtime)
+    goto stale;
+
+  GST_OBJECT_LOCK (h264parse);
+  h264parse->index_file = file;
+  h264parse->index_records = data + INDEX_HEADER_SIZE;
+  h264parse->index_n_records = (len - INDEX_HEADER_SIZE) / INDEX_RECORD_SIZE;
+  GST_OBJECT_UNLOCK (h264parse);
+
+  GST_DEBUG_OBJECT (h264parse, "using %u keyframes from %s",
+      h264parse->index_n_records, location);
+  g_free (location);
+  return;
+
+  /* ERRORS */
+no_source:
+  {
+    GST_DEBUG_OBJECT (h264parse, "unknown upstream file, not using %s",
+        location);
+    g_free (location);
+    return;
+  }
+open_failed:
+  {
+    GST_DEBUG_OBJECT (h264parse, "no index file: %s", err->message);
+    g_error_free (err);
+    g_free (location);
+    return;
+  }
+invalid:
+  {
+    GST_WARNING_OBJECT (h264parse, "%s is not a keyframe index", location);
+    g_mapped_file_free (file);
+    g_free (location);
+    return;
+  }
+stale:
+  {
+    GST_DEBUG_OBJECT (h264parse, "%s was written for another version of the "
+        "stream", location);
+    g_mapped_file_free (file);
+    g_free (location);
+    return;
+  }
+}
+
+/* write the keyframes of the index file together with the ones we found to a
+ * new index file, nothing is written when we found no new keyframes */
+static void
+gst_h264_parse_write_index (GstH264Parse * h264parse)
+{
+  GArray *keyframes;
+  GError *err = NULL;
+  gchar *location;
+  guint8 *data, *p;
+  guint i, added = 0;
+  gsize len;
+
+  GST_OBJECT_LOCK (h264parse);
+  if (h264parse->index_location == NULL || !h264parse->source_known) {
+    GST_OBJECT_UNLOCK (h264parse);
+    return;
+  }
+
+  keyframes = g_array_sized_new (FALSE, FALSE, sizeof (GstH264Keyframe),
+      h264parse->index_n_records + h264parse->keyframes->len);
+  g_array_set_size (keyframes, h264parse->index_n_records);
+  for (i = 0; i < h264parse->index_n_records; i++)
+    gst_h264_parse_read_index_record (h264parse->index_records +
+        i * INDEX_RECORD_SIZE, &g_array_index (keyframes, GstH264Keyframe, i));
+  for (i = 0; i < h264parse->keyframes->len; i++) {
+    if (gst_h264_keyframes_insert (keyframes,
+            &g_array_index (h264parse->keyframes, GstH264Keyframe, i)))
+      added++;
+  }
+
+  len = INDEX_HEADER_SIZE + keyframes->len * INDEX_RECORD_SIZE;
+  data = p = g_malloc0 (len);
+  memcpy (p, INDEX_FILE_MAGIC, 8);
+  GST_WRITE_UINT64_BE (p + 8, h264parse->source_size);
+  GST_WRITE_UINT64_BE (p + 16, h264parse->source_mtime);
+  location = g_strdup (h264parse->index_location);
+  GST_OBJECT_UNLOCK (h264parse);
+
+  if (added == 0)
+    goto done;
+
+  p += INDEX_HEADER_SIZE;
+  for (i = 0; i < keyframes->len; i++) {
+    GstH264Keyframe *entry = &g_array_index (keyframes, GstH264Keyframe, i);
+
+    GST_WRITE_UINT64_BE (p, entry->offset);
+    GST_WRITE_UINT64_BE (p + 8, entry->timestamp);
+    GST_WRITE_UINT32_BE (p + 16, entry->type);
+    p += INDEX_RECORD_SIZE;
+  }
+
+  GST_DEBUG_OBJECT (h264parse, "writing %u keyframes to %s", keyframes->len,
+      location);
+  if (!g_file_set_contents (location, (const gchar *) data, len, &err)) {
+    GST_WARNING_OBJECT (h264parse, "could not write index: %s", err->message);
+    g_error_free (err);
+  }
+
+done:
+  g_free (data);
+  g_free (location);
+  g_array_free (keyframes, TRUE);
+}
+
+static void
+gst_h264_parse_close_index (GstH264Parse * h264parse)
+{
+  GST_OBJECT_LOCK (h264parse);
+  if (h264parse->index_file)
+    g_mapped_file_free (h264parse->index_file);
+  h264parse->index_file = NULL;
+  h264parse->index_records = NULL;
+  h264parse->index_n_records = 0;
+  h264parse->index_checked = FALSE;
+  h264parse->source_known = FALSE;
+  GST_OBJECT_UNLOCK (h264parse);
+}
+
+/* get the timestamps of the first and the last keyframe we know, in the index
+ * file or found since */
+static gboolean
+gst_h264_parse_get_index_range (GstH264Parse * h264parse, gint64 * start,
+    gint64 * stop)
+{
+  GArray *keyframes = h264parse->keyframes;
+  GstH264Keyframe first = { 0, }, last = { 0, }, entry;
+  gboolean res = FALSE;
+
+  GST_OBJECT_LOCK (h264parse);
+  if (h264parse->index_records && h264parse->index_n_records > 0) {
+    gst_h264_parse_read_index_record (h264parse->index_records, &first);
+    gst_h264_parse_read_index_record (h264parse->index_records +
+        (h264parse->index_n_records - 1) * INDEX_RECORD_SIZE, &last);
+    res = TRUE;
+  }
+  if (keyframes->len > 0) {
+    entry = g_array_index (keyframes, GstH264Keyframe, 0);
+    if (!res || entry.timestamp < first.timestamp)
+      first = entry;
+    entry = g_array_index (keyframes, GstH264Keyframe, keyframes->len - 1);
+    if (!res || entry.timestamp > last.timestamp)
+      last = entry;
+    res = TRUE;
+  }
+  GST_OBJECT_UNLOCK (h264parse);
+
+  if (res) {
+    *start = first.timestamp;
+    *stop = last.timestamp;
+  }
+  return res;
+}
+
+/* check if config-interval wants the parameter sets in front of the IDR frame
+ * with @timestamp */
+static gboolean
+gst_h264_parse_config_due (GstH264Parse * h264parse, GstClockTime timestamp)
+{
+  GstClockTime interval;
+
+  if (h264parse->config_interval == 0)
+    return FALSE;
+  if (h264parse->config_interval < 0)
+    return TRUE;
+  if (!GST_CLOCK_TIME_IS_VALID (timestamp) ||
+      !GST_CLOCK_TIME_IS_VALID (h264parse->last_config) ||
+      timestamp < h264parse->last_config)
+    return TRUE;
+
+  interval = h264parse->config_interval * GST_SECOND;
+  return timestamp - h264parse->last_config >= interval;
+}
+
+/* push the cached parameter sets as one buffer in front of @outbuf described
+ * by @nal, the cached buffer is not copied */
+static GstFlowReturn
+gst_h264_parse_push_codec_nals (GstH264Parse * h264parse, GstNalList * nal,
+    GstBuffer * outbuf)
+{
+  GstNalList config_nal = { NULL, };
+  GstBuffer *config;
+  GstFlowReturn res;
+
+  config = gst_h264_parse_get_codec_nals (h264parse);
+  if (config == NULL)
+    return gst_h264_parse_push_nal (h264parse, nal, outbuf);
+
+  GST_DEBUG_OBJECT (h264parse, "sending %u bytes of SPS and PPS",
+      GST_BUFFER_SIZE (config));
+
+  config = gst_buffer_make_metadata_writable (gst_buffer_ref (config));
+  GST_BUFFER_TIMESTAMP (config) = GST_BUFFER_TIMESTAMP (outbuf);
+  GST_BUFFER_FLAG_UNSET (config, GST_BUFFER_FLAG_DELTA_UNIT);
+  h264parse->last_config = GST_BUFFER_TIMESTAMP (outbuf);
+  h264parse->config_sent = TRUE;
+
+  /* when collecting they start the access unit of the keyframe */
+  if (h264parse->output == GST_H264_PARSE_OUTPUT_AU ||
+      h264parse->keyframe_only) {
+    config_nal.hdr.nal_type = NAL_SPS;
+    res = gst_h264_parse_push_nal (h264parse, &config_nal, config);
+    if (res != GST_FLOW_OK) {
+      gst_buffer_unref (outbuf);
+      return res;
+    }
+    return gst_h264_parse_push_nal (h264parse, nal, outbuf);
+  }
+
+  if (G_UNLIKELY (h264parse->au)) {
+    res = gst_h264_parse_push_au (h264parse);
+    if (res != GST_FLOW_OK) {
+      gst_buffer_unref (config);
+      gst_buffer_unref (outbuf);
+      return res;
+    }
+  }
+
+  /* else in the same group, with packetized output a group is one sample */
+  return gst_h264_parse_push_group (h264parse, config, outbuf);
+}
+
+/* Figure out if the NAL units in @link are a delta unit. Parameter sets can be
+ * considered as non delta units, like the prefix and slice extension NAL units
+ * of IDR and anchor pictures in the enhancement layers. */
+static inline gboolean
+gst_h264_parse_is_delta_unit (GstNalList * link)
+{
+  if (link->i_frame || link->recovery)
+    return FALSE;
+
+  switch (link->hdr.nal_type) {
+    case NAL_SPS:
+    case NAL_PPS:
+    case NAL_SUBSET_SPS:
+      return FALSE;
+    case NAL_PREFIX:
+    case NAL_SLICE_EXT:
+      return !link->hdr.ext_idr && !link->hdr.anchor_pic;
+    default:
+      return TRUE;
+  }
+}
+
+/* the NAL units of the SVC and MVC enhancement layers and views, a base layer
+ * decoder ignores them */
+static inline gboolean
+gst_h264_parse_is_enhancement (gint nal_type)
+{
+  return nal_type == NAL_PREFIX || nal_type == NAL_SUBSET_SPS ||
+      nal_type == NAL_SLICE_EXT;
+}
+
+/* remove the enhancement layer NAL units from the packetized @buffer, the data
+ * is only copied when there are any */
+static GstBuffer *
+gst_h264_parse_strip_packetized (GstH264Parse * h264parse, GstBuffer * buffer)
+{
+  const guint8 *data = GST_BUFFER_DATA (buffer);
+  guint size = GST_BUFFER_SIZE (buffer);
+  guint prefix_size = h264parse->nal_length_size;
+  guint pos, nalu_size, out_size = 0;
+  gboolean strip = FALSE;
+  GstBuffer *outbuf;
+
+  for (pos = 0; pos + prefix_size < size; pos += prefix_size + nalu_size) {
+    nalu_size = gst_h264_parse_read_nalu_size (h264parse, data + pos);
+    nalu_size = MIN (nalu_size, size - pos - prefix_size);
+    if (nalu_size > 0 &&
+        gst_h264_parse_is_enhancement (data[pos + prefix_size] & 0x1f)) {
+      strip = TRUE;
+      break;
+    }
+  }
+  if (!strip)
+    return buffer;
+
+  outbuf = gst_buffer_new_and_alloc (size);
+  for (pos = 0; pos + prefix_size < size; pos += prefix_size + nalu_size) {
+    nalu_size = gst_h264_parse_read_nalu_size (h264parse, data + pos);
+    nalu_size = MIN (nalu_size, size - pos - prefix_size);
+    if (nalu_size > 0 &&
+        gst_h264_parse_is_enhancement (data[pos + prefix_size] & 0x1f)) {
+      g_atomic_int_add (&h264parse->stats.stripped_nals, 1);
+      continue;
+    }
+    memcpy (GST_BUFFER_DATA (outbuf) + out_size, data + pos,
+        prefix_size + nalu_size);
+    out_size += prefix_size + nalu_size;
+  }
+  GST_BUFFER_SIZE (outbuf) = out_size;
+  gst_buffer_copy_metadata (outbuf, buffer,
+      GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS);
+  gst_buffer_unref (buffer);
+
+  return outbuf;
+}
+
+/* output the NAL unit of @size bytes at the start of the adapter, the first
+ * @prefix_size bytes are the sync code or the NALU size */
+static GstFlowReturn
+gst_h264_parse_output_nal (GstH264Parse * h264parse, guint size,
+    guint prefix_size, GstClockTime timestamp)
+{
+  const guint8 *data;
+  guint avail;
+  GstNalList nal = { NULL, };
+  GstBuffer *outbuf;
+  gboolean delta_unit, idr, recovery, params = FALSE;
+
+  nal.pts = GST_CLOCK_TIME_NONE;
+  nal.duration = GST_CLOCK_TIME_NONE;
+
+  if (h264parse->packetized && !h264parse->split_packetized) {
+    /* a complete packetized buffer, it is the only data in the adapter so we
+     * can look at all of its NAL units without copying */
+    data = gst_adapter_peek (h264parse->adapter, size);
+    h264parse->sei_data = data;
+    idr = gst_h264_parse_parse_packetized (h264parse, &nal, data, size,
+        &params);
+    h264parse->sei_data = NULL;
+    recovery = nal.recovery;
+  } else {
+    /* we only need the start of the NAL unit to figure out what it is, don't
+     * peek more so that we don't merge the input buffers */
+    avail = MIN (size, prefix_size + NAL_HEADER_PEEK_SIZE);
+    data = gst_adapter_peek (h264parse->adapter, avail);
+
+    /* parameter sets and the SEI messages we use are small and parsed
+     * completely */
+    if (avail > prefix_size && avail < size) {
+      gint nal_type = data[prefix_size] & 0x1f;
+
+      if (nal_type == NAL_SPS || nal_type == NAL_PPS ||
+          (nal_type == NAL_SEI && gst_h264_parse_want_sei (h264parse))) {
+        avail = size;
+        data = gst_adapter_peek (h264parse->adapter, avail);
+      }
+    }
+
+    /* skip nalu_size bytes or sync */
+    h264parse->sei_data = data;
+    gst_h264_parse_parse_nal (h264parse, &nal, data + prefix_size,
+        avail - prefix_size);
+    h264parse->sei_data = NULL;
+    gst_h264_parse_count_nal (h264parse, &nal, size - prefix_size);
+    idr = nal.hdr.nal_type == NAL_SLICE_IDR && nal.hdr.first_mb_in_slice == 0;
+    recovery = nal.recovery && nal.hdr.first_mb_in_slice == 0;
+
+    if (h264parse->strip_enhancement &&
+        gst_h264_parse_is_enhancement (nal.hdr.nal_type)) {
+      g_atomic_int_add (&h264parse->stats.stripped_nals, 1);
+      gst_h264_parse_flush (h264parse, size);
+      return GST_FLOW_OK;
+    }
+  }
+
+  /* the NAL units in front of a picture can have its upstream timestamp */
+  if (h264parse->after_slice)
+    h264parse->ts_prefix = GST_CLOCK_TIME_NONE;
+  if (!nal.slice) {
+    if (GST_CLOCK_TIME_IS_VALID (timestamp))
+      h264parse->ts_prefix = timestamp;
+  } else if (h264parse->interpolate) {
+    gst_h264_parse_slice_timestamp (h264parse, &nal,
+        GST_CLOCK_TIME_IS_VALID (timestamp) ? timestamp :
+        h264parse->ts_prefix);
+    if (GST_CLOCK_TIME_IS_VALID (nal.pts))
+      timestamp = nal.pts;
+  }
+
+  /* the NAL units in front of the first slice of an IDR frame belong to its
+   * access unit, that's where a seek has to go */
+  if (h264parse->after_slice) {
+    if (h264parse->upstream_offset != GST_BUFFER_OFFSET_NONE)
+      h264parse->au_offset = h264parse->upstream_offset +
+          h264parse->adapter_offset;
+    else
+      h264parse->au_offset = GST_BUFFER_OFFSET_NONE;
+  }
+  h264parse->after_slice = nal.slice;
+  if (idr)
+    gst_h264_parse_add_keyframe (h264parse, h264parse->au_offset, timestamp,
+        KEYFRAME_IDR);
+  else if (recovery)
+    gst_h264_parse_add_keyframe (h264parse, h264parse->au_offset, timestamp,
+        KEYFRAME_RECOVERY);
+
+  /* access units are dropped as a whole when we push them */
+  if (h264parse->output == GST_H264_PARSE_OUTPUT_NAL &&
+      !h264parse->keyframe_only &&
+      gst_h264_parse_qos_drop (h264parse, &nal, idr ||
+          nal.hdr.nal_type == NAL_SLICE_IDR || ((nal.i_frame ||
+                  nal.recovery_point) && nal.hdr.first_mb_in_slice == 0),
+          timestamp)) {
+    g_atomic_int_add (&h264parse->stats.dropped_nals, 1);
+    GST_LOG_OBJECT (h264parse, "QoS dropped NAL unit, %d so far",
+        h264parse->stats.dropped_nals);
+    gst_h264_parse_clear_user_data (h264parse);
+    gst_h264_parse_flush (h264parse, size);
+    return GST_FLOW_OK;
+  }
+
+  delta_unit = gst_h264_parse_is_delta_unit (&nal);
+
+  outbuf = gst_h264_parse_take (h264parse, size);
+  if (h264parse->user_data->len > 0)
+    gst_h264_parse_emit_user_data (h264parse, outbuf, timestamp);
+  if (h264parse->strip_enhancement && h264parse->packetized &&
+      !h264parse->split_packetized) {
+    outbuf = gst_h264_parse_strip_packetized (h264parse, outbuf);
+    if (GST_BUFFER_SIZE (outbuf) == 0) {
+      gst_buffer_unref (outbuf);
+      return GST_FLOW_OK;
+    }
+  }
+
+  if (h264parse->packetized != h264parse->out_packetized)
+    outbuf = gst_h264_parse_convert (h264parse, outbuf);
+  GST_BUFFER_TIMESTAMP (outbuf) = timestamp;
+  if (GST_CLOCK_TIME_IS_VALID (nal.duration))
+    GST_BUFFER_DURATION (outbuf) = nal.duration;
+
+  if (delta_unit)
+    GST_BUFFER_FLAG_SET (outbuf, GST_BUFFER_FLAG_DELTA_UNIT);
+  else
+    GST_BUFFER_FLAG_UNSET (outbuf, GST_BUFFER_FLAG_DELTA_UNIT);
+
+  if (params || nal.hdr.nal_type == NAL_SPS || nal.hdr.nal_type == NAL_PPS) {
+    /* the stream has its own parameter sets here */
+    h264parse->last_config = timestamp;
+    h264parse->config_sent = TRUE;
+  } else if ((idr || recovery) && !h264parse->config_sent &&
+      gst_h264_parse_config_due (h264parse, timestamp)) {
+    h264parse->push_codec_nals = TRUE;
+  }
+  if (nal.slice || idr)
+    h264parse->config_sent = FALSE;
+
+  /* the parameter sets are not in the caps of bytestream output, send them
+   * in front of the first NAL unit and of keyframes for config-interval */
+  if (h264parse->push_codec_nals) {
+    h264parse->push_codec_nals = FALSE;
+    return gst_h264_parse_push_codec_nals (h264parse, &nal, outbuf);
+  }
+
+  return gst_h264_parse_push_nal (h264parse, &nal, outbuf);
+}
+
+/* in low latency mode the buffer we got ends a NAL unit, output the data
+ * after the last sync code and the access unit when it ends with a slice */
+static GstFlowReturn
+gst_h264_parse_flush_aligned (GstH264Parse * h264parse)
+{
+  GstFlowReturn res = GST_FLOW_OK;
+
+  if (!h264parse->packetized &&
+      h264parse->nal_starts->len == h264parse->nal_starts_head + 1) {
+    GstH264NalStart *start;
+    guint avail, prefix_size;
+
+    start = &g_array_index (h264parse->nal_starts, GstH264NalStart,
+        h264parse->nal_starts_head);
+    prefix_size = start->zeros ? 4 : 3;
+    avail = gst_adapter_available (h264parse->adapter);
+
+    /* the zeros at the end can be the start of the next sync code, we keep
+     * them in the adapter */
+    if (start->offset + 3 - prefix_size == h264parse->adapter_offset &&
+        avail > h264parse->zero_run + prefix_size) {
+      h264parse->nal_starts_head++;
+      res = gst_h264_parse_output_nal (h264parse,
+          avail - h264parse->zero_run, prefix_size, start->timestamp);
+    }
+  }
+
+  if (res == GST_FLOW_OK && h264parse->au_last && h264parse->au_last->slice)
+    res = gst_h264_parse_push_au (h264parse);
+
+  return res;
+}
+
+/* the packetized data in @data of @size bytes starts with an invalid NALU
+ * size, drop the data up to the next valid one in the resync window. Returns
+ * FALSE when there is none but the NAL header looks valid, the NAL unit then
+ * gets the rest of the data. */
+static gboolean
+gst_h264_parse_resync_packetized (GstH264Parse * h264parse,
+    const guint8 * data, guint size)
+{
+  guint len = h264parse->nal_length_size;
+  gint skip;
+
+  skip = gst_h264_find_nalu (data + 1, size - 1, len,
+      h264parse->max_nal_size, h264parse->resync_window);
+  if (skip >= 0) {
+    gst_h264_parse_drop_corrupt (h264parse, skip + 1);
+    return TRUE;
+  }
+  if (gst_h264_nal_header_valid (data[len]))
+    return FALSE;
+
+  gst_h264_parse_drop_corrupt (h264parse, size);
+  return TRUE;
+}
+
+/* the number of bytes at the start of the packetized data in @data that are
+ * NAL units with valid sizes, a tail too small for a NALU size is included */
+static guint
+gst_h264_parse_valid_packetized (GstH264Parse * h264parse,
+    const guint8 * data, guint size)
+{
+  guint len = h264parse->nal_length_size;
+  guint pos = 0;
+  guint32 nalu_size;
+
+  while (size - pos > len) {
+    nalu_size = gst_h264_parse_read_nalu_size (h264parse, data + pos);
+    if (!gst_h264_parse_nalu_size_valid (h264parse, nalu_size,
+            size - pos - len))
+      return pos;
+    pos += len + nalu_size;
+  }
+  return size;
+}
+
+/* packetized input usually has one access unit per buffer already, when we
+ * don't have to change it we only look at the NAL units up to the first slice
+ * and push the buffer as is instead of going through the adapter. Returns
+ * FALSE when @buffer has to be handled the normal way. */
+static gboolean
+gst_h264_parse_passthrough (GstH264Parse * h264parse, GstBuffer * buffer,
+    GstFlowReturn * res)
+{
+  GstNalList nal = { NULL, };
+  GstClockTime timestamp;
+  const guint8 *data;
+  guint size, nalu_size, pos;
+  gboolean idr, delta_unit, have_slice = FALSE;
+
+  if (!h264parse->passthrough || h264parse->split_packetized ||
+      h264parse->strip_enhancement ||
+      !h264parse->out_packetized || h264parse->keyframe_only ||
+      h264parse->seek_skip || h264parse->config_interval != 0 ||
+      h264parse->push_codec_nals || h264parse->au ||
+      gst_adapter_available (h264parse->adapter) > 0)
+    return FALSE;
+
+  data = GST_BUFFER_DATA (buffer);
+  size = GST_BUFFER_SIZE (buffer);
+
+  /* the normal path fixes up and counts invalid NALU sizes */
+  for (pos = 0; pos < size; pos += nalu_size) {
+    gint nal_type;
+
+    if (size - pos <= h264parse->nal_length_size)
+      return FALSE;
+    nalu_size = gst_h264_parse_read_nalu_size (h264parse, data + pos);
+    pos += h264parse->nal_length_size;
+    if (!gst_h264_parse_nalu_size_valid (h264parse, nalu_size, size - pos))
+      return FALSE;
+    nal_type = data[pos] & 0x1f;
+    if (nal_type >= NAL_SLICE && nal_type <= NAL_SLICE_IDR)
+      have_slice = TRUE;
+  }
+
+  /* access units have to start at the buffer start and contain a picture,
+   * checked before the parsing below changes any state */
+  if (h264parse->output == GST_H264_PARSE_OUTPUT_AU) {
+    GstH264NalHeader hdr;
+
+    if (!have_slice)
+      goto not_aligned;
+    gst_h264_read_nal_header (&hdr, data + h264parse->nal_length_size,
+        size - h264parse->nal_length_size, NULL, NULL);
+    if (hdr.nal_type >= NAL_SLICE && hdr.nal_type <= NAL_SLICE_IDR &&
+        hdr.first_mb_in_slice != 0)
+      goto not_aligned;
+  }
+
+  nal.pts = GST_CLOCK_TIME_NONE;
+  nal.duration = GST_CLOCK_TIME_NONE;
+
+  h264parse->sei_data = data;
+  for (pos = 0; pos < size && !nal.slice; pos += nalu_size) {
+    nalu_size = gst_h264_parse_read_nalu_size (h264parse, data + pos);
+    pos += h264parse->nal_length_size;
+    gst_h264_parse_parse_nal (h264parse, &nal, data + pos, nalu_size);
+    gst_h264_parse_count_nal (h264parse, &nal, nalu_size);
+  }
+  h264parse->sei_data = NULL;
+
+  timestamp = GST_BUFFER_TIMESTAMP (buffer);
+  idr = nal.hdr.nal_type == NAL_SLICE_IDR;
+
+  /* the same bookkeeping as for a complete buffer from the adapter */
+  if (h264parse->after_slice) {
+    h264parse->ts_prefix = GST_CLOCK_TIME_NONE;
+    if (h264parse->upstream_offset != GST_BUFFER_OFFSET_NONE)
+      h264parse->au_offset = h264parse->upstream_offset +
+          h264parse->adapter_offset;
+    else
+      h264parse->au_offset = GST_BUFFER_OFFSET_NONE;
+  }
+  if (!nal.slice) {
+    if (GST_CLOCK_TIME_IS_VALID (timestamp))
+      h264parse->ts_prefix = timestamp;
+  } else if (h264parse->interpolate) {
+    gst_h264_parse_slice_timestamp (h264parse, &nal,
+        GST_CLOCK_TIME_IS_VALID (timestamp) ? timestamp :
+        h264parse->ts_prefix);
+    if (GST_CLOCK_TIME_IS_VALID (nal.pts))
+      timestamp = nal.pts;
+  }
+  h264parse->after_slice = nal.slice;
+  h264parse->adapter_offset += size;
+  if (idr)
+    gst_h264_parse_add_keyframe (h264parse, h264parse->au_offset, timestamp,
+        KEYFRAME_IDR);
+  else if (nal.recovery)
+    gst_h264_parse_add_keyframe (h264parse, h264parse->au_offset, timestamp,
+        KEYFRAME_RECOVERY);
+
+  if (gst_h264_parse_qos_drop (h264parse, &nal, idr || nal.i_frame ||
+          nal.recovery_point, timestamp)) {
+    if (h264parse->output == GST_H264_PARSE_OUTPUT_AU) {
+      g_atomic_int_add (&h264parse->stats.dropped_aus, 1);
+      GST_LOG_OBJECT (h264parse, "QoS dropped access unit, %d so far",
+          h264parse->stats.dropped_aus);
+    } else {
+      g_atomic_int_add (&h264parse->stats.dropped_nals, 1);
+      GST_LOG_OBJECT (h264parse, "QoS dropped NAL unit, %d so far",
+          h264parse->stats.dropped_nals);
+    }
+    gst_h264_parse_clear_user_data (h264parse);
+    gst_buffer_unref (buffer);
+    *res = GST_FLOW_OK;
+    return TRUE;
+  }
+
+  /* with output=au the buffer is an access unit */
+  if (h264parse->output == GST_H264_PARSE_OUTPUT_AU) {
+    g_atomic_int_add (&h264parse->stats.aus, 1);
+    if (idr)
+      g_atomic_int_add (&h264parse->stats.idrs, 1);
+  }
+
+  delta_unit = gst_h264_parse_is_delta_unit (&nal);
+  if (nal.slice)
+    h264parse->config_sent = FALSE;
+
+  buffer = gst_buffer_make_metadata_writable (buffer);
+  GST_BUFFER_TIMESTAMP (buffer) = timestamp;
+  if (GST_CLOCK_TIME_IS_VALID (nal.duration))
+    GST_BUFFER_DURATION (buffer) = nal.duration;
+  if (delta_unit)
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  else
+    GST_BUFFER_FLAG_UNSET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  if (h264parse->user_data->len > 0)
+    gst_h264_parse_emit_user_data (h264parse, buffer, timestamp);
+
+  *res = gst_h264_parse_push_buffer (h264parse, buffer);
+  return TRUE;
+
+  /* ERRORS */
+not_aligned:
+  {
+    GST_DEBUG_OBJECT (h264parse, "input is not aligned on access units, "
+        "stop passthrough");
+    h264parse->passthrough = FALSE;
+    return FALSE;
   }
-  gst_adapter_clear (h264parse->adapter);
-  h264parse->have_i_frame = FALSE;
 }
 
 static GstFlowReturn
@@ -428,148 +3658,205 @@ gst_h264_parse_chain_forward (GstH264Parse * h264parse, gboolean discont,
   GstClockTime timestamp;
 
   if (discont) {
+    /* the access unit we have is complete, the data in the adapter is not */
+    res = gst_h264_parse_push_au (h264parse);
     gst_adapter_clear (h264parse->adapter);
+    gst_h264_parse_reset_scan (h264parse);
     h264parse->discont = TRUE;
+    if (h264parse->packetized && !h264parse->out_packetized)
+      h264parse->push_codec_nals = TRUE;
+  }
+
+  /* a seek with the keyframe index starts on the keyframe */
+  if (G_UNLIKELY (GST_CLOCK_TIME_IS_VALID (h264parse->index_seek_timestamp))) {
+    if (!GST_BUFFER_TIMESTAMP_IS_VALID (buffer)) {
+      buffer = gst_buffer_make_metadata_writable (buffer);
+      GST_BUFFER_TIMESTAMP (buffer) = h264parse->index_seek_timestamp;
+    }
+    h264parse->index_seek_timestamp = GST_CLOCK_TIME_NONE;
   }
 
+  /* the upstream offset of the data in the adapter */
+  if (h264parse->upstream_offset == GST_BUFFER_OFFSET_NONE &&
+      GST_BUFFER_OFFSET_IS_VALID (buffer)) {
+    guint64 queued = h264parse->adapter_offset +
+        gst_adapter_available (h264parse->adapter);
+
+    if (GST_BUFFER_OFFSET (buffer) >= queued)
+      h264parse->upstream_offset = GST_BUFFER_OFFSET (buffer) - queued;
+  }
+
+  if (h264parse->packetized && res == GST_FLOW_OK &&
+      gst_h264_parse_passthrough (h264parse, buffer, &res))
+    return res;
+
   timestamp = GST_BUFFER_TIMESTAMP (buffer);
 
+  if (!h264parse->packetized && h264parse->stats_timing) {
+    GstClockTime start;
+
+    start = gst_util_get_timestamp ();
+    gst_h264_parse_scan_buffer (h264parse, buffer);
+    gst_h264_parse_stats_add (h264parse, &h264parse->stats.scan_time,
+        gst_util_get_timestamp () - start);
+  } else if (!h264parse->packetized) {
+    gst_h264_parse_scan_buffer (h264parse, buffer);
+  }
+
   gst_adapter_push (h264parse->adapter, buffer);
+  if (gst_adapter_available (h264parse->adapter) >
+      (guint) h264parse->stats.adapter_max)
+    g_atomic_int_set (&h264parse->stats.adapter_max,
+        gst_adapter_available (h264parse->adapter));
 
   while (res == GST_FLOW_OK) {
-    gint i;
     gint next_nalu_pos = -1;
     gint avail;
-    gboolean delta_unit = TRUE;
+    guint prefix_size;
 
     avail = gst_adapter_available (h264parse->adapter);
     if (avail < h264parse->nal_length_size + 1)
       break;
-    data = gst_adapter_peek (h264parse->adapter, avail);
 
     if (!h264parse->packetized) {
-      /* Bytestream format, first 4 bytes are sync code */
-      /* Find next NALU header */
-      for (i = 1; i < avail - 4; ++i) {
-        if (data[i + 0] == 0 && data[i + 1] == 0 && data[i + 2] == 0
-            && data[i + 3] == 1) {
-          next_nalu_pos = i;
-          break;
+      GstH264NalStart *start, *next;
+      guint n_starts;
+      guint64 nal_start, nal_end;
+
+      n_starts = h264parse->nal_starts->len - h264parse->nal_starts_head;
+      if (n_starts == 0) {
+        /* no sync code yet, the last bytes can be the start of one */
+        if (avail > 3) {
+          GST_DEBUG_OBJECT (h264parse, "skipping %u bytes without sync code",
+              avail - 3);
+          gst_h264_parse_flush (h264parse, avail - 3);
+        }
+        break;
+      }
+
+      /* Bytestream format, the NAL unit starts with a 3 or 4 byte sync code,
+       * the zeros before it are trailing zeros of the previous NAL unit or
+       * garbage, skip them */
+      start = &g_array_index (h264parse->nal_starts, GstH264NalStart,
+          h264parse->nal_starts_head);
+      prefix_size = start->zeros ? 4 : 3;
+      nal_start = start->offset + 3 - prefix_size;
+      if (nal_start > h264parse->adapter_offset) {
+        gst_h264_parse_flush (h264parse,
+            nal_start - h264parse->adapter_offset);
+        continue;
+      }
+
+      /* we need the next sync code to know where this NAL unit ends, when
+       * it doesn't come the data is corrupt, we keep the last bytes because
+       * they can be the start of the next sync code */
+      if (n_starts < 2) {
+        if (h264parse->max_nal_size > 0 &&
+            avail > h264parse->max_nal_size + prefix_size + 3) {
+          h264parse->nal_starts_head++;
+          gst_h264_parse_drop_corrupt (h264parse, avail - 3);
         }
+        break;
+      }
+      next = start + 1;
+      nal_end = next->offset - MIN (next->zeros, next->offset - nal_start);
+      timestamp = start->timestamp;
+
+      h264parse->nal_starts_head++;
+      if (h264parse->nal_starts_head > 32 &&
+          h264parse->nal_starts_head * 2 > h264parse->nal_starts->len) {
+        g_array_remove_range (h264parse->nal_starts, 0,
+            h264parse->nal_starts_head);
+        h264parse->nal_starts_head = 0;
+      }
+
+      if (nal_end <= nal_start + prefix_size) {
+        GST_DEBUG_OBJECT (h264parse, "skipping empty NAL unit");
+        gst_h264_parse_flush (h264parse, nal_end - nal_start);
+        continue;
       }
+      next_nalu_pos = nal_end - nal_start;
     } else {
       guint32 nalu_size;
 
-      nalu_size = 0;
-      for (i = 0; i < h264parse->nal_length_size; i++)
-        nalu_size = (nalu_size << 8) | data[i];
+      /* the adapter only has the rest of the input buffer */
+      data = gst_adapter_peek (h264parse->adapter, avail);
+      nalu_size = gst_h264_parse_read_nalu_size (h264parse, data);
+      prefix_size = h264parse->nal_length_size;
 
       GST_LOG_OBJECT (h264parse, "got NALU size %u", nalu_size);
 
-      /* check for invalid NALU sizes, assume the size if the available bytes
-       * when something is fishy */
-      if (nalu_size <= 1 || nalu_size + h264parse->nal_length_size > avail) {
-        nalu_size = avail - h264parse->nal_length_size;
+      /* check for invalid NALU sizes, continue at the next valid one or
+       * assume the size of the available bytes when we can't find one */
+      if (!gst_h264_parse_nalu_size_valid (h264parse, nalu_size,
+              avail - prefix_size)) {
+        if (gst_h264_parse_resync_packetized (h264parse, data, avail))
+          continue;
+        nalu_size = avail - prefix_size;
+        g_atomic_int_add (&h264parse->stats.size_fixes, 1);
         GST_DEBUG_OBJECT (h264parse, "fixing invalid NALU size to %u",
             nalu_size);
       }
 
       /* Packetized format, see if we have to split it, usually splitting is not
-       * a good idea as decoders have no way of handling it. */
-      if (h264parse->split_packetized) {
-        if (nalu_size + h264parse->nal_length_size <= avail)
-          next_nalu_pos = nalu_size + h264parse->nal_length_size;
-      } else {
-        next_nalu_pos = avail;
-      }
-    }
-
-    /* skip nalu_size bytes or sync */
-    data += h264parse->nal_length_size;
-    avail -= h264parse->nal_length_size;
-
-    /* Figure out if this is a delta unit */
-    {
-      gint nal_type, nal_ref_idc;
-
-      nal_type = (data[0] & 0x1f);
-      nal_ref_idc = (data[0] & 0x60) >> 5;
-
-      GST_DEBUG_OBJECT (h264parse, "NAL type: %d, ref_idc: %d", nal_type,
-          nal_ref_idc);
-
-      /* first parse some things needed to get to the frame type */
-      if (nal_type >= NAL_SLICE && nal_type <= NAL_SLICE_IDR) {
-        GstNalBs bs;
-        gint first_mb_in_slice, slice_type;
-
-        gst_nal_bs_init (&bs, data + 1, avail - 1);
-
-        first_mb_in_slice = gst_nal_bs_read_ue (&bs);
-        slice_type = gst_nal_bs_read_ue (&bs);
-
-        GST_DEBUG_OBJECT (h264parse, "first MB: %d, slice type: %d",
-            first_mb_in_slice, slice_type);
-
-        switch (slice_type) {
-          case 0:
-          case 5:
-          case 3:
-          case 8:              /* SP */
-            /* P frames */
-            GST_DEBUG_OBJECT (h264parse, "we have a P slice");
-            delta_unit = TRUE;
-            break;
-          case 1:
-          case 6:
-            /* B frames */
-            GST_DEBUG_OBJECT (h264parse, "we have a B slice");
-            delta_unit = TRUE;
-            break;
-          case 2:
-          case 7:
-          case 4:
-          case 9:
-            /* I frames */
-            GST_DEBUG_OBJECT (h264parse, "we have an I slice");
-            delta_unit = FALSE;
-            break;
-        }
-      } else if (nal_type >= NAL_SPS && nal_type <= NAL_PPS) {
-        /* This can be considered as a non delta unit */
-        GST_DEBUG_OBJECT (h264parse, "we have a SPS or PPS NAL");
-        delta_unit = FALSE;
-      }
+       * a good idea as decoders have no way of handling it. Without splitting
+       * the NAL units up to an invalid size go out together. */
+      if (h264parse->split_packetized || nalu_size + prefix_size == avail)
+        next_nalu_pos = nalu_size + prefix_size;
+      else
+        next_nalu_pos = gst_h264_parse_valid_packetized (h264parse, data,
+            avail);
     }
 
     /* we have a packet */
     if (next_nalu_pos > 0) {
-      GstBuffer *outbuf;
+      res = gst_h264_parse_output_nal (h264parse, next_nalu_pos, prefix_size,
+          timestamp);
+    } else {
+      /* NALU can not be parsed yet, we wait for more data in the adapter. */
+      break;
+    }
+  }
 
-      outbuf = gst_adapter_take_buffer (h264parse->adapter, next_nalu_pos);
+  if (h264parse->low_latency && res == GST_FLOW_OK)
+    res = gst_h264_parse_flush_aligned (h264parse);
 
-      GST_DEBUG_OBJECT (h264parse,
-          "pushing buffer %p, size %u, ts %" GST_TIME_FORMAT, outbuf,
-          next_nalu_pos, GST_TIME_ARGS (GST_BUFFER_TIMESTAMP (outbuf)));
+  return res;
+}
 
-      if (h264parse->discont) {
-        GST_BUFFER_FLAG_SET (outbuf, GST_BUFFER_FLAG_DISCONT);
-        h264parse->discont = FALSE;
-      }
+/* at EOS the data after the last sync code is a complete NAL unit */
+static GstFlowReturn
+gst_h264_parse_drain (GstH264Parse * h264parse)
+{
+  GstFlowReturn res = GST_FLOW_OK;
 
-      if (delta_unit)
-        GST_BUFFER_FLAG_SET (outbuf, GST_BUFFER_FLAG_DELTA_UNIT);
-      else
-        GST_BUFFER_FLAG_UNSET (outbuf, GST_BUFFER_FLAG_DELTA_UNIT);
+  if (!h264parse->packetized &&
+      h264parse->nal_starts->len > h264parse->nal_starts_head) {
+    GstH264NalStart *start;
+    guint avail, prefix_size;
 
-      gst_buffer_set_caps (outbuf, GST_PAD_CAPS (h264parse->srcpad));
-      GST_BUFFER_TIMESTAMP (outbuf) = timestamp;
-      res = gst_pad_push (h264parse->srcpad, outbuf);
-    } else {
-      /* NALU can not be parsed yet, we wait for more data in the adapter. */
-      break;
+    start = &g_array_index (h264parse->nal_starts, GstH264NalStart,
+        h264parse->nal_starts_head);
+    prefix_size = start->zeros ? 4 : 3;
+    avail = gst_adapter_available (h264parse->adapter);
+
+    /* the adapter starts at the sync code when the chain function could not
+     * find the end of the NAL unit */
+    if (start->offset + 3 - prefix_size == h264parse->adapter_offset &&
+        avail > h264parse->zero_run + prefix_size) {
+      GST_DEBUG_OBJECT (h264parse, "draining last NAL unit");
+      res = gst_h264_parse_output_nal (h264parse,
+          avail - h264parse->zero_run, prefix_size, start->timestamp);
     }
   }
+  gst_adapter_clear (h264parse->adapter);
+  gst_h264_parse_reset_scan (h264parse);
+
+  if (res == GST_FLOW_OK)
+    res = gst_h264_parse_push_au (h264parse);
+  else
+    gst_h264_parse_clear_au (h264parse);
+
   return res;
 }
 
@@ -577,17 +3864,36 @@ static GstFlowReturn
 gst_h264_parse_flush_decode (GstH264Parse * h264parse)
 {
   GstFlowReturn res = GST_FLOW_OK;
-  gboolean first = TRUE;
+  gboolean first = TRUE, seen_i_frame = FALSE, dropping = FALSE;
 
   while (h264parse->decode) {
     GstNalList *link;
     GstBuffer *buf;
 
     link = h264parse->decode;
+
+    /* in keyframe only mode we keep the I frame at the start of the queue with
+     * the NAL units before it and drop the rest of the GOP */
+    if (h264parse->keyframe_only && !dropping) {
+      if (link->slice && link->i_frame)
+        seen_i_frame = TRUE;
+      else if (link->slice || seen_i_frame)
+        dropping = TRUE;
+    }
+    if (dropping) {
+      gst_buffer_unref (link->buffer);
+      h264parse->decode = gst_nal_list_delete_head (h264parse,
+          h264parse->decode);
+      h264parse->decode_len--;
+      continue;
+    }
+
+    if (h264parse->packetized != h264parse->out_packetized)
+      link->buffer = gst_h264_parse_convert (h264parse, link->buffer);
     buf = link->buffer;
 
-    GST_DEBUG_OBJECT (h264parse, "have type: %d, I frame: %d", link->nal_type,
-        link->i_frame);
+    GST_DEBUG_OBJECT (h264parse, "have type: %d, I frame: %d",
+        link->hdr.nal_type, link->i_frame);
 
     if (first) {
       /* first buffer has discont */
@@ -606,9 +3912,9 @@ gst_h264_parse_flush_decode (GstH264Parse * h264parse)
     GST_DEBUG_OBJECT (h264parse, "pushing buffer %p, ts %" GST_TIME_FORMAT,
         buf, GST_TIME_ARGS (GST_BUFFER_TIMESTAMP (buf)));
 
-    res = gst_pad_push (h264parse->srcpad, buf);
+    res = gst_h264_parse_pad_push (h264parse, buf);
 
-    h264parse->decode = gst_nal_list_delete_head (h264parse->decode);
+    h264parse->decode = gst_nal_list_delete_head (h264parse, h264parse->decode);
     h264parse->decode_len--;
   }
   /* the i frame is gone now */
@@ -625,13 +3931,33 @@ gst_h264_parse_queue_buffer (GstH264Parse * parse, GstBuffer * buffer)
   guint8 *data;
   guint size;
   guint32 nalu_size;
-  GstNalBs bs;
   GstNalList *link;
   GstFlowReturn res = GST_FLOW_OK;
   GstClockTime timestamp;
 
+  /* the enhancement layers are dropped before they get in the queue */
+  if (parse->strip_enhancement) {
+    if (parse->packetized) {
+      buffer = gst_h264_parse_strip_packetized (parse, buffer);
+      size = GST_BUFFER_SIZE (buffer);
+    } else {
+      data = GST_BUFFER_DATA (buffer);
+      size = GST_BUFFER_SIZE (buffer);
+      nalu_size = gst_h264_sync_code_size (data, size);
+      if (nalu_size > 0 && nalu_size < size &&
+          gst_h264_parse_is_enhancement (data[nalu_size] & 0x1f)) {
+        g_atomic_int_add (&parse->stats.stripped_nals, 1);
+        size = 0;
+      }
+    }
+    if (size == 0) {
+      gst_buffer_unref (buffer);
+      return GST_FLOW_OK;
+    }
+  }
+
   /* create new NALU link */
-  link = gst_nal_list_new (buffer);
+  link = gst_nal_list_new (parse, buffer);
 
   /* first parse the buffer */
   data = GST_BUFFER_DATA (buffer);
@@ -648,59 +3974,32 @@ gst_h264_parse_queue_buffer (GstH264Parse * parse, GstBuffer * buffer)
   /* now parse all the NAL units in this buffer, for bytestream we only have one
    * NAL unit but for packetized streams we can have multiple ones */
   while (size >= parse->nal_length_size + 1) {
-    gint i;
+    guint prefix_size;
 
     nalu_size = 0;
     if (parse->packetized) {
-      for (i = 0; i < parse->nal_length_size; i++)
-        nalu_size = (nalu_size << 8) | data[i];
+      nalu_size = gst_h264_parse_read_nalu_size (parse, data);
+      prefix_size = parse->nal_length_size;
+    } else {
+      /* the buffer was split on a 3 or 4 byte sync code */
+      prefix_size = gst_h264_sync_code_size (data, size);
+      if (prefix_size == 0)
+        break;
     }
 
-    /* skip nalu_size or sync bytes */
-    data += parse->nal_length_size;
-    size -= parse->nal_length_size;
-
-    link->nal_ref_idc = (data[0] & 0x60) >> 5;
-    link->nal_type = (data[0] & 0x1f);
+    /* skip nalu_size or sync bytes, a NALU size can't go past the end */
+    data += prefix_size;
+    size -= prefix_size;
+    nalu_size = MIN (nalu_size, size);
 
     /* nalu_size is 0 for bytestream, we have a complete packet */
-    GST_DEBUG_OBJECT (parse, "size: %u, NAL type: %d, ref_idc: %d",
-        nalu_size, link->nal_type, link->nal_ref_idc);
-
-    /* first parse some things needed to get to the frame type */
-    if (link->nal_type >= NAL_SLICE && link->nal_type <= NAL_SLICE_IDR) {
-      gst_nal_bs_init (&bs, data + 1, size - 1);
-
-      link->first_mb_in_slice = gst_nal_bs_read_ue (&bs);
-      link->slice_type = gst_nal_bs_read_ue (&bs);
-      link->slice = TRUE;
-
-      GST_DEBUG_OBJECT (parse, "first MB: %d, slice type: %d",
-          link->first_mb_in_slice, link->slice_type);
-
-      switch (link->slice_type) {
-        case 0:
-        case 5:
-        case 3:
-        case 8:                /* SP */
-          /* P frames */
-          GST_DEBUG_OBJECT (parse, "we have a P slice");
-          break;
-        case 1:
-        case 6:
-          /* B frames */
-          GST_DEBUG_OBJECT (parse, "we have a B slice");
-          break;
-        case 2:
-        case 7:
-        case 4:
-        case 9:
-          /* I frames */
-          GST_DEBUG_OBJECT (parse, "we have an I slice");
-          link->i_frame = TRUE;
-          break;
-      }
-    }
+    GST_DEBUG_OBJECT (parse, "size: %u", nalu_size);
+
+    gst_h264_parse_parse_nal (parse, link, data,
+        parse->packetized ? nalu_size : size);
+    gst_h264_parse_count_nal (parse, link,
+        parse->packetized ? nalu_size : size);
+
     /* bytestream, we can exit now */
     if (!parse->packetized)
       break;
@@ -719,6 +4018,11 @@ gst_h264_parse_queue_buffer (GstH264Parse * parse, GstBuffer * buffer)
     GST_DEBUG_OBJECT (parse, "flushing decode queue");
     res = gst_h264_parse_flush_decode (parse);
   }
+  if (parse->decode_len >= MAX_DECODE_QUEUE_LEN && res == GST_FLOW_OK) {
+    GST_WARNING_OBJECT (parse, "decode queue full, flushing %d NAL units",
+        parse->decode_len);
+    res = gst_h264_parse_flush_decode (parse);
+  }
   if (link->i_frame)
     /* we're going to add a new I-frame in the queue */
     parse->have_i_frame = TRUE;
@@ -732,23 +4036,287 @@ gst_h264_parse_queue_buffer (GstH264Parse * parse, GstBuffer * buffer)
   return res;
 }
 
+/* copy up to @size bytes from the start of the pending data to @dest */
 static guint
-gst_h264_parse_find_start_reverse (GstH264Parse * parse, guint8 * data,
-    guint size, guint32 * code)
+gst_h264_parse_peek_pending (GstH264Parse * h264parse, guint8 * dest,
+    guint size)
 {
-  guint32 search = *code;
+  guint i, len, n = 0;
 
-  while (size > 0) {
-    /* the sync code is kept in reverse */
-    search = (search << 8) | (data[size - 1]);
-    if (search == 0x01000000)
-      break;
+  /* the pending buffers are in reverse order */
+  for (i = h264parse->pending->len; i > 0 && n < size; i--) {
+    GstBuffer *buf = g_ptr_array_index (h264parse->pending, i - 1);
+
+    len = MIN (size - n, GST_BUFFER_SIZE (buf));
+    memcpy (dest + n, GST_BUFFER_DATA (buf), len);
+    n += len;
+  }
+  return n;
+}
+
+/* check for a sync code that starts in the last bytes of @buffer and ends in
+ * the pending data, the data in front of the sync codes that are completely
+ * inside a buffer are never merged */
+static gboolean
+gst_h264_parse_find_pending_sync_code (GstH264Parse * h264parse,
+    GstBuffer * buffer, guint * start)
+{
+  guint8 window[6];
+  guint codes[2];
+  guint tail, size, n_codes, i;
+
+  tail = MIN (GST_BUFFER_SIZE (buffer), 3);
+  memcpy (window, GST_BUFFER_DATA (buffer) + GST_BUFFER_SIZE (buffer) - tail,
+      tail);
+  size = tail + gst_h264_parse_peek_pending (h264parse, window + tail, 3);
+
+  n_codes = gst_h264_find_sync_codes (window, size, codes, 2);
+  for (i = 0; i < n_codes; i++) {
+    guint code_size = gst_h264_sync_code_size (window + codes[i],
+        size - codes[i]);
+
+    if (codes[i] < tail && codes[i] + code_size > tail) {
+      *start = GST_BUFFER_SIZE (buffer) - tail + codes[i];
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* get the @size bytes at @offset in @buffer followed by the pending data in
+ * one buffer, this is a sub-buffer when there is no pending data and one copy
+ * otherwise. The pending data is cleared. */
+static GstBuffer *
+gst_h264_parse_take_pending (GstH264Parse * h264parse, GstBuffer * buffer,
+    guint offset, guint size)
+{
+  GstBuffer *outbuf;
+  guint8 *data;
+  guint i;
+
+  if (h264parse->pending->len == 0)
+    return gst_buffer_create_sub (buffer, offset, size);
+
+  GST_DEBUG_OBJECT (h264parse, "merging %u pending bytes in %u buffers",
+      h264parse->pending_size, h264parse->pending->len);
+
+  outbuf = gst_buffer_new_and_alloc (size + h264parse->pending_size);
+  data = GST_BUFFER_DATA (outbuf);
+  memcpy (data, GST_BUFFER_DATA (buffer) + offset, size);
+  data += size;
+  for (i = h264parse->pending->len; i > 0; i--) {
+    GstBuffer *buf = g_ptr_array_index (h264parse->pending, i - 1);
+
+    memcpy (data, GST_BUFFER_DATA (buf), GST_BUFFER_SIZE (buf));
+    data += GST_BUFFER_SIZE (buf);
+    gst_buffer_unref (buf);
+  }
+  g_ptr_array_set_size (h264parse->pending, 0);
+  h264parse->pending_size = 0;
+
+  return outbuf;
+}
+
+/* split the gathered buffers of a GOP chunk backwards on the sync codes, the
+ * NAL units are added to @split in the order they go in the decode queue.
+ * The data in front of the first sync code stays pending for the previous
+ * chunk. */
+static void
+gst_h264_parse_split_gather (GstH264Parse * h264parse, GPtrArray * gather,
+    GPtrArray * split)
+{
+  GstBuffer *gbuf = NULL;
+  guint start, last;
+  GstClockTime timestamp;
+
+  while (gather->len > 0) {
+    guint8 *data;
+
+    /* get new buffer and init the start code search to the end position */
+    if (gbuf != NULL)
+      gst_buffer_unref (gbuf);
+
+    /* take the buffers from the end of the gather queue */
+    gbuf = GST_BUFFER_CAST (g_ptr_array_remove_index (gather, gather->len - 1));
+
+    if (h264parse->packetized) {
+      /* packetized the packets are already split, we can just parse and
+       * store them */
+      GST_DEBUG_OBJECT (h264parse, "copied packetized buffer");
+      g_ptr_array_add (split, gbuf);
+      gbuf = NULL;
+    } else {
+      guint *codes, n_codes, max_codes;
+
+      last = GST_BUFFER_SIZE (gbuf);
+      data = GST_BUFFER_DATA (gbuf);
+      timestamp = GST_BUFFER_TIMESTAMP (gbuf);
+
+      GST_DEBUG_OBJECT (h264parse,
+          "buffer size: %u, timestamp %" GST_TIME_FORMAT, last,
+          GST_TIME_ARGS (timestamp));
+
+      /* find all the sync codes in the buffer in one pass, a sync code takes
+       * at least 3 bytes so there can't be more than size / 3 of them. One
+       * more can start in the last bytes and end in the pending data. */
+      max_codes = last / 3 + 2;
+      g_array_set_size (h264parse->sync_codes, max_codes);
+      codes = (guint *) h264parse->sync_codes->data;
+      n_codes = gst_h264_find_sync_codes (data, last, codes, max_codes - 1);
+      if (h264parse->pending->len > 0 &&
+          gst_h264_parse_find_pending_sync_code (h264parse, gbuf, &start))
+        codes[n_codes++] = start;
+
+      /* and split from the last one backwards */
+      while (n_codes > 0) {
+        GstBuffer *decode;
+        guint8 *ddata;
+        guint end;
+
+        start = codes[--n_codes];
+
+        GST_DEBUG_OBJECT (h264parse, "found start code at %u", start);
+
+        /* we found a start code, everything starting from it and the
+         * pending data goes to the decode queue. */
+        decode = gst_h264_parse_take_pending (h264parse, gbuf, start,
+            last - start);
+
+        /* strip the trailing_zero_8bits */
+        ddata = GST_BUFFER_DATA (decode);
+        for (end = GST_BUFFER_SIZE (decode); end > 4 && ddata[end - 1] == 0;
+            end--);
+        GST_BUFFER_SIZE (decode) = end;
+
+        GST_BUFFER_TIMESTAMP (decode) = timestamp;
+
+        g_ptr_array_add (split, decode);
+
+        last = start;
+      }
+      if (last > 0) {
+        GstBuffer *head;
+
+        /* no start code found, keep the data in front of the pending data
+         * until we find the start code in one of the previous buffers */
+        GST_DEBUG_OBJECT (h264parse, "no start code, keeping buffer to %u",
+            last);
+        if (last == GST_BUFFER_SIZE (gbuf))
+          head = gst_buffer_ref (gbuf);
+        else
+          head = gst_buffer_create_sub (gbuf, 0, last);
+        g_ptr_array_add (h264parse->pending, head);
+        h264parse->pending_size += last;
+      }
+    }
+  }
+
+  if (gbuf)
+    gst_buffer_unref (gbuf);
+}
+
+/* see what we have in the split NAL units, this pushes the GOPs that are
+ * complete */
+static GstFlowReturn
+gst_h264_parse_queue_split (GstH264Parse * h264parse, GPtrArray * split)
+{
+  GstFlowReturn res = GST_FLOW_OK;
+  guint i;
+
+  for (i = 0; i < split->len; i++)
+    res = gst_h264_parse_queue_buffer (h264parse,
+        g_ptr_array_index (split, i));
+  g_ptr_array_set_size (split, 0);
+
+  return res;
+}
+
+/* runs in the reverse thread pool */
+static void
+gst_h264_parse_reverse_job (GPtrArray * gather, GstH264Parse * h264parse)
+{
+  gst_h264_parse_split_gather (h264parse, gather, h264parse->reverse_split);
+
+  g_mutex_lock (h264parse->reverse_lock);
+  h264parse->reverse_busy = FALSE;
+  g_cond_signal (h264parse->reverse_cond);
+  g_mutex_unlock (h264parse->reverse_lock);
+}
+
+static void
+gst_h264_parse_wait_reverse (GstH264Parse * h264parse)
+{
+  g_mutex_lock (h264parse->reverse_lock);
+  while (h264parse->reverse_busy)
+    g_cond_wait (h264parse->reverse_cond, h264parse->reverse_lock);
+  g_mutex_unlock (h264parse->reverse_lock);
+}
+
+static gboolean
+gst_h264_parse_start_reverse_pool (GstH264Parse * h264parse)
+{
+  GError *err = NULL;
+
+  if (h264parse->reverse_pool)
+    return TRUE;
+
+  h264parse->reverse_pool =
+      g_thread_pool_new ((GFunc) gst_h264_parse_reverse_job, h264parse, 1,
+      FALSE, &err);
+  if (h264parse->reverse_pool == NULL) {
+    GST_WARNING_OBJECT (h264parse, "could not create reverse thread: %s",
+        err->message);
+    g_error_free (err);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+gst_h264_parse_stop_reverse_pool (GstH264Parse * h264parse)
+{
+  if (h264parse->reverse_pool == NULL)
+    return;
+
+  g_thread_pool_free (h264parse->reverse_pool, FALSE, TRUE);
+  h264parse->reverse_pool = NULL;
+}
+
+/* start splitting the chunk we gathered on the reverse thread and queue the
+ * NAL units of the chunk it split before, the pushing of that chunk
+ * downstream runs in parallel with the split of the next one */
+static GstFlowReturn
+gst_h264_parse_split_parallel (GstH264Parse * h264parse)
+{
+  GPtrArray *tmp;
+
+  gst_h264_parse_wait_reverse (h264parse);
+
+  /* the split NAL units are ours now */
+  tmp = h264parse->reverse_ready;
+  h264parse->reverse_ready = h264parse->reverse_split;
+  h264parse->reverse_split = tmp;
+
+  if (h264parse->gather->len > 0) {
+    tmp = h264parse->reverse_gather;
+    h264parse->reverse_gather = h264parse->gather;
+    h264parse->gather = tmp;
 
-    size--;
+    h264parse->reverse_busy = TRUE;
+    g_thread_pool_push (h264parse->reverse_pool, h264parse->reverse_gather,
+        NULL);
   }
-  *code = search;
 
-  return size - 1;
+  return gst_h264_parse_queue_split (h264parse, h264parse->reverse_ready);
+}
+
+/* queue the chunk the reverse thread is still splitting at EOS */
+static GstFlowReturn
+gst_h264_parse_finish_reverse (GstH264Parse * h264parse)
+{
+  gst_h264_parse_wait_reverse (h264parse);
+
+  return gst_h264_parse_queue_split (h264parse, h264parse->reverse_split);
 }
 
 static GstFlowReturn
@@ -756,108 +4324,28 @@ gst_h264_parse_chain_reverse (GstH264Parse * h264parse, gboolean discont,
     GstBuffer * buffer)
 {
   GstFlowReturn res = GST_FLOW_OK;
-  GstBuffer *gbuf = NULL;
 
   /* if we have a discont, move buffers to the decode list */
   if (G_UNLIKELY (discont)) {
-    guint start, stop, last;
-    guint32 code;
-    GstBuffer *prev;
-    GstClockTime timestamp;
-
     GST_DEBUG_OBJECT (h264parse,
         "received discont, copy gathered buffers for decoding");
 
-    /* init start code accumulator */
-    stop = -1;
-    prev = h264parse->prev;
-    h264parse->prev = NULL;
-
-    while (h264parse->gather) {
-      guint8 *data;
-
-      /* get new buffer and init the start code search to the end position */
-      if (gbuf != NULL)
-        gst_buffer_unref (gbuf);
-      gbuf = GST_BUFFER_CAST (h264parse->gather->data);
-
-      /* remove from the gather list, they are in reverse order */
-      h264parse->gather =
-          g_list_delete_link (h264parse->gather, h264parse->gather);
-
-      if (h264parse->packetized) {
-        /* packetized the packets are already split, we can just parse and 
-         * store them */
-        GST_DEBUG_OBJECT (h264parse, "copied packetized buffer");
-        res = gst_h264_parse_queue_buffer (h264parse, gbuf);
-        gbuf = NULL;
-      } else {
-        /* bytestream, we have to split the NALUs on the sync markers */
-        code = 0xffffffff;
-        if (prev) {
-          /* if we have a previous buffer or a leftover, merge them together
-           * now */
-          GST_DEBUG_OBJECT (h264parse, "merging previous buffer");
-          gbuf = gst_buffer_join (gbuf, prev);
-          prev = NULL;
-        }
-
-        last = GST_BUFFER_SIZE (gbuf);
-        data = GST_BUFFER_DATA (gbuf);
-        timestamp = GST_BUFFER_TIMESTAMP (gbuf);
-
-        GST_DEBUG_OBJECT (h264parse,
-            "buffer size: %u, timestamp %" GST_TIME_FORMAT, last,
-            GST_TIME_ARGS (timestamp));
-
-        while (last > 0) {
-          GST_DEBUG_OBJECT (h264parse, "scan from %u", last);
-          /* find a start code searching backwards in this buffer */
-          start =
-              gst_h264_parse_find_start_reverse (h264parse, data, last, &code);
-          if (start != -1) {
-            GstBuffer *decode;
-
-            GST_DEBUG_OBJECT (h264parse, "found start code at %u", start);
-
-            /* we found a start code, copy everything starting from it to the
-             * decode queue. */
-            decode = gst_buffer_create_sub (gbuf, start, last - start);
-
-            GST_BUFFER_TIMESTAMP (decode) = timestamp;
-
-            /* see what we have here */
-            res = gst_h264_parse_queue_buffer (h264parse, decode);
-
-            last = start;
-          } else {
-            /* no start code found, keep the buffer and merge with potential next
-             * buffer. */
-            GST_DEBUG_OBJECT (h264parse, "no start code, keeping buffer to %u",
-                last);
-            prev = gst_buffer_create_sub (gbuf, 0, last);
-            gst_buffer_unref (gbuf);
-            gbuf = NULL;
-            break;
-          }
-        }
-      }
-    }
-    if (prev) {
-      GST_DEBUG_OBJECT (h264parse, "keeping buffer");
-      h264parse->prev = prev;
+    if (h264parse->reverse_thread &&
+        gst_h264_parse_start_reverse_pool (h264parse)) {
+      res = gst_h264_parse_split_parallel (h264parse);
+    } else {
+      /* the chunk the thread has if the property changed */
+      gst_h264_parse_finish_reverse (h264parse);
+      gst_h264_parse_split_gather (h264parse, h264parse->gather,
+          h264parse->reverse_ready);
+      res = gst_h264_parse_queue_split (h264parse, h264parse->reverse_ready);
     }
   }
   if (buffer) {
     /* add buffer to gather queue */
     GST_DEBUG_OBJECT (h264parse, "gathering buffer %p, size %u", buffer,
         GST_BUFFER_SIZE (buffer));
-    h264parse->gather = g_list_prepend (h264parse->gather, buffer);
-  }
-
-  if (gbuf) {
-    gst_buffer_unref (gbuf);
-    gbuf = NULL;
+    g_ptr_array_add (h264parse->gather, buffer);
   }
 
   return res;
@@ -869,37 +4357,49 @@ gst_h264_parse_chain (GstPad * pad, GstBuffer * buffer)
   GstFlowReturn res;
   GstH264Parse *h264parse;
   gboolean discont;
-  GstCaps *caps;
 
   h264parse = GST_H264PARSE (GST_PAD_PARENT (pad));
 
   if (!GST_PAD_CAPS (h264parse->srcpad)) {
-    /* Set default caps if the sink caps were not negotiated, this is when we
-     * are reading from a file or so */
-    caps = gst_caps_new_simple ("video/x-h264", NULL);
-
-    /* Set source caps */
-    if (!gst_pad_set_caps (h264parse->srcpad, caps))
-      goto caps_failed;
-
     /* we assume the bytestream format. If the data turns out to be packetized,
      * we have a problem because we don't know the length of the nalu_size
      * indicator. Packetized input MUST set the codec_data. */
     h264parse->packetized = FALSE;
     h264parse->nal_length_size = 4;
+    gst_buffer_replace (&h264parse->codec_data, NULL);
 
-    gst_caps_unref (caps);
+    /* Set default caps if the sink caps were not negotiated, this is when we
+     * are reading from a file or so */
+    if (!gst_h264_parse_negotiate (h264parse, NULL))
+      goto caps_failed;
   }
 
+  /* upstream knows what it reads now */
+  if (G_UNLIKELY (!h264parse->index_checked))
+    gst_h264_parse_open_index (h264parse);
+
   discont = GST_BUFFER_IS_DISCONT (buffer);
 
   GST_DEBUG_OBJECT (h264parse, "received buffer of size %u",
       GST_BUFFER_SIZE (buffer));
+  gst_h264_parse_stats_add (h264parse, &h264parse->stats.bytes,
+      GST_BUFFER_SIZE (buffer));
 
-  if (h264parse->segment.rate > 0.0)
+  if (h264parse->segment.rate > 0.0) {
+    GstFlowReturn bres;
+
+    /* everything we get out of this buffer is pushed in one go */
+    if (h264parse->batch_output)
+      gst_h264_parse_start_batch (h264parse);
     res = gst_h264_parse_chain_forward (h264parse, discont, buffer);
-  else
+    bres = gst_h264_parse_push_batch (h264parse, FALSE);
+    if (res == GST_FLOW_OK)
+      res = bres;
+  } else {
     res = gst_h264_parse_chain_reverse (h264parse, discont, buffer);
+  }
+  if (h264parse->stats_interval > 0)
+    gst_h264_parse_post_stats (h264parse);
 
   return res;
 
@@ -908,11 +4408,159 @@ caps_failed:
   {
     GST_ELEMENT_ERROR (GST_ELEMENT (h264parse),
         CORE, NEGOTIATION, (NULL), ("failed to set caps"));
-    gst_caps_unref (caps);
+    gst_buffer_unref (buffer);
     return GST_FLOW_ERROR;
   }
 }
 
+static void
+gst_h264_parse_loop (GstPad * pad)
+{
+  GstH264Parse *h264parse;
+  GstBuffer *buffer = NULL;
+  GstFlowReturn ret;
+  guint size;
+
+  h264parse = GST_H264PARSE (GST_PAD_PARENT (pad));
+
+  if (G_UNLIKELY (h264parse->need_newsegment)) {
+    GstSegment *segment = &h264parse->segment;
+
+    gst_pad_push_event (h264parse->srcpad,
+        gst_event_new_new_segment_full (FALSE, segment->rate,
+            segment->applied_rate, segment->format, segment->start,
+            segment->stop, segment->time));
+    h264parse->need_newsegment = FALSE;
+  }
+
+  /* read up to the next block boundary so that reads are aligned again after
+   * a seek */
+  size = PULL_BLOCK_SIZE - h264parse->pull_offset % PULL_BLOCK_SIZE;
+  ret = gst_pad_pull_range (pad, h264parse->pull_offset, size, &buffer);
+  if (ret != GST_FLOW_OK)
+    goto pause;
+
+  if (GST_BUFFER_SIZE (buffer) == 0) {
+    gst_buffer_unref (buffer);
+    ret = GST_FLOW_UNEXPECTED;
+    goto pause;
+  }
+
+  buffer = gst_buffer_make_metadata_writable (buffer);
+  GST_BUFFER_OFFSET (buffer) = h264parse->pull_offset;
+  if (h264parse->pull_discont) {
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DISCONT);
+    h264parse->pull_discont = FALSE;
+  }
+  h264parse->pull_offset += GST_BUFFER_SIZE (buffer);
+
+  ret = gst_h264_parse_chain (pad, buffer);
+  if (ret != GST_FLOW_OK)
+    goto pause;
+
+  /* the picture timestamps tell us where we are, stop at the end of the
+   * segment */
+  if (GST_CLOCK_TIME_IS_VALID (h264parse->ts_max_pts)) {
+    GstSegment *segment = &h264parse->segment;
+
+    gst_segment_set_last_stop (segment, GST_FORMAT_TIME,
+        h264parse->ts_max_pts);
+    if (segment->stop != -1 &&
+        (gint64) h264parse->ts_max_pts >= segment->stop) {
+      GST_DEBUG_OBJECT (h264parse, "reached the segment stop %"
+          GST_TIME_FORMAT, GST_TIME_ARGS (segment->stop));
+      ret = GST_FLOW_UNEXPECTED;
+      goto pause;
+    }
+  }
+
+  return;
+
+pause:
+  {
+    GST_LOG_OBJECT (h264parse, "pausing task, reason %s",
+        gst_flow_get_name (ret));
+    gst_pad_pause_task (pad);
+    if (ret == GST_FLOW_UNEXPECTED &&
+        (h264parse->segment.flags & GST_SEEK_FLAG_SEGMENT)) {
+      gint64 stop = h264parse->segment.stop;
+
+      /* a segment seek continues with the next one, no EOS */
+      gst_h264_parse_drain (h264parse);
+      if (stop == -1)
+        stop = h264parse->segment.last_stop;
+      GST_DEBUG_OBJECT (h264parse, "posting segment done at %" GST_TIME_FORMAT,
+          GST_TIME_ARGS (stop));
+      gst_element_post_message (GST_ELEMENT_CAST (h264parse),
+          gst_message_new_segment_done (GST_OBJECT_CAST (h264parse),
+              GST_FORMAT_TIME, stop));
+    } else if (ret == GST_FLOW_UNEXPECTED) {
+      /* drain like on an EOS event from upstream */
+      gst_h264_parse_sink_event (pad, gst_event_new_eos ());
+    } else if (ret == GST_FLOW_NOT_LINKED || ret < GST_FLOW_UNEXPECTED) {
+      GST_ELEMENT_ERROR (h264parse, STREAM, FAILED,
+          ("Internal data stream error."),
+          ("streaming stopped, reason %s", gst_flow_get_name (ret)));
+      gst_pad_push_event (h264parse->srcpad, gst_event_new_eos ());
+    }
+  }
+}
+
+/* we read large blocks ourselves when upstream can do that */
+static gboolean
+gst_h264_parse_sink_activate (GstPad * sinkpad)
+{
+  if (gst_pad_check_pull_range (sinkpad)) {
+    GST_DEBUG_OBJECT (sinkpad, "activating pull");
+    return gst_pad_activate_pull (sinkpad, TRUE);
+  }
+
+  GST_DEBUG_OBJECT (sinkpad, "activating push");
+  return gst_pad_activate_push (sinkpad, TRUE);
+}
+
+static gboolean
+gst_h264_parse_sink_activate_pull (GstPad * sinkpad, gboolean active)
+{
+  GstH264Parse *h264parse;
+
+  h264parse = GST_H264PARSE (GST_PAD_PARENT (sinkpad));
+
+  if (active) {
+    gst_segment_init (&h264parse->segment, GST_FORMAT_TIME);
+    h264parse->pull = TRUE;
+    h264parse->pull_offset = 0;
+    h264parse->pull_discont = FALSE;
+    h264parse->need_newsegment = TRUE;
+    gst_h264_parse_start_scan_pool (h264parse);
+
+    return gst_pad_start_task (sinkpad, (GstTaskFunction) gst_h264_parse_loop,
+        sinkpad);
+  } else {
+    gboolean res;
+
+    h264parse->pull = FALSE;
+    res = gst_pad_stop_task (sinkpad);
+    gst_h264_parse_stop_scan_pool (h264parse);
+
+    return res;
+  }
+}
+
+/* see if only keyframes should be output in the current segment */
+static void
+gst_h264_parse_update_keyframe_only (GstH264Parse * h264parse)
+{
+  gdouble rate = ABS (h264parse->segment.rate);
+
+  h264parse->keyframe_only = h264parse->seek_skip ||
+      (h264parse->keyframe_only_rate > 0.0 &&
+      rate > h264parse->keyframe_only_rate);
+
+  GST_DEBUG_OBJECT (h264parse, "rate %g, keyframe only %d", rate,
+      h264parse->keyframe_only);
+}
+
 static gboolean
 gst_h264_parse_sink_event (GstPad * pad, GstEvent * event)
 {
@@ -932,7 +4580,11 @@ gst_h264_parse_sink_event (GstPad * pad, GstEvent * event)
       GST_DEBUG_OBJECT (h264parse, "received EOS");
       if (h264parse->segment.rate < 0.0) {
         gst_h264_parse_chain_reverse (h264parse, TRUE, NULL);
+        gst_h264_parse_finish_reverse (h264parse);
         gst_h264_parse_flush_decode (h264parse);
+      } else {
+        gst_h264_parse_drain (h264parse);
+        gst_h264_parse_write_index (h264parse);
       }
       res = gst_pad_push_event (h264parse->srcpad, event);
       break;
@@ -946,9 +4598,30 @@ gst_h264_parse_sink_event (GstPad * pad, GstEvent * event)
       gst_event_parse_new_segment_full (event, &update, &rate, &applied_rate,
           &format, &start, &stop, &pos);
 
+      /* we did a byte seek for a time seek with the keyframe index, make
+       * a time segment starting at the keyframe */
+      GST_OBJECT_LOCK (h264parse);
+      if (format == GST_FORMAT_BYTES &&
+          GST_CLOCK_TIME_IS_VALID (h264parse->index_seek_time)) {
+        h264parse->index_seek_timestamp = h264parse->index_seek_time;
+        format = GST_FORMAT_TIME;
+        start = pos = h264parse->index_seek_time;
+        stop = h264parse->index_seek_stop;
+        h264parse->index_seek_time = GST_CLOCK_TIME_NONE;
+        GST_OBJECT_UNLOCK (h264parse);
+
+        gst_event_unref (event);
+        event = gst_event_new_new_segment_full (update, rate, applied_rate,
+            format, start, stop, pos);
+      } else {
+        GST_OBJECT_UNLOCK (h264parse);
+      }
+
       /* now configure the values */
       gst_segment_set_newsegment_full (&h264parse->segment, update,
           rate, applied_rate, format, start, stop, pos);
+      gst_h264_parse_update_keyframe_only (h264parse);
+      gst_h264_parse_reset_timestamps (h264parse);
 
       GST_DEBUG_OBJECT (h264parse,
           "Pushing newseg rate %g, applied rate %g, format %d, start %"
@@ -968,6 +4641,307 @@ gst_h264_parse_sink_event (GstPad * pad, GstEvent * event)
   return res;
 }
 
+/* seek in pull mode, a time seek starts at the keyframe in front of the
+ * position in the keyframe index. When the position is not in the indexed
+ * part we start at the last keyframe we know in front of it and skip up to the
+ * first keyframe at the position, indexing the keyframes on the way. */
+static gboolean
+gst_h264_parse_perform_seek (GstH264Parse * h264parse, GstEvent * event)
+{
+  gdouble rate;
+  GstFormat format;
+  GstSeekFlags flags;
+  GstSeekType start_type, stop_type;
+  gint64 start, stop, position;
+  GstSegment seeksegment;
+  GstH264Keyframe keyframe;
+  gboolean flush, update, indexed;
+
+  gst_event_parse_seek (event, &rate, &format, &flags, &start_type, &start,
+      &stop_type, &stop);
+
+  if (format != GST_FORMAT_TIME)
+    goto wrong_format;
+  if (rate <= 0.0)
+    goto wrong_rate;
+
+  /* work on a copy until we know we can do the seek */
+  memcpy (&seeksegment, &h264parse->segment, sizeof (GstSegment));
+  gst_segment_set_seek (&seeksegment, rate, format, flags, start_type,
+      start, stop_type, stop, &update);
+
+  /* without a new start we continue from where we are */
+  if (start_type == GST_SEEK_TYPE_NONE)
+    position = h264parse->segment.last_stop != -1 ?
+        h264parse->segment.last_stop : h264parse->segment.start;
+  else
+    position = seeksegment.start;
+
+  gst_h264_parse_open_index (h264parse);
+  keyframe.offset = 0;
+  keyframe.timestamp = 0;
+  indexed = position <= 0 ||
+      gst_h264_parse_find_keyframe (h264parse, position, &keyframe);
+
+  GST_DEBUG_OBJECT (h264parse, "seeking to keyframe at offset %"
+      G_GUINT64_FORMAT ", ts %" GST_TIME_FORMAT ", indexed %d",
+      keyframe.offset, GST_TIME_ARGS (keyframe.timestamp), indexed);
+
+  flush = (flags & GST_SEEK_FLAG_FLUSH) != 0;
+  if (flush)
+    gst_pad_push_event (h264parse->srcpad, gst_event_new_flush_start ());
+  else
+    gst_pad_pause_task (h264parse->sinkpad);
+
+  /* wait for the streaming thread to stop */
+  GST_PAD_STREAM_LOCK (h264parse->sinkpad);
+
+  if (flush)
+    gst_pad_push_event (h264parse->srcpad, gst_event_new_flush_stop ());
+
+  gst_h264_parse_clear_queues (h264parse);
+  memcpy (&h264parse->segment, &seeksegment, sizeof (GstSegment));
+  h264parse->seek_skip = (flags & GST_SEEK_FLAG_SKIP) != 0;
+  gst_h264_parse_update_keyframe_only (h264parse);
+
+  h264parse->pull_offset = keyframe.offset;
+  h264parse->pull_discont = TRUE;
+  h264parse->index_seek_timestamp = keyframe.timestamp;
+  h264parse->need_newsegment = TRUE;
+  if (!indexed)
+    h264parse->seek_target = position;
+
+  gst_pad_start_task (h264parse->sinkpad, (GstTaskFunction) gst_h264_parse_loop,
+      h264parse->sinkpad);
+
+  GST_PAD_STREAM_UNLOCK (h264parse->sinkpad);
+
+  return TRUE;
+
+  /* ERRORS */
+wrong_format:
+  {
+    GST_DEBUG_OBJECT (h264parse, "can only seek in TIME format");
+    return FALSE;
+  }
+wrong_rate:
+  {
+    GST_DEBUG_OBJECT (h264parse, "reverse playback is not supported in pull "
+        "mode");
+    return FALSE;
+  }
+}
+
+static gboolean
+gst_h264_parse_src_event (GstPad * pad, GstEvent * event)
+{
+  GstH264Parse *h264parse;
+  gboolean res;
+
+  h264parse = GST_H264PARSE (gst_pad_get_parent (pad));
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_SEEK:
+    {
+      gdouble rate;
+      GstFormat format;
+      GstSeekFlags flags;
+      GstSeekType start_type, stop_type;
+      gint64 start, stop;
+      GstH264Keyframe keyframe;
+
+      /* in pull mode we do the seek ourselves */
+      if (h264parse->pull) {
+        res = gst_h264_parse_perform_seek (h264parse, event);
+        gst_event_unref (event);
+        goto done;
+      }
+
+      gst_event_parse_seek (event, &rate, &format, &flags, &start_type, &start,
+          &stop_type, &stop);
+
+      /* the new segment tells us when the seek takes effect */
+      h264parse->seek_skip = (flags & GST_SEEK_FLAG_SKIP) != 0;
+      GST_DEBUG_OBJECT (h264parse, "seek rate %g, skip %d", rate,
+          h264parse->seek_skip);
+
+      /* seek to the keyframe in front of the position when we know it */
+      gst_h264_parse_open_index (h264parse);
+      if (format == GST_FORMAT_TIME && rate > 0.0 &&
+          start_type == GST_SEEK_TYPE_SET &&
+          gst_h264_parse_find_keyframe (h264parse, start, &keyframe)) {
+        GstEvent *seek;
+
+        GST_DEBUG_OBJECT (h264parse, "seeking to keyframe at offset %"
+            G_GUINT64_FORMAT ", ts %" GST_TIME_FORMAT, keyframe.offset,
+            GST_TIME_ARGS (keyframe.timestamp));
+
+        GST_OBJECT_LOCK (h264parse);
+        h264parse->index_seek_time = keyframe.timestamp;
+        h264parse->index_seek_stop =
+            stop_type == GST_SEEK_TYPE_SET ? stop : -1;
+        GST_OBJECT_UNLOCK (h264parse);
+
+        seek = gst_event_new_seek (rate, GST_FORMAT_BYTES, flags,
+            GST_SEEK_TYPE_SET, keyframe.offset, GST_SEEK_TYPE_NONE, -1);
+        if (gst_pad_push_event (h264parse->sinkpad, seek)) {
+          gst_event_unref (event);
+          res = TRUE;
+          goto done;
+        }
+
+        /* let upstream do the time seek */
+        GST_DEBUG_OBJECT (h264parse, "byte seek failed");
+        GST_OBJECT_LOCK (h264parse);
+        h264parse->index_seek_time = GST_CLOCK_TIME_NONE;
+        GST_OBJECT_UNLOCK (h264parse);
+      }
+      break;
+    }
+    case GST_EVENT_QOS:
+    {
+      gdouble proportion;
+      GstClockTimeDiff diff;
+      GstClockTime timestamp;
+
+      gst_event_parse_qos (event, &proportion, &diff, &timestamp);
+
+      GST_OBJECT_LOCK (h264parse);
+      if (!GST_CLOCK_TIME_IS_VALID (timestamp))
+        h264parse->earliest_time = GST_CLOCK_TIME_NONE;
+      else if (diff < 0 && timestamp < -diff)
+        h264parse->earliest_time = 0;
+      else
+        h264parse->earliest_time = timestamp + diff;
+      GST_OBJECT_UNLOCK (h264parse);
+
+      GST_LOG_OBJECT (h264parse, "QoS proportion %g, diff %" G_GINT64_FORMAT
+          ", timestamp %" GST_TIME_FORMAT, proportion, diff,
+          GST_TIME_ARGS (timestamp));
+      break;
+    }
+    default:
+      break;
+  }
+  res = gst_pad_push_event (h264parse->sinkpad, event);
+
+done:
+  gst_object_unref (h264parse);
+
+  return res;
+}
+
+static gboolean
+gst_h264_parse_src_query (GstPad * pad, GstQuery * query)
+{
+  GstH264Parse *h264parse;
+  gboolean res;
+
+  h264parse = GST_H264PARSE (gst_pad_get_parent (pad));
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_SEEKING:
+    {
+      GstFormat format;
+      gboolean seekable = FALSE;
+      gint64 start, stop;
+      GstQuery *peer;
+
+      /* upstream knows best */
+      res = gst_pad_peer_query (h264parse->sinkpad, query);
+      if (res)
+        gst_query_parse_seeking (query, NULL, &seekable, NULL, NULL);
+      gst_query_parse_seeking (query, &format, NULL, NULL, NULL);
+      if (seekable || format != GST_FORMAT_TIME)
+        break;
+
+      /* we can do time seeks in the indexed part with byte seeks */
+      peer = gst_query_new_seeking (GST_FORMAT_BYTES);
+      if (gst_pad_peer_query (h264parse->sinkpad, peer))
+        gst_query_parse_seeking (peer, NULL, &seekable, NULL, NULL);
+      gst_query_unref (peer);
+
+      gst_h264_parse_open_index (h264parse);
+      if (seekable && gst_h264_parse_get_index_range (h264parse, &start,
+              &stop)) {
+        gst_query_set_seeking (query, GST_FORMAT_TIME, TRUE, start, stop);
+        res = TRUE;
+      }
+      break;
+    }
+    case GST_QUERY_LATENCY:
+    {
+      GstClockTime min, max, latency = 0;
+      gboolean live;
+
+      res = gst_pad_peer_query (h264parse->sinkpad, query);
+      if (!res)
+        break;
+
+      /* the last NAL unit of a frame goes out when the sync code of the next
+       * frame arrives, an access unit when the next one starts */
+      GST_OBJECT_LOCK (h264parse);
+      if (!h264parse->low_latency && (!h264parse->packetized ||
+              h264parse->output == GST_H264_PARSE_OUTPUT_AU) &&
+          GST_CLOCK_TIME_IS_VALID (h264parse->frame_duration))
+        latency = h264parse->frame_duration;
+      GST_OBJECT_UNLOCK (h264parse);
+
+      gst_query_parse_latency (query, &live, &min, &max);
+      GST_DEBUG_OBJECT (h264parse, "upstream latency min %" GST_TIME_FORMAT
+          ", max %" GST_TIME_FORMAT ", adding %" GST_TIME_FORMAT,
+          GST_TIME_ARGS (min), GST_TIME_ARGS (max), GST_TIME_ARGS (latency));
+      min += latency;
+      if (GST_CLOCK_TIME_IS_VALID (max))
+        max += latency;
+      gst_query_set_latency (query, live, min, max);
+      break;
+    }
+    default:
+      res = gst_pad_query_default (pad, query);
+      break;
+  }
+  gst_object_unref (h264parse);
+
+  return res;
+}
+
+static void
+gst_h264_parse_set_index (GstElement * element, GstIndex * index)
+{
+  GstH264Parse *h264parse = GST_H264PARSE (element);
+  GstIndex *old;
+  gint id = 0;
+
+  if (index) {
+    gst_object_ref (index);
+    gst_index_get_writer_id (index, GST_OBJECT (element), &id);
+  }
+
+  GST_OBJECT_LOCK (h264parse);
+  old = h264parse->index;
+  h264parse->index = index;
+  h264parse->index_id = id;
+  GST_OBJECT_UNLOCK (h264parse);
+
+  if (old)
+    gst_object_unref (old);
+}
+
+static GstIndex *
+gst_h264_parse_get_index (GstElement * element)
+{
+  GstH264Parse *h264parse = GST_H264PARSE (element);
+  GstIndex *index = NULL;
+
+  GST_OBJECT_LOCK (h264parse);
+  if (h264parse->index)
+    index = gst_object_ref (h264parse->index);
+  GST_OBJECT_UNLOCK (h264parse);
+
+  return index;
+}
+
 static GstStateChangeReturn
 gst_h264_parse_change_state (GstElement * element, GstStateChange transition)
 {
@@ -979,6 +4953,16 @@ gst_h264_parse_change_state (GstElement * element, GstStateChange transition)
   switch (transition) {
     case GST_STATE_CHANGE_READY_TO_PAUSED:
       gst_segment_init (&h264parse->segment, GST_FORMAT_UNDEFINED);
+      gst_h264_parse_reset_stats (h264parse);
+      h264parse->seek_skip = FALSE;
+      h264parse->keyframe_only = FALSE;
+      /* the sink caps are not set again, get the parameter sets we cleared
+       * at the last stop from their codec_data */
+      if (h264parse->codec_data && !h264parse->have_sps) {
+        gst_h264_parse_parse_avcc (h264parse, h264parse->codec_data);
+        h264parse->push_codec_nals = h264parse->packetized &&
+            !h264parse->out_packetized;
+      }
       break;
     default:
       break;
@@ -989,6 +4973,16 @@ gst_h264_parse_change_state (GstElement * element, GstStateChange transition)
   switch (transition) {
     case GST_STATE_CHANGE_PAUSED_TO_READY:
       gst_h264_parse_clear_queues (h264parse);
+      gst_h264_parse_stop_reverse_pool (h264parse);
+      gst_h264_parse_clear_params (h264parse);
+      gst_nal_list_free_pool (h264parse);
+      /* the next stream has its own keyframes */
+      gst_h264_parse_close_index (h264parse);
+      GST_OBJECT_LOCK (h264parse);
+      g_array_set_size (h264parse->keyframes, 0);
+      h264parse->index_seek_time = GST_CLOCK_TIME_NONE;
+      GST_OBJECT_UNLOCK (h264parse);
+      h264parse->index_seek_timestamp = GST_CLOCK_TIME_NONE;
       break;
     default:
       break;
@@ -1001,6 +4995,10 @@ gst_h264_parse_change_state (GstElement * element, GstStateChange transition)
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
+  GST_DEBUG_CATEGORY_INIT (h264_parse_debug, "h264parse", 0, "h264 parser");
+
+  GST_DEBUG ("using %s start code search", gst_h264_scan_init ());
+
   return gst_element_register (plugin, "h264parse",
       GST_RANK_NONE, GST_TYPE_H264PARSE);
 }
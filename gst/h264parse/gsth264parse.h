@@ -26,6 +26,8 @@
 #include <gst/gst.h>
 #include <gst/base/gstadapter.h>
 
+#include "gsth264nal.h"
+
 G_BEGIN_DECLS
 
 #define GST_TYPE_H264PARSE \
@@ -43,6 +45,62 @@ typedef struct _GstH264Parse GstH264Parse;
 typedef struct _GstH264ParseClass GstH264ParseClass;
 
 typedef struct _GstNalList GstNalList;
+typedef struct _GstH264ScanJob GstH264ScanJob;
+typedef struct _GstH264ParseStats GstH264ParseStats;
+typedef struct _GstH264ParseSei GstH264ParseSei;
+
+#define GST_H264_PARSE_MAX_SPS GST_H264_MAX_SPS
+#define GST_H264_PARSE_MAX_PPS GST_H264_MAX_PPS
+
+typedef enum
+{
+  GST_H264_PARSE_OUTPUT_NAL,
+  GST_H264_PARSE_OUTPUT_AU
+} GstH264ParseOutput;
+
+/* the counters are updated with atomic operations so that get_property can
+ * read them while we stream, the 64 bit byte totals and times are protected
+ * with the object lock */
+struct _GstH264ParseStats
+{
+  /* input bytes and the NAL units per type */
+  guint64 bytes;
+  volatile gint nals[32];
+  /* the access units and IDR frames we pushed, only counted with output=au
+   * because we don't collect access units with output=nal */
+  volatile gint aus;
+  volatile gint idrs;
+  volatile gint dropped_nals;
+  volatile gint dropped_aus;
+  volatile gint dropped_gops;
+  guint64 nal_bytes;
+  volatile gint max_nal_size;
+  volatile gint adapter_max;
+  /* only measured with stats-timing */
+  GstClockTime scan_time;
+  GstClockTime push_time;
+  /* packetized NAL unit sizes we had to fix */
+  volatile gint size_fixes;
+  /* corrupt data we dropped to find the next NAL unit */
+  volatile gint resyncs;
+  guint64 corrupt_bytes;
+  /* SVC and MVC enhancement layer NAL units we dropped */
+  volatile gint stripped_nals;
+};
+
+/* the SEI messages in front of a picture we look at, Annex D */
+struct _GstH264ParseSei
+{
+  gboolean recovery_point;
+  gint recovery_frame_cnt;
+  gboolean buffering_period;
+  /* the delays are only there with HRD parameters */
+  gboolean pic_timing;
+  guint cpb_removal_delay;
+  guint dpb_output_delay;
+  gboolean have_pic_struct;
+  guint pic_struct;
+};
 
 struct _GstH264Parse
 {
@@ -52,22 +110,187 @@ struct _GstH264Parse
   GstPad *srcpad;
 
   gboolean split_packetized;
+  GstH264ParseOutput output;
+  gint config_interval;
+  gdouble keyframe_only_rate;
+  gboolean qos;
+  gboolean interpolate;
+  GstClockTime qos_gop_lateness;
+  guint scan_threads;
+  gboolean reverse_thread;
+  gboolean low_latency;
+  gboolean batch_output;
+  guint max_nal_size;
+  guint resync_window;
+  gboolean recovery_points;
+  gboolean pic_timing;
+  gboolean emit_user_data;
+  gboolean strip_enhancement;
   guint nal_length_size;
 
   GstSegment segment;
+  /* pull mode, the offset of the next block and if we have to send a new
+   * segment */
+  gboolean pull;
+  guint64 pull_offset;
+  gboolean pull_discont;
+  gboolean need_newsegment;
+  /* a seek past the indexed part starts at an earlier keyframe, the slices
+   * up to the first keyframe at this position are dropped */
+  GstClockTime seek_target;
+  /* only output access units with keyframes */
+  gboolean seek_skip;
+  gboolean keyframe_only;
   gboolean packetized;
+  /* packetized input buffers are access units we can push as they are */
+  gboolean passthrough;
+  /* output stream format, converted when different from packetized */
+  gboolean out_packetized;
+  gboolean update_caps;
+  gboolean push_codec_nals;
+  /* when we last sent parameter sets and if we did since the last slice */
+  GstClockTime last_config;
+  gboolean config_sent;
   gboolean discont;
 
+  /* frame duration of the last SPS with timing, protected with the object
+   * lock for the latency query */
+  GstClockTime frame_duration;
+
+  /* running time of the QoS events, protected with the object lock */
+  GstClockTime earliest_time;
+  /* last input timestamp and if we drop up to the next keyframe or recovery
+   * point, because we are late or after corrupt data */
+  GstClockTime qos_timestamp;
+  gboolean qos_skip_gop;
+
+  /* keyframe index, GstH264Keyframe sorted on offset, protected with the
+   * object lock like the GstIndex */
+  GArray *keyframes;
+  GstIndex *index;
+  gint index_id;
+  /* upstream offset of adapter offset 0 and of the access unit we output */
+  guint64 upstream_offset;
+  guint64 au_offset;
+  gboolean after_slice;
+  /* keyframe and stop of a time seek we did as a byte seek */
+  GstClockTime index_seek_time;
+  gint64 index_seek_stop;
+  /* timestamp for the first buffer after such a seek */
+  GstClockTime index_seek_timestamp;
+
+  /* keyframe index file, the mapped records are used for seeking */
+  gchar *index_location;
+  gboolean index_checked;
+  GMappedFile *index_file;
+  const guint8 *index_records;
+  guint index_n_records;
+  /* the file upstream reads, the index file is for this version of it */
+  gboolean source_known;
+  guint64 source_size;
+  gint64 source_mtime;
+
+  /* timestamp interpolation, the last upstream timestamp and the timestamp
+   * of picture order count 0 */
+  GstClockTime ts_upstream;
+  /* upstream timestamp of the NAL units in front of the next picture */
+  GstClockTime ts_prefix;
+  gint64 ts_base;
+  gboolean ts_base_valid;
+  /* the last picture in display order */
+  GstClockTime ts_max_pts;
+  GstClockTime ts_max_duration;
+  /* first slice and timestamp of the current picture */
+  GstNalList *ts_slice;
+  gboolean ts_have_slice;
+  GstClockTime ts_pts;
+  GstClockTime ts_duration;
+  /* picture order count state of the previous picture */
+  gint poc_msb;
+  gint poc_lsb;
+  gint poc_frame_num;
+  gint poc_frame_num_offset;
+  /* removal time of the last access unit with a buffering period SEI, the
+   * pic_timing delays count from there */
+  gint64 cpb_base;
+  gboolean cpb_base_valid;
+
+  /* SEI messages for the next picture and the ones of the current picture,
+   * only parsed when one of their consumers is enabled. The SPS of the last
+   * slice is the one the SEI messages use. */
+  GstH264ParseSei sei_next;
+  GstH264ParseSei sei;
+  gint active_sps_id;
+  /* data of the NAL units we are about to output and the registered user
+   * data found in it, GstH264UserData */
+  const guint8 *sei_data;
+  GArray *user_data;
+
   /* gather/decode queues for reverse playback */
-  GList *gather;
-  GstBuffer *prev;
+  GPtrArray *gather;
+  /* bytestream data after the last sync code we found, in reverse order */
+  GPtrArray *pending;
+  guint pending_size;
+  /* reverse thread, it splits the chunk in reverse_gather to reverse_split
+   * while we queue reverse_ready, busy is protected with reverse_lock */
+  GThreadPool *reverse_pool;
+  GPtrArray *reverse_gather;
+  GPtrArray *reverse_split;
+  GPtrArray *reverse_ready;
+  gboolean reverse_busy;
+  GMutex *reverse_lock;
+  GCond *reverse_cond;
   GstNalList *decode;
   gint decode_len;
+  /* unused GstNalList links */
+  GstNalList *nal_pool;
+  guint nal_pool_len;
   gboolean have_sps;
   gboolean have_pps;
   gboolean have_i_frame;
 
+  /* parameter sets seen in the stream, indexed by id */
+  GstH264Sps *sps[GST_H264_PARSE_MAX_SPS];
+  GstH264Pps *pps[GST_H264_PARSE_MAX_PPS];
+  /* the parameter sets in bytestream format */
+  GstBuffer *codec_nals;
+  /* the avcC of the sink caps */
+  GstBuffer *codec_data;
+
   GstAdapter *adapter;
+  /* stream offset of the first byte in the adapter */
+  guint64 adapter_offset;
+  /* sync codes found in the bytestream data pushed in the adapter */
+  GArray *nal_starts;
+  guint nal_starts_head;
+  /* number of zero bytes at the end of the scanned data */
+  guint zero_run;
+  /* threads searching the parts of a large block in pull mode */
+  GThreadPool *scan_pool;
+  GstH264ScanJob *scan_jobs;
+  guint scan_n_jobs;
+  /* jobs not done yet, protected with scan_lock */
+  guint scan_running;
+  GMutex *scan_lock;
+  GCond *scan_cond;
+
+  /* access unit being collected for au output */
+  GstNalList *au;
+  GstNalList *au_last;
+  GstNalList *au_slice;
+  gboolean au_keyframe;
+  GstClockTime au_timestamp;
+  /* output of the input buffer we are handling, pushed at the end of it */
+  GstBufferList *batch;
+  GstBufferListIterator *batch_it;
+  guint batch_len;
+  GstH264ParseStats stats;
+  gboolean stats_timing;
+  GstClockTime stats_interval;
+  /* protected with the object lock */
+  GstClockTime stats_last;
+  /* scratch space for the sync code offsets of a buffer */
+  GArray *sync_codes;
 };
 
 struct _GstH264ParseClass
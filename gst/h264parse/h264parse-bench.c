@@ -0,0 +1,738 @@
+/* GStreamer h264 parser benchmark
+ * Copyright (C) 2005 Michal Benes <michal.benes@itonis.tv>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Measures the hot paths of the parser: the start code search, the GstNalBs
+ * reader and the forward and reverse chain functions, on synthetic streams
+ * and on the byte-stream files given on the command line. The element is
+ * compiled in so that the static functions can be called directly.
+ *
+ *   h264parse-bench [-s MB] [-r repeats] [file.h264 ...]
+ */
+
+#include "gsth264parse.c"
+
+static gint bench_size = 16;
+static gint bench_repeats = 3;
+
+static GOptionEntry bench_options[] = {
+  {"size", 's', 0, G_OPTION_ARG_INT, &bench_size,
+      "Size of the synthetic streams in MB", "MB"},
+  {"repeats", 'r', 0, G_OPTION_ARG_INT, &bench_repeats,
+      "Number of runs of each case, the fastest one is reported", "N"},
+  {NULL}
+};
+
+/* a NAL unit in a stream, @offset is the NAL header after the sync code or
+ * NAL unit size at @start */
+typedef struct
+{
+  guint start;
+  guint offset;
+  guint size;
+  guint frame;
+} BenchNal;
+
+typedef struct
+{
+  guint8 *data;
+  guint size;
+  GArray *nals;
+  guint frames;
+  guint max_nal_size;
+} BenchStream;
+
+/* pad we link to the parser, counts what it pushes */
+static GstPad *bench_pad;
+static guint bench_outputs;
+
+/* bit writer for the synthetic parameter sets and slice headers */
+typedef struct
+{
+  guint8 *data;
+  guint bits;
+} BenchBits;
+
+static void
+bench_put_u (BenchBits * bits, guint32 value, guint n)
+{
+  while (n--) {
+    if ((value >> n) & 1)
+      bits->data[bits->bits / 8] |= 0x80 >> (bits->bits % 8);
+    bits->bits++;
+  }
+}
+
+static void
+bench_put_ue (BenchBits * bits, guint32 value)
+{
+  guint n = 0;
+
+  value++;
+  while ((value >> n) > 1)
+    n++;
+  bits->bits += n;
+  bench_put_u (bits, value, n + 1);
+}
+
+/* rbsp_trailing_bits, returns the size in bytes */
+static guint
+bench_put_trailing (BenchBits * bits)
+{
+  bench_put_u (bits, 1, 1);
+  return (bits->bits + 7) / 8;
+}
+
+static void
+bench_add_nal (BenchStream * stream, gboolean sync4, guint8 header,
+    const guint8 * rbsp, guint rbsp_size, guint payload)
+{
+  BenchNal nal;
+  guint8 *p;
+  guint i;
+
+  p = stream->data + stream->size;
+  nal.start = stream->size;
+  if (sync4)
+    *p++ = 0;
+  *p++ = 0;
+  *p++ = 0;
+  *p++ = 1;
+
+  nal.offset = p - stream->data;
+  nal.size = 1 + rbsp_size + payload;
+  nal.frame = stream->frames;
+
+  *p++ = header;
+  memcpy (p, rbsp, rbsp_size);
+  p += rbsp_size;
+  /* slice data without 0 bytes, so no emulation prevention is needed */
+  for (i = 0; i < payload; i++)
+    *p++ = 1 + g_random_int_range (0, 255);
+
+  stream->size = p - stream->data;
+  stream->max_nal_size = MAX (stream->max_nal_size, nal.size);
+  g_array_append_val (stream->nals, nal);
+}
+
+/* make a baseline stream of about @size bytes with @slices slices per frame,
+ * slices of at most @max_slice bytes and an IDR frame with SPS and PPS every
+ * 30 frames */
+static BenchStream *
+bench_make_stream (guint size, guint slices, gboolean sync4, guint max_slice)
+{
+  BenchStream *stream;
+  guint8 rbsp[32];
+  BenchBits bits;
+  guint rbsp_size, i;
+
+  stream = g_new0 (BenchStream, 1);
+  stream->data = g_malloc (size + 64 * 1024);
+  stream->nals = g_array_new (FALSE, FALSE, sizeof (BenchNal));
+
+  while (stream->size < size) {
+    gboolean idr = stream->frames % 30 == 0;
+
+    if (idr) {
+      /* 320x240, frame_num of 4 bits, POC type 2 */
+      memset (rbsp, 0, sizeof (rbsp));
+      bits.data = rbsp;
+      bits.bits = 0;
+      bench_put_u (&bits, 66, 8);
+      bench_put_u (&bits, 0, 8);
+      bench_put_u (&bits, 30, 8);
+      bench_put_ue (&bits, 0);
+      bench_put_ue (&bits, 0);
+      bench_put_ue (&bits, 2);
+      bench_put_ue (&bits, 1);
+      bench_put_u (&bits, 0, 1);
+      bench_put_ue (&bits, 19);
+      bench_put_ue (&bits, 14);
+      bench_put_u (&bits, 1, 1);
+      bench_put_u (&bits, 1, 1);
+      bench_put_u (&bits, 0, 2);
+      rbsp_size = bench_put_trailing (&bits);
+      bench_add_nal (stream, TRUE, 0x67, rbsp, rbsp_size, 0);
+
+      memset (rbsp, 0, sizeof (rbsp));
+      bits.data = rbsp;
+      bits.bits = 0;
+      bench_put_ue (&bits, 0);
+      bench_put_ue (&bits, 0);
+      bench_put_u (&bits, 0, 2);
+      bench_put_ue (&bits, 0);
+      bench_put_ue (&bits, 0);
+      bench_put_ue (&bits, 0);
+      bench_put_u (&bits, 0, 3);
+      bench_put_ue (&bits, 0);
+      bench_put_ue (&bits, 0);
+      bench_put_ue (&bits, 0);
+      bench_put_u (&bits, 4, 3);
+      rbsp_size = bench_put_trailing (&bits);
+      bench_add_nal (stream, sync4, 0x68, rbsp, rbsp_size, 0);
+    }
+
+    for (i = 0; i < slices; i++) {
+      memset (rbsp, 0, sizeof (rbsp));
+      bits.data = rbsp;
+      bits.bits = 0;
+      bench_put_ue (&bits, i * 300 / slices);
+      bench_put_ue (&bits, idr ? 7 : 5);
+      bench_put_ue (&bits, 0);
+      bench_put_u (&bits, stream->frames % 16, 4);
+      if (idr)
+        bench_put_ue (&bits, stream->frames / 30);
+      rbsp_size = bench_put_trailing (&bits);
+      bench_add_nal (stream, sync4 && i == 0, idr ? 0x65 : 0x41, rbsp,
+          rbsp_size, g_random_int_range (max_slice / 4, max_slice) -
+          rbsp_size - 1);
+    }
+    stream->frames++;
+  }
+
+  return stream;
+}
+
+/* find the NAL units and frames of a byte-stream file */
+static BenchStream *
+bench_load_stream (const gchar * filename)
+{
+  BenchStream *stream;
+  GError *err = NULL;
+  gchar *contents;
+  gsize size;
+  guint pos, frame = 0;
+  gboolean in_picture = FALSE;
+
+  if (!g_file_get_contents (filename, &contents, &size, &err)) {
+    g_printerr ("%s\n", err->message);
+    g_error_free (err);
+    return NULL;
+  }
+
+  stream = g_new0 (BenchStream, 1);
+  stream->data = (guint8 *) contents;
+  stream->size = size;
+  stream->nals = g_array_new (FALSE, FALSE, sizeof (BenchNal));
+
+  pos = 0;
+  while (pos < size) {
+    BenchNal nal;
+    gint type;
+
+    pos += gst_h264_scan_start_code_c (stream->data + pos, size - pos);
+    if (pos + 3 >= size)
+      break;
+    nal.start = (pos > 0 && stream->data[pos - 1] == 0) ? pos - 1 : pos;
+    pos += 3;
+    if (stream->nals->len > 0) {
+      BenchNal *prev;
+
+      prev = &g_array_index (stream->nals, BenchNal, stream->nals->len - 1);
+      prev->size = nal.start - prev->offset;
+      stream->max_nal_size = MAX (stream->max_nal_size, prev->size);
+    }
+
+    /* a slice with first_mb_in_slice 0 or the NAL units in front of the
+     * first slice start a new frame */
+    type = stream->data[pos] & 0x1f;
+    if (type >= NAL_SLICE && type <= NAL_SLICE_IDR) {
+      if (in_picture && (stream->data[pos + 1] & 0x80))
+        frame++;
+      in_picture = TRUE;
+    } else if (type >= NAL_SEI && type <= NAL_AU_DELIMITER && in_picture) {
+      frame++;
+      in_picture = FALSE;
+    }
+    nal.offset = pos;
+    nal.size = size - pos;
+    nal.frame = frame;
+    g_array_append_val (stream->nals, nal);
+  }
+  if (stream->nals->len > 0) {
+    BenchNal *last;
+
+    last = &g_array_index (stream->nals, BenchNal, stream->nals->len - 1);
+    stream->max_nal_size = MAX (stream->max_nal_size, last->size);
+  }
+  stream->frames = frame + 1;
+
+  return stream;
+}
+
+static void
+bench_free_stream (BenchStream * stream)
+{
+  g_array_free (stream->nals, TRUE);
+  g_free (stream->data);
+  g_free (stream);
+}
+
+/* the stream with @nal_length_size byte NAL unit sizes and one buffer per
+ * frame, the avcC goes in @caps */
+static BenchStream *
+bench_packetize (BenchStream * stream, guint nal_length_size, GstCaps ** caps,
+    GArray * chunks)
+{
+  BenchStream *out;
+  GstBuffer *avcc;
+  guint8 *p, *sps = NULL, *pps = NULL;
+  guint sps_size = 0, pps_size = 0, i, start = 0;
+
+  out = g_new0 (BenchStream, 1);
+  out->data = g_malloc (stream->size + stream->nals->len * 4);
+  out->nals = g_array_new (FALSE, FALSE, sizeof (BenchNal));
+  out->frames = stream->frames;
+
+  p = out->data;
+  for (i = 0; i < stream->nals->len; i++) {
+    BenchNal *nal = &g_array_index (stream->nals, BenchNal, i);
+    BenchNal copy = *nal;
+    guint8 *data = stream->data + nal->offset;
+    guint n;
+
+    if (i > 0 && nal->frame != (nal - 1)->frame) {
+      guint len = (p - out->data) - start;
+
+      g_array_append_val (chunks, len);
+      start = p - out->data;
+    }
+    if ((data[0] & 0x1f) == NAL_SPS && sps == NULL) {
+      sps = data;
+      sps_size = nal->size;
+    } else if ((data[0] & 0x1f) == NAL_PPS && pps == NULL) {
+      pps = data;
+      pps_size = nal->size;
+    }
+
+    copy.start = p - out->data;
+    for (n = nal_length_size; n > 0; n--)
+      *p++ = nal->size >> (8 * (n - 1));
+    copy.offset = p - out->data;
+    memcpy (p, data, nal->size);
+    p += nal->size;
+    g_array_append_val (out->nals, copy);
+  }
+  out->size = p - out->data;
+  out->max_nal_size = stream->max_nal_size;
+  if (out->size > start) {
+    guint len = out->size - start;
+
+    g_array_append_val (chunks, len);
+  }
+
+  avcc = gst_buffer_new_and_alloc (11 + sps_size + pps_size);
+  p = GST_BUFFER_DATA (avcc);
+  p[0] = 1;
+  p[1] = sps ? sps[1] : 66;
+  p[2] = sps ? sps[2] : 0;
+  p[3] = sps ? sps[3] : 30;
+  p[4] = 0xfc | (nal_length_size - 1);
+  p[5] = 0xe0 | (sps ? 1 : 0);
+  GST_WRITE_UINT16_BE (p + 6, sps_size);
+  memcpy (p + 8, sps, sps_size);
+  p += 8 + sps_size;
+  p[0] = pps ? 1 : 0;
+  GST_WRITE_UINT16_BE (p + 1, pps_size);
+  memcpy (p + 3, pps, pps_size);
+
+  *caps = gst_caps_new_simple ("video/x-h264", "codec_data", GST_TYPE_BUFFER,
+      avcc, NULL);
+  gst_buffer_unref (avcc);
+
+  return out;
+}
+
+/* cut the stream in one buffer per frame */
+static GArray *
+bench_frames (BenchStream * stream)
+{
+  GArray *chunks;
+  guint i, start = 0;
+
+  chunks = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (i = 1; i <= stream->nals->len; i++) {
+    BenchNal *nal = &g_array_index (stream->nals, BenchNal, i - 1);
+    guint end, len;
+
+    if (i < stream->nals->len && (nal + 1)->frame == nal->frame)
+      continue;
+    end = (i < stream->nals->len) ? (nal + 1)->start : stream->size;
+    len = end - start;
+    g_array_append_val (chunks, len);
+    start = end;
+  }
+  return chunks;
+}
+
+/* cut the stream in buffers of @block_size bytes */
+static GArray *
+bench_blocks (BenchStream * stream, guint block_size)
+{
+  GArray *chunks;
+  guint pos;
+
+  chunks = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (pos = 0; pos < stream->size; pos += block_size) {
+    guint len = MIN (block_size, stream->size - pos);
+
+    g_array_append_val (chunks, len);
+  }
+  return chunks;
+}
+
+static void
+bench_report (const gchar * name, BenchStream * stream, gdouble seconds)
+{
+  g_print ("%-44s %9.1f MB/s %12.0f NALs/s\n", name,
+      stream->size / seconds / (1024 * 1024), stream->nals->len / seconds);
+}
+
+static GstFlowReturn
+bench_chain (GstPad * pad, GstBuffer * buffer)
+{
+  bench_outputs++;
+  gst_buffer_unref (buffer);
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+bench_chain_list (GstPad * pad, GstBufferList * list)
+{
+  bench_outputs += gst_buffer_list_n_groups (list);
+  gst_buffer_list_unref (list);
+  return GST_FLOW_OK;
+}
+
+static gboolean
+bench_event (GstPad * pad, GstEvent * event)
+{
+  gst_event_unref (event);
+  return TRUE;
+}
+
+static gboolean
+bench_setcaps (GstPad * pad, GstCaps * caps)
+{
+  return TRUE;
+}
+
+/* the input buffers, in the order we push them. For reverse playback the
+ * chunks are frames and the GOPs starting at an SPS are pushed from the last
+ * to the first with their first buffer marked DISCONT. */
+static GPtrArray *
+bench_make_buffers (BenchStream * stream, GArray * chunks, gboolean reverse)
+{
+  GPtrArray *buffers, *gop = NULL;
+  GPtrArray *gops;
+  guint i, pos = 0, nal = 0;
+
+  buffers = g_ptr_array_new ();
+  gops = g_ptr_array_new ();
+  for (i = 0; i < chunks->len; i++) {
+    guint len = g_array_index (chunks, guint, i);
+    GstBuffer *buffer;
+    gboolean gop_start = FALSE;
+
+    while (nal < stream->nals->len &&
+        g_array_index (stream->nals, BenchNal, nal).offset < pos + len) {
+      BenchNal *n = &g_array_index (stream->nals, BenchNal, nal);
+
+      if ((stream->data[n->offset] & 0x1f) == NAL_SPS)
+        gop_start = TRUE;
+      nal++;
+    }
+
+    buffer = gst_buffer_new_and_alloc (len);
+    memcpy (GST_BUFFER_DATA (buffer), stream->data + pos, len);
+    pos += len;
+
+    if (gop == NULL || (reverse && gop_start)) {
+      gop = g_ptr_array_new ();
+      g_ptr_array_add (gops, gop);
+      GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DISCONT);
+    }
+    g_ptr_array_add (gop, buffer);
+  }
+
+  for (i = 0; i < gops->len; i++) {
+    GPtrArray *g = g_ptr_array_index (gops, reverse ? gops->len - 1 - i : i);
+    guint j;
+
+    for (j = 0; j < g->len; j++)
+      g_ptr_array_add (buffers, g_ptr_array_index (g, j));
+    g_ptr_array_free (g, TRUE);
+  }
+  g_ptr_array_free (gops, TRUE);
+
+  return buffers;
+}
+
+/* push the stream through a new parser and return the seconds it took */
+static gdouble
+bench_parse_once (BenchStream * stream, GArray * chunks, GstCaps * caps,
+    gboolean reverse, GstH264ParseOutput output)
+{
+  GstElement *element;
+  GstPad *srcpad, *sinkpad;
+  GPtrArray *buffers;
+  GstClockTime start, end;
+  guint i;
+
+  element = gst_element_factory_make ("h264parse", NULL);
+  g_object_set (element, "output", output, NULL);
+  srcpad = gst_element_get_static_pad (element, "src");
+  sinkpad = gst_element_get_static_pad (element, "sink");
+  gst_pad_link (srcpad, bench_pad);
+  gst_element_set_state (element, GST_STATE_PAUSED);
+
+  if (caps)
+    gst_pad_set_caps (sinkpad, caps);
+  if (reverse)
+    gst_pad_send_event (sinkpad, gst_event_new_new_segment (FALSE, -1.0,
+            GST_FORMAT_TIME, 0, -1, 0));
+
+  buffers = bench_make_buffers (stream, chunks, reverse);
+  bench_outputs = 0;
+
+  start = gst_util_get_timestamp ();
+  for (i = 0; i < buffers->len; i++)
+    gst_pad_chain (sinkpad, g_ptr_array_index (buffers, i));
+  gst_pad_send_event (sinkpad, gst_event_new_eos ());
+  end = gst_util_get_timestamp ();
+
+  if (bench_outputs == 0)
+    g_printerr ("parser did not output anything\n");
+
+  g_ptr_array_free (buffers, TRUE);
+  gst_element_set_state (element, GST_STATE_NULL);
+  gst_pad_unlink (srcpad, bench_pad);
+  gst_object_unref (srcpad);
+  gst_object_unref (sinkpad);
+  gst_object_unref (element);
+
+  return (end - start) / (gdouble) GST_SECOND;
+}
+
+static void
+bench_parse (const gchar * name, BenchStream * stream, GArray * chunks,
+    GstCaps * caps, gboolean reverse, GstH264ParseOutput output)
+{
+  gdouble best = G_MAXDOUBLE;
+  gint i;
+
+  for (i = 0; i < bench_repeats; i++)
+    best = MIN (best, bench_parse_once (stream, chunks, caps, reverse,
+            output));
+  bench_report (name, stream, best);
+}
+
+static void
+bench_scan (const gchar * name, BenchStream * stream, GstH264ScanFunc scan)
+{
+  gdouble best = G_MAXDOUBLE;
+  guint found = 0;
+  gint i;
+
+  for (i = 0; i < bench_repeats; i++) {
+    GstClockTime start;
+    guint pos = 0;
+
+    found = 0;
+    start = gst_util_get_timestamp ();
+    while (pos < stream->size) {
+      pos += scan (stream->data + pos, stream->size - pos);
+      if (pos >= stream->size)
+        break;
+      found++;
+      pos += 3;
+    }
+    best = MIN (best, (gst_util_get_timestamp () - start) /
+        (gdouble) GST_SECOND);
+  }
+  if (found != stream->nals->len)
+    g_printerr ("%s: found %u of %u start codes\n", name, found,
+        stream->nals->len);
+  bench_report (name, stream, best);
+}
+
+/* read the whole NAL units as Exp-Golomb codes */
+static void
+bench_bs (const gchar * name, BenchStream * stream)
+{
+  gdouble best = G_MAXDOUBLE;
+  volatile guint sum = 0;
+  gint i;
+
+  for (i = 0; i < bench_repeats; i++) {
+    GstClockTime start;
+    guint j;
+
+    start = gst_util_get_timestamp ();
+    for (j = 0; j < stream->nals->len; j++) {
+      BenchNal *nal = &g_array_index (stream->nals, BenchNal, j);
+      GstNalBs bs;
+
+      gst_nal_bs_init (&bs, stream->data + nal->offset, nal->size);
+      while (!gst_nal_bs_eos (&bs))
+        sum += gst_nal_bs_read_ue (&bs) + gst_nal_bs_read (&bs, 3);
+    }
+    best = MIN (best, (gst_util_get_timestamp () - start) /
+        (gdouble) GST_SECOND);
+  }
+  bench_report (name, stream, best);
+}
+
+static void
+bench_stream (const gchar * name, BenchStream * stream)
+{
+  static const guint block_sizes[] = { 188, 64 * 1024, 4 * 1024 * 1024 };
+  gchar *case_name;
+  GArray *chunks;
+  guint i;
+
+  case_name = g_strdup_printf ("%s scan c", name);
+  bench_scan (case_name, stream, gst_h264_scan_start_code_c);
+  g_free (case_name);
+  if (gst_h264_scan_start_code != gst_h264_scan_start_code_c) {
+    case_name = g_strdup_printf ("%s scan simd", name);
+    bench_scan (case_name, stream, gst_h264_scan_start_code);
+    g_free (case_name);
+  }
+  case_name = g_strdup_printf ("%s bitstream", name);
+  bench_bs (case_name, stream);
+  g_free (case_name);
+
+  for (i = 0; i < G_N_ELEMENTS (block_sizes); i++) {
+    chunks = bench_blocks (stream, block_sizes[i]);
+    case_name = g_strdup_printf ("%s forward nal %u", name, block_sizes[i]);
+    bench_parse (case_name, stream, chunks, NULL, FALSE,
+        GST_H264_PARSE_OUTPUT_NAL);
+    g_free (case_name);
+    case_name = g_strdup_printf ("%s forward au %u", name, block_sizes[i]);
+    bench_parse (case_name, stream, chunks, NULL, FALSE,
+        GST_H264_PARSE_OUTPUT_AU);
+    g_free (case_name);
+    g_array_free (chunks, TRUE);
+  }
+
+  chunks = bench_frames (stream);
+  case_name = g_strdup_printf ("%s reverse", name);
+  bench_parse (case_name, stream, chunks, NULL, TRUE,
+      GST_H264_PARSE_OUTPUT_NAL);
+  g_free (case_name);
+  g_array_free (chunks, TRUE);
+
+  for (i = 1; i <= 4; i++) {
+    BenchStream *avc;
+    GstCaps *caps;
+
+    /* the NAL unit sizes have to fit */
+    if (i < 4 && stream->max_nal_size >= (1U << (8 * i)))
+      continue;
+
+    chunks = g_array_new (FALSE, FALSE, sizeof (guint));
+    avc = bench_packetize (stream, i, &caps, chunks);
+    case_name = g_strdup_printf ("%s packetized %u nal", name, i);
+    bench_parse (case_name, avc, chunks, caps, FALSE,
+        GST_H264_PARSE_OUTPUT_NAL);
+    g_free (case_name);
+    case_name = g_strdup_printf ("%s packetized %u au", name, i);
+    bench_parse (case_name, avc, chunks, caps, FALSE,
+        GST_H264_PARSE_OUTPUT_AU);
+    g_free (case_name);
+    gst_caps_unref (caps);
+    bench_free_stream (avc);
+    g_array_free (chunks, TRUE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  GOptionContext *ctx;
+  GError *err = NULL;
+  guint size;
+  gint i;
+
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+
+  ctx = g_option_context_new ("[FILE...] - benchmark the h264 parser");
+  g_option_context_add_main_entries (ctx, bench_options, NULL);
+  g_option_context_add_group (ctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (ctx, &argc, &argv, &err)) {
+    g_printerr ("%s\n", err->message);
+    g_error_free (err);
+    return 1;
+  }
+  g_option_context_free (ctx);
+
+  gst_plugin_register_static (GST_VERSION_MAJOR, GST_VERSION_MINOR,
+      "h264parse", "Element parsing raw h264 streams", plugin_init, VERSION,
+      "LGPL", "h264parse-bench", GST_PACKAGE_NAME, GST_PACKAGE_ORIGIN);
+
+  bench_pad = gst_pad_new ("bench", GST_PAD_SINK);
+  gst_pad_set_chain_function (bench_pad, bench_chain);
+  gst_pad_set_chain_list_function (bench_pad, bench_chain_list);
+  gst_pad_set_event_function (bench_pad, bench_event);
+  gst_pad_set_setcaps_function (bench_pad, bench_setcaps);
+  gst_pad_set_active (bench_pad, TRUE);
+
+  size = MAX (bench_size, 1) * 1024 * 1024;
+  bench_repeats = MAX (bench_repeats, 1);
+  g_random_set_seed (0x264);
+
+  if (argc > 1) {
+    for (i = 1; i < argc; i++) {
+      BenchStream *stream;
+
+      if (!(stream = bench_load_stream (argv[i])))
+        return 1;
+      bench_stream (argv[i], stream);
+      bench_free_stream (stream);
+    }
+  } else {
+    static const struct
+    {
+      const gchar *name;
+      guint slices;
+      gboolean sync4;
+      guint max_slice;
+    } cases[] = {
+      {"1 slice, 3 byte sync", 1, FALSE, 200},
+      {"1 slice, 4 byte sync", 1, TRUE, 200},
+      {"8 slices, 3 byte sync", 8, FALSE, 200},
+      {"1 slice, large", 1, FALSE, 60000},
+      {"8 slices, large", 8, TRUE, 8000},
+    };
+
+    for (i = 0; i < G_N_ELEMENTS (cases); i++) {
+      BenchStream *stream;
+
+      stream = bench_make_stream (size, cases[i].slices, cases[i].sync4,
+          cases[i].max_slice);
+      bench_stream (cases[i].name, stream);
+      bench_free_stream (stream);
+    }
+  }
+
+  gst_object_unref (bench_pad);
+
+  return 0;
+}
@@ -0,0 +1,626 @@
+/* GStreamer h264 parser checks
+ * Copyright (C) 2005 Michal Benes <michal.benes@itonis.tv>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Pushes small synthetic streams through the parser and checks what comes
+ * out. The element is compiled in so that the checks can also look at its
+ * state. Returns non-zero when a check fails.
+ *
+ *   h264parse-check
+ */
+
+#include "gsth264parse.c"
+
+/* pad we link to the parser, keeps what it pushes */
+static GstPad *check_pad;
+static GPtrArray *check_outputs;
+static gint check_failures;
+
+#define CHECK(expr) G_STMT_START {                                      \
+  if (!(expr)) {                                                        \
+    g_printerr ("%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+    check_failures++;                                                   \
+  }                                                                     \
+} G_STMT_END
+
+/* bit writer for the parameter sets and slice headers */
+typedef struct
+{
+  guint8 data[32];
+  guint bits;
+} CheckBits;
+
+static void
+check_put_u (CheckBits * bits, guint32 value, guint n)
+{
+  while (n--) {
+    if ((value >> n) & 1)
+      bits->data[bits->bits / 8] |= 0x80 >> (bits->bits % 8);
+    bits->bits++;
+  }
+}
+
+static void
+check_put_ue (CheckBits * bits, guint32 value)
+{
+  guint n = 0;
+
+  value++;
+  while ((value >> n) > 1)
+    n++;
+  bits->bits += n;
+  check_put_u (bits, value, n + 1);
+}
+
+/* a NAL unit of a stream we build, without sync code or NALU size */
+typedef struct
+{
+  guint8 data[64];
+  guint size;
+} CheckNal;
+
+/* rbsp_trailing_bits, the NAL unit gets the @header and @bits */
+static void
+check_finish_nal (CheckNal * nal, guint8 header, CheckBits * bits)
+{
+  guint size;
+
+  check_put_u (bits, 1, 1);
+  size = (bits->bits + 7) / 8;
+  nal->data[0] = header;
+  memcpy (nal->data + 1, bits->data, size);
+  nal->size = 1 + size;
+}
+
+/* 320x240 baseline, frame_num of 4 bits, POC type 2 */
+static void
+check_make_sps (CheckNal * nal)
+{
+  CheckBits bits = { {0,}, 0 };
+
+  check_put_u (&bits, 66, 8);
+  check_put_u (&bits, 0, 8);
+  check_put_u (&bits, 30, 8);
+  check_put_ue (&bits, 0);
+  check_put_ue (&bits, 0);
+  check_put_ue (&bits, 2);
+  check_put_ue (&bits, 1);
+  check_put_u (&bits, 0, 1);
+  check_put_ue (&bits, 19);
+  check_put_ue (&bits, 14);
+  check_put_u (&bits, 1, 1);
+  check_put_u (&bits, 1, 1);
+  check_put_u (&bits, 0, 2);
+  check_finish_nal (nal, 0x67, &bits);
+}
+
+static void
+check_make_pps (CheckNal * nal)
+{
+  CheckBits bits = { {0,}, 0 };
+
+  check_put_ue (&bits, 0);
+  check_put_ue (&bits, 0);
+  check_put_u (&bits, 0, 2);
+  check_put_ue (&bits, 0);
+  check_put_ue (&bits, 0);
+  check_put_ue (&bits, 0);
+  check_put_u (&bits, 0, 3);
+  check_put_ue (&bits, 0);
+  check_put_ue (&bits, 0);
+  check_put_ue (&bits, 0);
+  check_put_u (&bits, 4, 3);
+  check_finish_nal (nal, 0x68, &bits);
+}
+
+/* a slice of a whole picture with some slice data after the header, the
+ * @slice_type is 2 for I and 0 for P */
+static void
+check_make_slice (CheckNal * nal, gboolean idr, guint slice_type,
+    guint frame_num)
+{
+  CheckBits bits = { {0,}, 0 };
+  guint i;
+
+  check_put_ue (&bits, 0);
+  check_put_ue (&bits, slice_type + 5);
+  check_put_ue (&bits, 0);
+  check_put_u (&bits, frame_num % 16, 4);
+  if (idr)
+    check_put_ue (&bits, 0);
+  /* slice data without 0 bytes */
+  for (i = 0; i < 8; i++)
+    check_put_u (&bits, 0x5a, 8);
+  check_finish_nal (nal, idr ? 0x65 : 0x41, &bits);
+}
+
+/* a recovery point SEI with a recovery_frame_cnt of @count */
+static void
+check_make_recovery_sei (CheckNal * nal, guint count)
+{
+  CheckBits payload = { {0,}, 0 };
+  CheckBits bits = { {0,}, 0 };
+  guint size, i;
+
+  check_put_ue (&payload, count);
+  check_put_u (&payload, 1, 1);
+  check_put_u (&payload, 0, 1);
+  check_put_u (&payload, 0, 2);
+  /* bit_equal_to_one and bit_equal_to_zero up to the byte boundary */
+  check_put_u (&payload, 1, 1);
+  size = (payload.bits + 7) / 8;
+
+  check_put_u (&bits, SEI_RECOVERY_POINT, 8);
+  check_put_u (&bits, size, 8);
+  for (i = 0; i < size; i++)
+    check_put_u (&bits, payload.data[i], 8);
+  check_finish_nal (nal, 0x06, &bits);
+}
+
+/* a packetized buffer with the @n_nals NAL units in @nals prefixed with their
+ * size in @len bytes */
+static GstBuffer *
+check_packetize (const CheckNal * nals, guint n_nals, guint len,
+    GstClockTime timestamp)
+{
+  GstBuffer *buffer;
+  guint8 *p;
+  guint i, size = 0;
+
+  for (i = 0; i < n_nals; i++)
+    size += len + nals[i].size;
+  buffer = gst_buffer_new_and_alloc (size);
+  p = GST_BUFFER_DATA (buffer);
+  for (i = 0; i < n_nals; i++) {
+    gst_h264_parse_write_nalu_size (p, len, nals[i].size);
+    memcpy (p + len, nals[i].data, nals[i].size);
+    p += len + nals[i].size;
+  }
+  GST_BUFFER_TIMESTAMP (buffer) = timestamp;
+
+  return buffer;
+}
+
+/* avc caps with the SPS and PPS in the codec_data and NALU sizes of @len
+ * bytes */
+static GstCaps *
+check_avc_caps (guint len)
+{
+  CheckNal sps, pps;
+  GstBuffer *avcc;
+  GstCaps *caps;
+  guint8 *p;
+
+  check_make_sps (&sps);
+  check_make_pps (&pps);
+
+  avcc = gst_buffer_new_and_alloc (11 + sps.size + pps.size);
+  p = GST_BUFFER_DATA (avcc);
+  p[0] = 1;
+  p[1] = sps.data[1];
+  p[2] = sps.data[2];
+  p[3] = sps.data[3];
+  p[4] = 0xfc | (len - 1);
+  p[5] = 0xe0 | 1;
+  GST_WRITE_UINT16_BE (p + 6, sps.size);
+  memcpy (p + 8, sps.data, sps.size);
+  p += 8 + sps.size;
+  p[0] = 1;
+  GST_WRITE_UINT16_BE (p + 1, pps.size);
+  memcpy (p + 3, pps.data, pps.size);
+
+  caps = gst_caps_new_simple ("video/x-h264", "codec_data", GST_TYPE_BUFFER,
+      avcc, NULL);
+  gst_buffer_unref (avcc);
+
+  return caps;
+}
+
+static GstFlowReturn
+check_chain (GstPad * pad, GstBuffer * buffer)
+{
+  g_ptr_array_add (check_outputs, buffer);
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+check_chain_list (GstPad * pad, GstBufferList * list)
+{
+  GstBufferListIterator *it;
+
+  /* every group is one output buffer */
+  it = gst_buffer_list_iterate (list);
+  while (gst_buffer_list_iterator_next_group (it))
+    g_ptr_array_add (check_outputs, gst_buffer_list_iterator_merge_group (it));
+  gst_buffer_list_iterator_free (it);
+  gst_buffer_list_unref (list);
+  return GST_FLOW_OK;
+}
+
+static gboolean
+check_event (GstPad * pad, GstEvent * event)
+{
+  gst_event_unref (event);
+  return TRUE;
+}
+
+static gboolean
+check_setcaps (GstPad * pad, GstCaps * caps)
+{
+  return TRUE;
+}
+
+static GstElement *
+check_start (GstCaps * caps)
+{
+  GstElement *element;
+  GstPad *srcpad, *sinkpad;
+
+  element = gst_element_factory_make ("h264parse", NULL);
+  srcpad = gst_element_get_static_pad (element, "src");
+  gst_pad_link (srcpad, check_pad);
+  gst_object_unref (srcpad);
+  gst_element_set_state (element, GST_STATE_PAUSED);
+
+  if (caps) {
+    sinkpad = gst_element_get_static_pad (element, "sink");
+    gst_pad_set_caps (sinkpad, caps);
+    gst_object_unref (sinkpad);
+  }
+  g_ptr_array_set_size (check_outputs, 0);
+
+  return element;
+}
+
+static void
+check_push (GstElement * element, GstBuffer * buffer)
+{
+  GstPad *sinkpad;
+
+  sinkpad = gst_element_get_static_pad (element, "sink");
+  CHECK (gst_pad_chain (sinkpad, buffer) == GST_FLOW_OK);
+  gst_object_unref (sinkpad);
+}
+
+static void
+check_stop (GstElement * element)
+{
+  GstPad *srcpad, *sinkpad;
+
+  sinkpad = gst_element_get_static_pad (element, "sink");
+  gst_pad_send_event (sinkpad, gst_event_new_eos ());
+  gst_object_unref (sinkpad);
+
+  gst_element_set_state (element, GST_STATE_NULL);
+  srcpad = gst_element_get_static_pad (element, "src");
+  gst_pad_unlink (srcpad, check_pad);
+  gst_object_unref (srcpad);
+  gst_object_unref (element);
+}
+
+static void
+check_clear_outputs (void)
+{
+  g_ptr_array_foreach (check_outputs, (GFunc) gst_mini_object_unref, NULL);
+  g_ptr_array_set_size (check_outputs, 0);
+}
+
+/* TRUE when @buffer is a sequence of NAL units with @len byte sizes, the
+ * type of the first one is returned in @first_type and of the last one in
+ * @last_type */
+static gboolean
+check_is_packetized (GstBuffer * buffer, guint len, gint * first_type,
+    gint * last_type)
+{
+  const guint8 *data = GST_BUFFER_DATA (buffer);
+  guint size = GST_BUFFER_SIZE (buffer);
+  guint pos = 0, nalu_size, i;
+
+  *first_type = -1;
+  *last_type = -1;
+  while (pos < size) {
+    if (size - pos <= len)
+      return FALSE;
+    for (nalu_size = 0, i = 0; i < len; i++)
+      nalu_size = (nalu_size << 8) | data[pos + i];
+    if (nalu_size == 0 || nalu_size > size - pos - len)
+      return FALSE;
+    if (*first_type < 0)
+      *first_type = data[pos + len] & 0x1f;
+    *last_type = data[pos + len] & 0x1f;
+    pos += len + nalu_size;
+  }
+  return pos == size;
+}
+
+/* the SPS and PPS that config-interval inserts in avc that is passed through
+ * have the NALU size length of the codec_data and are in the sample of the
+ * IDR frame */
+static void
+check_config_interval_avc (void)
+{
+  GstElement *element;
+  GstCaps *caps;
+  CheckNal slice;
+  guint i, n_sps = 0;
+
+  caps = check_avc_caps (2);
+  element = check_start (caps);
+  g_object_set (element, "config-interval", 1, NULL);
+
+  /* an IDR frame every 30 frames of 25 fps */
+  for (i = 0; i < 60; i++) {
+    check_make_slice (&slice, i % 30 == 0, i % 30 == 0 ? 2 : 0, i);
+    check_push (element, check_packetize (&slice, 1, 2, i * GST_SECOND / 25));
+  }
+  check_stop (element);
+  gst_caps_unref (caps);
+
+  CHECK (check_outputs->len == 60);
+  for (i = 0; i < check_outputs->len; i++) {
+    gint type, last_type;
+
+    CHECK (check_is_packetized (g_ptr_array_index (check_outputs, i), 2,
+            &type, &last_type));
+    if (type == NAL_SPS) {
+      CHECK (last_type == NAL_SLICE_IDR);
+      n_sps++;
+    }
+  }
+  CHECK (n_sps == 2);
+  check_clear_outputs ();
+}
+
+/* a packetized buffer with an invalid NALU size in front of @nal */
+static GstBuffer *
+check_corrupt (const CheckNal * nal, GstClockTime timestamp)
+{
+  GstBuffer *buffer, *corrupt;
+
+  buffer = check_packetize (nal, 1, 4, timestamp);
+  corrupt = gst_buffer_new_and_alloc (6 + GST_BUFFER_SIZE (buffer));
+  memset (GST_BUFFER_DATA (corrupt), 0xff, 6);
+  memcpy (GST_BUFFER_DATA (corrupt) + 6, GST_BUFFER_DATA (buffer),
+      GST_BUFFER_SIZE (buffer));
+  GST_BUFFER_TIMESTAMP (corrupt) = timestamp;
+  gst_buffer_unref (buffer);
+
+  return corrupt;
+}
+
+/* a stream without IDR frames recovers from corrupt data at the next I frame
+ * and at the next recovery point, also without recovery-points */
+static void
+check_resync_without_idr (void)
+{
+  static const guint expected[] = { 0, 1, 2, 3, 7, 8, 9, 12, 13 };
+  GstElement *element;
+  GstCaps *caps;
+  CheckNal nals[2];
+  guint i;
+
+  caps = check_avc_caps (4);
+  element = check_start (caps);
+
+  for (i = 0; i < 14; i++) {
+    GstClockTime timestamp = i * GST_SECOND / 25;
+
+    check_make_slice (&nals[0], FALSE, (i == 0 || i == 7) ? 2 : 0, i);
+    if (i == 4 || i == 10) {
+      check_push (element, check_corrupt (&nals[0], timestamp));
+    } else if (i == 12) {
+      nals[1] = nals[0];
+      check_make_recovery_sei (&nals[0], 0);
+      check_push (element, check_packetize (nals, 2, 4, timestamp));
+    } else {
+      check_push (element, check_packetize (nals, 1, 4, timestamp));
+    }
+  }
+  check_stop (element);
+  gst_caps_unref (caps);
+
+  CHECK (check_outputs->len == G_N_ELEMENTS (expected));
+  for (i = 0; i < MIN (check_outputs->len, G_N_ELEMENTS (expected)); i++) {
+    GstBuffer *buffer = g_ptr_array_index (check_outputs, i);
+
+    CHECK (GST_BUFFER_TIMESTAMP (buffer) == expected[i] * GST_SECOND / 25);
+  }
+  check_clear_outputs ();
+}
+
+/* one bytestream buffer with a SPS, a PPS and @n_frames frames, with 3 and 4
+ * byte sync codes and trailing zeros */
+static GstBuffer *
+check_make_bytestream (guint n_frames)
+{
+  CheckNal nal;
+  GstBuffer *buffer;
+  guint8 *p;
+  guint i, zeros;
+
+  buffer = gst_buffer_new_and_alloc ((n_frames + 2) * (sizeof (nal.data) + 6));
+  p = GST_BUFFER_DATA (buffer);
+  for (i = 0; i < n_frames + 2; i++) {
+    if (i == 0)
+      check_make_sps (&nal);
+    else if (i == 1)
+      check_make_pps (&nal);
+    else
+      check_make_slice (&nal, (i - 2) % 30 == 0, (i - 2) % 30 == 0 ? 2 : 0,
+          i - 2);
+
+    zeros = (i % 3 == 0) ? 3 : 2;
+    memset (p, 0, zeros);
+    p[zeros] = 1;
+    memcpy (p + zeros + 1, nal.data, nal.size);
+    p += zeros + 1 + nal.size;
+    if (i % 7 == 0) {
+      memset (p, 0, 2);
+      p += 2;
+    }
+  }
+  GST_BUFFER_SIZE (buffer) = p - GST_BUFFER_DATA (buffer);
+  GST_BUFFER_TIMESTAMP (buffer) = 0;
+
+  return buffer;
+}
+
+/* push @buffer through a parser that searches it with @scan_threads threads,
+ * the pool is only started in pull mode so we start it ourselves */
+static GPtrArray *
+check_scan_outputs (GstBuffer * buffer, guint scan_threads)
+{
+  GstElement *element;
+  GPtrArray *outputs;
+
+  element = check_start (NULL);
+  g_object_set (element, "scan-threads", scan_threads, NULL);
+  gst_h264_parse_start_scan_pool (GST_H264PARSE (element));
+  CHECK ((scan_threads > 1) == (GST_H264PARSE (element)->scan_pool != NULL));
+  check_push (element, buffer);
+  gst_h264_parse_stop_scan_pool (GST_H264PARSE (element));
+  check_stop (element);
+
+  outputs = check_outputs;
+  check_outputs = g_ptr_array_new ();
+
+  return outputs;
+}
+
+/* the sync codes the scan threads find give the same output as the search
+ * of the whole buffer */
+static void
+check_parallel_scan (void)
+{
+  GstBuffer *buffer;
+  GPtrArray *sequential, *parallel;
+  guint i;
+
+  buffer = check_make_bytestream (20000);
+  CHECK (GST_BUFFER_SIZE (buffer) >= 4 * PARALLEL_SCAN_MIN_SIZE);
+
+  sequential = check_scan_outputs (gst_buffer_ref (buffer), 1);
+  parallel = check_scan_outputs (buffer, 4);
+
+  CHECK (sequential->len > 20000);
+  CHECK (parallel->len == sequential->len);
+  for (i = 0; i < MIN (parallel->len, sequential->len); i++) {
+    GstBuffer *a = g_ptr_array_index (sequential, i);
+    GstBuffer *b = g_ptr_array_index (parallel, i);
+
+    CHECK (GST_BUFFER_SIZE (a) == GST_BUFFER_SIZE (b) &&
+        memcmp (GST_BUFFER_DATA (a), GST_BUFFER_DATA (b),
+            GST_BUFFER_SIZE (a)) == 0);
+  }
+
+  g_ptr_array_foreach (sequential, (GFunc) gst_mini_object_unref, NULL);
+  g_ptr_array_free (sequential, TRUE);
+  g_ptr_array_foreach (parallel, (GFunc) gst_mini_object_unref, NULL);
+  g_ptr_array_free (parallel, TRUE);
+}
+
+/* TRUE when @element knows the SPS and PPS of check_avc_caps() */
+static gboolean
+check_has_params (GstElement * element)
+{
+  GstH264Parse *h264parse = GST_H264PARSE (element);
+
+  return h264parse->sps[0] != NULL && h264parse->pps[0] != NULL;
+}
+
+/* an avcC that announces a second PPS it doesn't have is accepted with the
+ * parameter sets in front of the cut */
+static void
+check_truncated_avcc (void)
+{
+  GstElement *element;
+  GstStructure *s;
+  GstBuffer *truncated;
+  GstCaps *caps;
+  GstPad *sinkpad;
+  CheckNal sps;
+
+  caps = check_avc_caps (4);
+  s = gst_caps_get_structure (caps, 0);
+  truncated = gst_buffer_copy (gst_value_get_buffer (gst_structure_get_value
+          (s, "codec_data")));
+  check_make_sps (&sps);
+  GST_BUFFER_DATA (truncated)[8 + sps.size] = 2;
+  gst_structure_set (s, "codec_data", GST_TYPE_BUFFER, truncated, NULL);
+  gst_buffer_unref (truncated);
+
+  element = check_start (NULL);
+  sinkpad = gst_element_get_static_pad (element, "sink");
+  CHECK (gst_pad_set_caps (sinkpad, caps));
+  gst_object_unref (sinkpad);
+  CHECK (check_has_params (element));
+  check_stop (element);
+  gst_caps_unref (caps);
+}
+
+/* the parameter sets of the codec_data are still known after a stop, the
+ * sink caps are not set again */
+static void
+check_restart_avc (void)
+{
+  GstElement *element;
+  GstCaps *caps;
+
+  caps = check_avc_caps (4);
+  element = check_start (caps);
+  gst_element_set_state (element, GST_STATE_READY);
+  gst_element_set_state (element, GST_STATE_PAUSED);
+  CHECK (check_has_params (element));
+  check_stop (element);
+  gst_caps_unref (caps);
+}
+
+int
+main (int argc, char *argv[])
+{
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+  gst_init (&argc, &argv);
+
+  gst_plugin_register_static (GST_VERSION_MAJOR, GST_VERSION_MINOR,
+      "h264parse", "Element parsing raw h264 streams", plugin_init, VERSION,
+      "LGPL", "h264parse-check", GST_PACKAGE_NAME, GST_PACKAGE_ORIGIN);
+
+  check_outputs = g_ptr_array_new ();
+  check_pad = gst_pad_new ("check", GST_PAD_SINK);
+  gst_pad_set_chain_function (check_pad, check_chain);
+  gst_pad_set_chain_list_function (check_pad, check_chain_list);
+  gst_pad_set_event_function (check_pad, check_event);
+  gst_pad_set_setcaps_function (check_pad, check_setcaps);
+  gst_pad_set_active (check_pad, TRUE);
+
+  check_config_interval_avc ();
+  check_resync_without_idr ();
+  check_parallel_scan ();
+  check_truncated_avcc ();
+  check_restart_avc ();
+
+  gst_object_unref (check_pad);
+  g_ptr_array_free (check_outputs, TRUE);
+
+  if (check_failures > 0) {
+    g_printerr ("%d checks failed\n", check_failures);
+    return 1;
+  }
+  return 0;
+}